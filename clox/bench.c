@@ -0,0 +1,239 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define DEFAULT_WARMUP 10
+#define DEFAULT_SAMPLES 30
+// Each sample calls the function enough times to take at least this
+// long, so that the resolution of the clock does not matter
+#define DEFAULT_SAMPLE_TIME 0.01
+
+// Upper bounds that keep a badly chosen option from running forever
+#define MAX_SAMPLES 100000
+#define MAX_ITERATIONS (1 << 30)
+#define MAX_WARMUP MAX_ITERATIONS
+// Seconds after which warming up and measuring stop early, whatever
+// the options ask for. Only checked between calls.
+#define MAX_BENCH_TIME 60.0
+
+static uint64_t nanoTime() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+// Nanoseconds on a monotonic clock, only meaningful when compared to
+// another reading from the same process
+static Value clockNanosNative(int argCount, Value* args) {
+  return NUMBER_VAL((double)nanoTime());
+}
+
+// Resolution of clockNanos() in nanoseconds
+static Value clockResolutionNative(int argCount, Value* args) {
+  struct timespec resolution;
+  clock_getres(CLOCK_MONOTONIC, &resolution);
+  return NUMBER_VAL((double)resolution.tv_sec * 1e9 + resolution.tv_nsec);
+}
+
+static bool findOption(ObjInstance* options, const char* name, Value* field) {
+  ObjString* key = copyString(name, (int)strlen(name));
+  return tableGet(&options->fields, key, field);
+}
+
+// Reads a positive number from a field of the options instance,
+// leaving the value untouched if the field is not there
+static bool readOption(ObjInstance* options, const char* name, double* value) {
+  Value field;
+  if (!findOption(options, name, &field)) return true;
+
+  if (!IS_NUMBER(field) || AS_NUMBER(field) <= 0) {
+    nativeError("Benchmark option '%s' must be a positive number.", name);
+    return false;
+  }
+
+  *value = AS_NUMBER(field);
+  return true;
+}
+
+// Reads a whole count of at least min from a field of the options
+// instance, capped at max so that it fits in an int
+static bool readCountOption(ObjInstance* options, const char* name, int min, int max,
+                            int* value) {
+  Value field;
+  if (!findOption(options, name, &field)) return true;
+
+  if (!IS_NUMBER(field) || AS_NUMBER(field) < min ||
+      AS_NUMBER(field) != floor(AS_NUMBER(field))) {
+    nativeError("Benchmark option '%s' must be an integer of at least %d.", name, min);
+    return false;
+  }
+
+  double number = AS_NUMBER(field);
+  *value = number > max ? max : (int)number;
+  return true;
+}
+
+// Calls the function the given number of times, returning the
+// elapsed nanoseconds, or -1 if the function raised an error
+static double runIterations(Value function, int iterations) {
+  uint64_t start = nanoTime();
+  for (int i = 0; i < iterations; i++) {
+    Value ignored;
+    if (!callFunction(function, 0, NULL, &ignored)) return -1;
+  }
+  return (double)(nanoTime() - start);
+}
+
+// Same as runIterations(), but gives up on the remaining calls once
+// the deadline has passed, as nothing is measured
+static bool warmUp(Value function, int iterations, uint64_t deadline) {
+  for (int i = 0; i < iterations && nanoTime() < deadline; i++) {
+    Value ignored;
+    if (!callFunction(function, 0, NULL, &ignored)) return false;
+  }
+  return true;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void setField(ObjInstance* instance, const char* name, double value) {
+  // The key is kept on the stack while the table grows
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  tableSet(&instance->fields, AS_STRING(vm.stackTop[-1]), NUMBER_VAL(value));
+  pop();
+}
+
+// bench(fn) or bench(fn, options) calls fn without arguments over and
+// over and returns an instance with statistics about the time (in
+// nanoseconds) and memory that a single call takes.
+//
+// The options are read from the fields of an instance: warmup (calls
+// made before measuring), samples (number of measurements) and
+// sampleTime (minimum seconds per measurement). The number of calls
+// per measurement is doubled until a measurement takes at least
+// sampleTime, unless an explicit iterations field is given.
+//
+// However the options are set, a benchmark stops warming up and
+// measuring after MAX_BENCH_TIME seconds. It always takes at least one
+// sample, and the samples field of the result tells how many it took.
+static Value benchNative(int argCount, Value* args) {
+  if (argCount != 1 && argCount != 2) {
+    return nativeError("Expected 1 or 2 arguments but got %d.", argCount);
+  }
+
+  Value function = args[0];
+  int warmup = DEFAULT_WARMUP;
+  int sampleCount = DEFAULT_SAMPLES;
+  double sampleTime = DEFAULT_SAMPLE_TIME;
+  // Zero until given, in which case it is found by doubling
+  int iterationCount = 0;
+
+  if (argCount == 2 && !IS_NIL(args[1])) {
+    if (!IS_INSTANCE(args[1])) {
+      return nativeError("Benchmark options must be an instance.");
+    }
+
+    ObjInstance* options = AS_INSTANCE(args[1]);
+    if (!readCountOption(options, "warmup", 0, MAX_WARMUP, &warmup) ||
+        !readCountOption(options, "samples", 1, MAX_SAMPLES, &sampleCount) ||
+        !readOption(options, "sampleTime", &sampleTime) ||
+        !readCountOption(options, "iterations", 1, MAX_ITERATIONS, &iterationCount)) {
+      return NIL_VAL;
+    }
+  }
+
+  uint64_t deadline = nanoTime() + (uint64_t)(MAX_BENCH_TIME * 1e9);
+  if (!warmUp(function, warmup, deadline)) return NIL_VAL;
+
+  if (iterationCount == 0) {
+    iterationCount = 1;
+    for (;;) {
+      double elapsed = runIterations(function, iterationCount);
+      if (elapsed < 0) return NIL_VAL;
+      if (elapsed >= sampleTime * 1e9 || iterationCount >= MAX_ITERATIONS ||
+          nanoTime() >= deadline) {
+        break;
+      }
+      iterationCount *= 2;
+    }
+  }
+
+  int capacity = sampleCount;
+  double* times = ALLOCATE(double, capacity);
+
+  size_t objectsBefore = vm.objectsAllocated;
+  size_t bytesBefore = vm.bytesRequested;
+
+  for (int i = 0; i < capacity; i++) {
+    if (i > 0 && nanoTime() >= deadline) {
+      sampleCount = i;
+      break;
+    }
+
+    double elapsed = runIterations(function, iterationCount);
+    if (elapsed < 0) {
+      FREE_ARRAY(double, times, capacity);
+      return NIL_VAL;
+    }
+    times[i] = elapsed / iterationCount;
+  }
+
+  double totalCalls = (double)sampleCount * iterationCount;
+  double objects = (vm.objectsAllocated - objectsBefore) / totalCalls;
+  double bytes = (vm.bytesRequested - bytesBefore) / totalCalls;
+
+  double sum = 0;
+  for (int i = 0; i < sampleCount; i++) sum += times[i];
+  double mean = sum / sampleCount;
+
+  double squares = 0;
+  for (int i = 0; i < sampleCount; i++) {
+    squares += (times[i] - mean) * (times[i] - mean);
+  }
+  double stddev = sampleCount > 1 ? sqrt(squares / (sampleCount - 1)) : 0;
+
+  qsort(times, sampleCount, sizeof(double), compareDoubles);
+  double median = sampleCount % 2 == 1
+      ? times[sampleCount / 2]
+      : (times[sampleCount / 2 - 1] + times[sampleCount / 2]) / 2;
+  double min = times[0];
+  double max = times[sampleCount - 1];
+  FREE_ARRAY(double, times, capacity);
+
+  push(OBJ_VAL(copyString("BenchResult", 11)));
+  ObjClass* klass = newClass(AS_STRING(vm.stackTop[-1]));
+  push(OBJ_VAL(klass));
+  ObjInstance* result = newInstance(klass);
+  push(OBJ_VAL(result));
+
+  setField(result, "mean", mean);
+  setField(result, "median", median);
+  setField(result, "stddev", stddev);
+  setField(result, "min", min);
+  setField(result, "max", max);
+  setField(result, "samples", sampleCount);
+  setField(result, "iterations", iterationCount);
+  setField(result, "allocations", objects);
+  setField(result, "bytes", bytes);
+
+  pop();
+  pop();
+  pop();
+  return OBJ_VAL(result);
+}
+
+void defineBenchNatives() {
+  defineNative("clockNanos", clockNanosNative, 0);
+  defineNative("clockResolution", clockResolutionNative, 0);
+  defineNative("bench", benchNative, -1);
+}
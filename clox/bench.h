@@ -0,0 +1,8 @@
+#ifndef clox_bench_h
+#define clox_bench_h
+
+// Registers the high resolution clock natives along with bench(),
+// which measures how long a function takes to run
+void defineBenchNatives();
+
+#endif
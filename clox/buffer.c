@@ -0,0 +1,306 @@
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "memory.h"
+#include "vm.h"
+
+// Numbers are read and written as one of these types, named like
+// "u8", "i32le" or "f64be". Types wider than a byte need an endianness.
+typedef enum {
+  NUMBER_SIGNED,
+  NUMBER_UNSIGNED,
+  NUMBER_FLOAT,
+} NumberKind;
+
+typedef struct {
+  NumberKind kind;
+  // In bytes
+  int size;
+  bool bigEndian;
+} NumberType;
+
+void freeBuffer(ObjBuffer* buffer) {
+  if (buffer->owner != NULL_REF) return;
+
+  if (buffer->mapped) {
+    munmap(buffer->bytes, buffer->length);
+  } else {
+    FREE_ARRAY(uint8_t, buffer->bytes, buffer->length);
+  }
+}
+
+static bool checkBuffer(Value value) {
+  if (!IS_BUFFER(value)) {
+    nativeError("Argument must be a buffer.");
+    return false;
+  }
+  return true;
+}
+
+// Returns false (after reporting the error) if the value is not an
+// offset at which size bytes fit into the buffer
+static bool checkOffset(ObjBuffer* buffer, Value offset, size_t size) {
+  if (!IS_NUMBER(offset)) {
+    nativeError("Buffer offset must be a number.");
+    return false;
+  }
+
+  double number = AS_NUMBER(offset);
+  if (number < 0 || number != floor(number) ||
+      number + size > (double)buffer->length) {
+    nativeError("Buffer offset out of bounds.");
+    return false;
+  }
+  return true;
+}
+
+static bool parseNumberType(Value value, NumberType* type) {
+  if (!IS_STRING(value)) {
+    nativeError("Number type must be a string.");
+    return false;
+  }
+  const char* name = AS_CSTRING(value);
+
+  switch (name[0]) {
+    case 'i': type->kind = NUMBER_SIGNED; break;
+    case 'u': type->kind = NUMBER_UNSIGNED; break;
+    case 'f': type->kind = NUMBER_FLOAT; break;
+    default: goto invalid;
+  }
+
+  const char* endianness;
+  if (strncmp(name + 1, "8", 1) == 0 && type->kind != NUMBER_FLOAT) {
+    type->size = 1;
+    endianness = name + 2;
+  } else if (strncmp(name + 1, "16", 2) == 0 && type->kind != NUMBER_FLOAT) {
+    type->size = 2;
+    endianness = name + 3;
+  } else if (strncmp(name + 1, "32", 2) == 0) {
+    type->size = 4;
+    endianness = name + 3;
+  } else if (strncmp(name + 1, "64", 2) == 0) {
+    type->size = 8;
+    endianness = name + 3;
+  } else {
+    goto invalid;
+  }
+
+  if (type->size == 1 && endianness[0] == '\0') {
+    type->bigEndian = false;
+    return true;
+  }
+  if (strcmp(endianness, "le") == 0 || strcmp(endianness, "be") == 0) {
+    type->bigEndian = endianness[0] == 'b';
+    return true;
+  }
+
+invalid:
+  nativeError("Unknown number type '%s'.", name);
+  return false;
+}
+
+static uint64_t loadBits(const uint8_t* bytes, NumberType* type) {
+  uint64_t bits = 0;
+  for (int i = 0; i < type->size; i++) {
+    int byte = type->bigEndian ? i : type->size - 1 - i;
+    bits = (bits << 8) | bytes[byte];
+  }
+  return bits;
+}
+
+static void storeBits(uint8_t* bytes, NumberType* type, uint64_t bits) {
+  for (int i = 0; i < type->size; i++) {
+    int byte = type->bigEndian ? type->size - 1 - i : i;
+    bytes[byte] = (uint8_t)bits;
+    bits >>= 8;
+  }
+}
+
+// Integers wider than 53 bits might not survive being turned into
+// a number exactly
+static double decodeNumber(uint64_t bits, NumberType* type) {
+  switch (type->kind) {
+    case NUMBER_UNSIGNED: return (double)bits;
+    case NUMBER_SIGNED: {
+      // Sign extend from the top bit of the type
+      int unused = 64 - 8 * type->size;
+      return (double)((int64_t)(bits << unused) >> unused);
+    }
+    case NUMBER_FLOAT:
+      if (type->size == 4) {
+        uint32_t narrow = (uint32_t)bits;
+        float number;
+        memcpy(&number, &narrow, sizeof(number));
+        return number;
+      } else {
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        return number;
+      }
+  }
+  return 0;
+}
+
+// Returns false (after reporting the error) if the number can't be
+// stored as the type without losing anything but float precision
+static bool encodeNumber(double number, NumberType* type, uint64_t* bits) {
+  if (type->kind == NUMBER_FLOAT) {
+    if (type->size == 4) {
+      float narrow = (float)number;
+      uint32_t narrowBits;
+      memcpy(&narrowBits, &narrow, sizeof(narrowBits));
+      *bits = narrowBits;
+    } else {
+      memcpy(bits, &number, sizeof(number));
+    }
+    return true;
+  }
+
+  // 2^(bits in the type), computed as a double so that 64 bits work
+  double range = ldexp(1, 8 * type->size);
+  double min = type->kind == NUMBER_SIGNED ? -range / 2 : 0;
+  double max = type->kind == NUMBER_SIGNED ? range / 2 : range;
+  if (number != floor(number) || number < min || number >= max) {
+    nativeError("Number doesn't fit the type.");
+    return false;
+  }
+
+  *bits = number < 0 ? (uint64_t)(int64_t)number : (uint64_t)number;
+  return true;
+}
+
+// buffer(length) creates a buffer of zeroes
+static Value bufferNative(int argCount, Value* args) {
+  if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 ||
+      AS_NUMBER(args[0]) != floor(AS_NUMBER(args[0]))) {
+    return nativeError("Buffer length must be a non-negative integer.");
+  }
+
+  size_t length = (size_t)AS_NUMBER(args[0]);
+  uint8_t* bytes = ALLOCATE(uint8_t, length);
+  memset(bytes, 0, length);
+  return OBJ_VAL(newBuffer(bytes, length));
+}
+
+// mapFile(path) returns a read-only buffer of the contents of a file,
+// which is mapped into memory rather than read, so that only the parts
+// that are used are ever loaded
+static Value mapFileNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) {
+    return nativeError("Path must be a string.");
+  }
+  const char* path = AS_CSTRING(args[0]);
+
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    if (fd >= 0) close(fd);
+    return nativeError("Could not open file \"%s\".", path);
+  }
+
+  // Empty files can't be mapped, but there is nothing to map anyway
+  void* bytes = NULL;
+  if (info.st_size > 0) {
+    bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (bytes == MAP_FAILED) {
+    return nativeError("Could not map file \"%s\".", path);
+  }
+
+  ObjBuffer* buffer = newBuffer(bytes, info.st_size);
+  buffer->mapped = info.st_size > 0;
+  buffer->readOnly = true;
+  return OBJ_VAL(buffer);
+}
+
+static Value bufferLengthNative(int argCount, Value* args) {
+  if (!checkBuffer(args[0])) return NIL_VAL;
+
+  return NUMBER_VAL((double)AS_BUFFER(args[0])->length);
+}
+
+// bufferSlice(buffer, start, end) returns a buffer of the bytes from
+// start up to end, which shares them with the original
+static Value bufferSliceNative(int argCount, Value* args) {
+  if (!checkBuffer(args[0])) return NIL_VAL;
+  ObjBuffer* buffer = AS_BUFFER(args[0]);
+  if (!checkOffset(buffer, args[1], 0) || !checkOffset(buffer, args[2], 0)) {
+    return NIL_VAL;
+  }
+
+  size_t start = (size_t)AS_NUMBER(args[1]);
+  size_t end = (size_t)AS_NUMBER(args[2]);
+  if (end < start) {
+    return nativeError("Slice end must not come before its start.");
+  }
+
+  ObjBuffer* slice = newBuffer(buffer->bytes + start, end - start);
+  slice->owner = buffer->owner != NULL_REF ? buffer->owner : PTR_REF(buffer);
+  slice->readOnly = buffer->readOnly;
+  return OBJ_VAL(slice);
+}
+
+// bufferRead(buffer, offset, type) reads a number of the given type
+static Value bufferReadNative(int argCount, Value* args) {
+  if (!checkBuffer(args[0])) return NIL_VAL;
+  ObjBuffer* buffer = AS_BUFFER(args[0]);
+  NumberType type;
+  if (!parseNumberType(args[2], &type)) return NIL_VAL;
+  if (!checkOffset(buffer, args[1], type.size)) return NIL_VAL;
+
+  uint64_t bits = loadBits(buffer->bytes + (size_t)AS_NUMBER(args[1]), &type);
+  return NUMBER_VAL(decodeNumber(bits, &type));
+}
+
+// bufferWrite(buffer, offset, type, number) stores a number as the
+// given type
+static Value bufferWriteNative(int argCount, Value* args) {
+  if (!checkBuffer(args[0])) return NIL_VAL;
+  ObjBuffer* buffer = AS_BUFFER(args[0]);
+  if (buffer->readOnly) return nativeError("Buffer is read-only.");
+  NumberType type;
+  if (!parseNumberType(args[2], &type)) return NIL_VAL;
+  if (!checkOffset(buffer, args[1], type.size)) return NIL_VAL;
+  if (!IS_NUMBER(args[3])) return nativeError("Value must be a number.");
+
+  uint64_t bits;
+  if (!encodeNumber(AS_NUMBER(args[3]), &type, &bits)) return NIL_VAL;
+  storeBits(buffer->bytes + (size_t)AS_NUMBER(args[1]), &type, bits);
+  return args[3];
+}
+
+// bufferToString(buffer) copies the bytes into a string
+static Value bufferToStringNative(int argCount, Value* args) {
+  if (!checkBuffer(args[0])) return NIL_VAL;
+  ObjBuffer* buffer = AS_BUFFER(args[0]);
+  if (buffer->length > INT32_MAX) return nativeError("Buffer is too large.");
+
+  return OBJ_VAL(copyString((const char*)buffer->bytes, (int)buffer->length));
+}
+
+// bufferFromString(string) copies the characters into a new buffer
+static Value bufferFromStringNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) return nativeError("Argument must be a string.");
+  ObjString* string = AS_STRING(args[0]);
+
+  uint8_t* bytes = ALLOCATE(uint8_t, string->length);
+  memcpy(bytes, string->chars, string->length);
+  return OBJ_VAL(newBuffer(bytes, string->length));
+}
+
+void defineBufferNatives() {
+  defineNative("buffer", bufferNative, 1);
+  defineNative("mapFile", mapFileNative, 1);
+  defineNative("bufferLength", bufferLengthNative, 1);
+  defineNative("bufferSlice", bufferSliceNative, 3);
+  defineNative("bufferRead", bufferReadNative, 3);
+  defineNative("bufferWrite", bufferWriteNative, 4);
+  defineNative("bufferToString", bufferToStringNative, 1);
+  defineNative("bufferFromString", bufferFromStringNative, 1);
+}
@@ -0,0 +1,13 @@
+#ifndef clox_buffer_h
+#define clox_buffer_h
+
+#include "object.h"
+
+// Releases the bytes that a buffer owns, slices own nothing
+void freeBuffer(ObjBuffer* buffer);
+
+// Registers the natives for creating buffers (or mapping files into
+// them), slicing them and reading and writing numbers in them
+void defineBufferNatives();
+
+#endif
@@ -0,0 +1,369 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "memory.h"
+#include "verify.h"
+#include "vm.h"
+
+#define SELF_PATH "/proc/self/exe"
+// Marks the end of an executable that carries a bundled script, the
+// last two characters double as the version of the bytecode format
+#define BUNDLE_MAGIC "CLOXBC03"
+// Functions are read by recursing into the ones nested in them, far
+// deeper than any script nests its functions
+#define MAX_FUNCTION_DEPTH UINT8_COUNT
+
+// Sits at the very end of a bundled executable, right after the
+// bytecode, so that it can be found without parsing the ELF file
+typedef struct {
+  uint64_t size;
+  char magic[8];
+} Trailer;
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_BOOL,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+  CONSTANT_RECORD_TYPE,
+} ConstantTag;
+
+typedef ByteArray Writer;
+
+typedef struct {
+  const uint8_t* current;
+  const uint8_t* end;
+  // Set once we read past the end, after which reads return zeroes
+  bool failed;
+  // Number of functions that are being read
+  int depth;
+} Reader;
+
+static void writeByte(Writer* writer, uint8_t byte) {
+  writeByteArray(writer, &byte, 1);
+}
+
+// Bundles only ever run with the interpreter that wrote them, so
+// everything is stored in the byte order of the host
+static void writeInt(Writer* writer, uint32_t value) {
+  writeByteArray(writer, &value, sizeof(value));
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+  writeInt(writer, string->length);
+  writeByteArray(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeConstant(Writer* writer, Value value) {
+  if (IS_NIL(value)) {
+    writeByte(writer, CONSTANT_NIL);
+  } else if (IS_BOOL(value)) {
+    writeByte(writer, CONSTANT_BOOL);
+    writeByte(writer, AS_BOOL(value));
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    writeByte(writer, CONSTANT_NUMBER);
+    writeByteArray(writer, &number, sizeof(number));
+  } else if (IS_STRING(value)) {
+    writeByte(writer, CONSTANT_STRING);
+    writeString(writer, AS_STRING(value));
+  } else if (IS_RECORD_TYPE(value)) {
+    ObjRecordType* type = AS_RECORD_TYPE(value);
+    writeByte(writer, CONSTANT_RECORD_TYPE);
+    writeString(writer, REF_PTR(ObjString, type->name));
+    writeInt(writer, type->fieldCount);
+    for (int i = 0; i < type->fieldCount; i++) {
+      writeString(writer, REF_PTR(ObjString, type->fields[i]));
+    }
+  } else {
+    // The compiler does not emit any other kind of constant
+    writeByte(writer, CONSTANT_FUNCTION);
+    writeFunction(writer, AS_FUNCTION(value));
+  }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  writeInt(writer, function->arity);
+  writeInt(writer, function->upvalueCount);
+
+  writeByte(writer, function->name != NULL_REF);
+  if (function->name != NULL_REF) {
+    writeString(writer, REF_PTR(ObjString, function->name));
+  }
+
+  Chunk* chunk = &function->chunk;
+  writeInt(writer, chunk->count);
+  writeByteArray(writer, chunk->code, chunk->count);
+  // Line numbers are kept for runtime errors
+  for (int i = 0; i < chunk->count; i++) {
+    writeInt(writer, chunk->lines[i]);
+  }
+
+  writeInt(writer, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    writeConstant(writer, chunk->constants.values[i]);
+  }
+
+  writeInt(writer, chunk->handlerCount);
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    writeInt(writer, handler->start);
+    writeInt(writer, handler->end);
+    writeInt(writer, handler->handler);
+    writeInt(writer, handler->stackSlots);
+  }
+}
+
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+  if (reader->failed || (size_t)(reader->end - reader->current) < length) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  const uint8_t* bytes = reader->current;
+  reader->current += length;
+  return bytes;
+}
+
+static uint8_t readByte(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readInt(Reader* reader) {
+  uint32_t value = 0;
+  const uint8_t* bytes = readBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// Reads the number of items that follow, every item takes up at least
+// a byte so a count larger than what is left means the data is corrupt
+static int readCount(Reader* reader) {
+  uint32_t count = readInt(reader);
+  if (count > (size_t)(reader->end - reader->current) || count > INT32_MAX) {
+    reader->failed = true;
+    return 0;
+  }
+  return (int)count;
+}
+
+static ObjString* readString(Reader* reader) {
+  int length = readCount(reader);
+  const uint8_t* chars = readBytes(reader, length);
+  if (chars == NULL) return NULL;
+  return copyString((const char*)chars, length);
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+// Everything that is being read is kept on the VM stack, which all of
+// it has to fit onto before the bytecode is even verified
+static bool pushRead(Reader* reader, Value value) {
+  if (vm.stackTop - vm.stack >= STACK_MAX) reader->failed = true;
+  if (reader->failed) return false;
+  push(value);
+  return true;
+}
+
+static ObjRecordType* readRecordType(Reader* reader) {
+  ObjString* name = readString(reader);
+  if (name == NULL) return NULL;
+  // Reading the fields allocates
+  if (!pushRead(reader, OBJ_VAL(name))) return NULL;
+
+  int fieldCount = readCount(reader);
+  ObjRecordType* type = newRecordType(name, fieldCount);
+  if (pushRead(reader, OBJ_VAL(type))) {
+    for (int i = 0; i < fieldCount; i++) {
+      ObjString* field = readString(reader);
+      if (field == NULL) break;
+      type->fields[i] = PTR_REF(field);
+    }
+    pop();
+  }
+
+  pop();
+  return reader->failed ? NULL : type;
+}
+
+static Value readConstant(Reader* reader) {
+  switch (readByte(reader)) {
+    case CONSTANT_NIL: return NIL_VAL;
+    case CONSTANT_BOOL: return BOOL_VAL(readByte(reader) != 0);
+    case CONSTANT_NUMBER: {
+      double number = 0;
+      const uint8_t* bytes = readBytes(reader, sizeof(number));
+      if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case CONSTANT_STRING: {
+      ObjString* string = readString(reader);
+      return string == NULL ? NIL_VAL : OBJ_VAL(string);
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction* function = readFunction(reader);
+      return function == NULL ? NIL_VAL : OBJ_VAL(function);
+    }
+    case CONSTANT_RECORD_TYPE: {
+      ObjRecordType* type = readRecordType(reader);
+      return type == NULL ? NIL_VAL : OBJ_VAL(type);
+    }
+    default:
+      reader->failed = true;
+      return NIL_VAL;
+  }
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+  if (reader->depth == MAX_FUNCTION_DEPTH) reader->failed = true;
+  if (reader->failed) return NULL;
+
+  ObjFunction* function = newFunction();
+  // Reading the name and the constants allocates
+  if (!pushRead(reader, OBJ_VAL(function))) return NULL;
+  reader->depth++;
+
+  function->arity = readInt(reader);
+  function->upvalueCount = readInt(reader);
+  if (readByte(reader)) function->name = PTR_REF(readString(reader));
+
+  int count = readCount(reader);
+  const uint8_t* code = readBytes(reader, count);
+  for (int i = 0; i < count && !reader->failed; i++) {
+    writeChunk(&function->chunk, code[i], readInt(reader));
+  }
+
+  int constantCount = readCount(reader);
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    addConstant(&function->chunk, readConstant(reader));
+  }
+
+  int handlerCount = readCount(reader);
+  for (int i = 0; i < handlerCount && !reader->failed; i++) {
+    int start = readInt(reader);
+    int end = readInt(reader);
+    int handler = readInt(reader);
+    int stackSlots = readInt(reader);
+    addHandler(&function->chunk, start, end, handler, stackSlots);
+  }
+
+  reader->depth--;
+  pop();
+  return reader->failed ? NULL : function;
+}
+
+// Maps the running executable into memory, returns NULL if that fails
+static const uint8_t* mapExecutable(size_t* size) {
+  int fd = open(SELF_PATH, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(Trailer)) {
+    close(fd);
+    return NULL;
+  }
+
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+
+  *size = info.st_size;
+  return (const uint8_t*)data;
+}
+
+// Returns the bytecode of the bundled script, or NULL if the
+// executable does not carry one
+static const uint8_t* findBundle(const uint8_t* executable, size_t size,
+                                 size_t* bundleSize) {
+  Trailer trailer;
+  memcpy(&trailer, executable + size - sizeof(Trailer), sizeof(Trailer));
+  if (memcmp(trailer.magic, BUNDLE_MAGIC, sizeof(trailer.magic)) != 0) return NULL;
+  if (trailer.size > size - sizeof(Trailer)) return NULL;
+
+  *bundleSize = trailer.size;
+  return executable + size - sizeof(Trailer) - trailer.size;
+}
+
+bool writeBundle(ObjFunction* script, const char* path) {
+  size_t size;
+  const uint8_t* executable = mapExecutable(&size);
+  if (executable == NULL) {
+    fprintf(stderr, "Could not read the interpreter executable.\n");
+    return false;
+  }
+
+  // When bundling from a bundle, its own script is left out
+  size_t interpreterSize = size;
+  size_t oldBundleSize;
+  const uint8_t* oldBundle = findBundle(executable, size, &oldBundleSize);
+  if (oldBundle != NULL) interpreterSize = oldBundle - executable;
+
+  // Growing the buffer can trigger a GC, which must not take the
+  // freshly compiled script with it
+  push(OBJ_VAL(script));
+  Writer writer;
+  initByteArray(&writer);
+  writeFunction(&writer, script);
+  pop();
+
+  Trailer trailer;
+  trailer.size = writer.count;
+  memcpy(trailer.magic, BUNDLE_MAGIC, sizeof(trailer.magic));
+
+  bool written = false;
+  FILE* file = fopen(path, "wb");
+  if (file != NULL) {
+    written = fwrite(executable, 1, interpreterSize, file) == interpreterSize &&
+              fwrite(writer.bytes, 1, writer.count, file) == (size_t)writer.count &&
+              fwrite(&trailer, sizeof(Trailer), 1, file) == 1;
+    written = fclose(file) == 0 && written;
+  }
+  if (written) written = chmod(path, 0755) == 0;
+
+  freeByteArray(&writer);
+  munmap((void*)executable, size);
+
+  if (!written) fprintf(stderr, "Could not write bundle \"%s\".\n", path);
+  return written;
+}
+
+ObjFunction* loadBundle() {
+  size_t size;
+  const uint8_t* executable = mapExecutable(&size);
+  if (executable == NULL) return NULL;
+
+  size_t bundleSize;
+  const uint8_t* bundle = findBundle(executable, size, &bundleSize);
+  if (bundle == NULL) {
+    munmap((void*)executable, size);
+    return NULL;
+  }
+
+  Reader reader = { bundle, bundle + bundleSize, false, 0 };
+  ObjFunction* script = readFunction(&reader);
+  munmap((void*)executable, size);
+
+  if (script == NULL || reader.current != reader.end) {
+    fprintf(stderr, "Bundled bytecode is corrupt.\n");
+    exit(65);
+  }
+
+  // The bytecode may not have been written by us at all, so it only
+  // runs if it cannot make the VM step outside of its own data
+  const char* error = verifyFunction(script);
+  if (error != NULL) {
+    fprintf(stderr, "Bundled bytecode is invalid: %s\n", error);
+    exit(65);
+  }
+  return script;
+}
@@ -0,0 +1,17 @@
+#ifndef clox_bundle_h
+#define clox_bundle_h
+
+#include "object.h"
+
+// A bundle is a copy of the interpreter's own executable with the
+// bytecode of a compiled script appended to it, which is run instead
+// of the REPL when the executable starts.
+
+// Writes an executable to path that runs the given script, returns
+// false (after reporting why) if that was not possible
+bool writeBundle(ObjFunction* script, const char* path);
+// Returns the script embedded in the running executable, or NULL if
+// there is none
+ObjFunction* loadBundle();
+
+#endif
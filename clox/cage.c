@@ -0,0 +1,138 @@
+#include "cage.h"
+
+#ifdef HEAP_CAGE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Size of the unit that all cage allocations are rounded up to
+#define CAGE_GRANULE ((size_t)1 << CAGE_SHIFT)
+// Freed blocks up to this many granules are recycled through
+// per-size free lists, which covers all fixed size objects
+#define CAGE_SIZE_CLASSES 64
+// Memory is made accessible in steps of this size as the cage fills up
+#define CAGE_COMMIT_STEP (1024 * 1024)
+
+// A freed block, stored in the memory of the block itself
+typedef struct FreeBlock {
+  struct FreeBlock* next;
+  size_t size;
+} FreeBlock;
+
+char* cageBase = NULL;
+
+// Offset of the first byte that has never been handed out
+static size_t cageTop;
+// Number of bytes from the base that are readable and writable
+static size_t cageCommitted;
+
+static FreeBlock* freeLists[CAGE_SIZE_CLASSES];
+// Freed blocks that are too large for any of the size classes
+static FreeBlock* largeBlocks;
+
+void initCage() {
+  // Reserving the address space costs nothing until pages are
+  // touched, we only commit memory as the bump pointer reaches it
+  void* base = mmap(NULL, CAGE_SIZE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Could not reserve heap cage.\n");
+    exit(1);
+  }
+
+  cageBase = (char*)base;
+  cageCommitted = 0;
+  // Skip the first granule so that no object ever sits at offset
+  // zero, which is reserved for the null reference
+  cageTop = CAGE_GRANULE;
+
+  for (int i = 0; i < CAGE_SIZE_CLASSES; i++) {
+    freeLists[i] = NULL;
+  }
+  largeBlocks = NULL;
+}
+
+void freeCage() {
+  if (cageBase == NULL) return;
+  munmap(cageBase, CAGE_SIZE);
+  cageBase = NULL;
+}
+
+static size_t roundToGranule(size_t size) {
+  return (size + CAGE_GRANULE - 1) & ~(CAGE_GRANULE - 1);
+}
+
+static void* bumpAllocate(size_t size) {
+  if (cageTop + size > CAGE_SIZE) {
+    fprintf(stderr, "Heap cage exhausted.\n");
+    exit(1);
+  }
+
+  if (cageTop + size > cageCommitted) {
+    size_t newCommitted = (cageTop + size + CAGE_COMMIT_STEP - 1) &
+                          ~((size_t)CAGE_COMMIT_STEP - 1);
+    if (newCommitted > CAGE_SIZE) newCommitted = CAGE_SIZE;
+
+    if (mprotect(cageBase + cageCommitted, newCommitted - cageCommitted,
+                 PROT_READ | PROT_WRITE) != 0) {
+      fprintf(stderr, "Could not commit heap cage memory.\n");
+      exit(1);
+    }
+    cageCommitted = newCommitted;
+  }
+
+  void* result = cageBase + cageTop;
+  cageTop += size;
+  return result;
+}
+
+void* cageAllocate(size_t size) {
+  size = roundToGranule(size);
+  size_t sizeClass = size >> CAGE_SHIFT;
+
+  if (sizeClass < CAGE_SIZE_CLASSES) {
+    FreeBlock* block = freeLists[sizeClass];
+    if (block != NULL) {
+      freeLists[sizeClass] = block->next;
+      return block;
+    }
+  } else {
+    // Large blocks are rare enough that a first fit search through
+    // a single list is sufficient
+    FreeBlock* previous = NULL;
+    for (FreeBlock* block = largeBlocks; block != NULL; block = block->next) {
+      if (block->size == size) {
+        if (previous == NULL) {
+          largeBlocks = block->next;
+        } else {
+          previous->next = block->next;
+        }
+        return block;
+      }
+      previous = block;
+    }
+  }
+
+  return bumpAllocate(size);
+}
+
+void cageFree(void* pointer, size_t size) {
+  if (pointer == NULL) return;
+
+  size = roundToGranule(size);
+  size_t sizeClass = size >> CAGE_SHIFT;
+
+  FreeBlock* block = (FreeBlock*)pointer;
+  block->size = size;
+
+  if (sizeClass < CAGE_SIZE_CLASSES) {
+    block->next = freeLists[sizeClass];
+    freeLists[sizeClass] = block;
+  } else {
+    block->next = largeBlocks;
+    largeBlocks = block;
+  }
+}
+
+#endif
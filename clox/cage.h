@@ -0,0 +1,56 @@
+#ifndef clox_cage_h
+#define clox_cage_h
+
+#include "common.h"
+
+// A field declared with OBJ_REF(type) holds a reference to a heap object.
+// Normally that is just a pointer, but with HEAP_CAGE enabled every object
+// lives inside one reserved region of virtual memory (the cage), which lets
+// us store references as 32-bit offsets from the start of the cage.
+//
+// Only ever go through REF_PTR and PTR_REF to convert between the two
+// representations, and compare against NULL_REF rather than NULL.
+#ifdef HEAP_CAGE
+
+// Objects are aligned to 8 bytes within the cage, so the offsets are
+// stored shifted which lets 32 bits address a 32GB cage
+#define CAGE_SHIFT 3
+#define CAGE_SIZE (((size_t)UINT32_MAX + 1) << CAGE_SHIFT)
+
+#define OBJ_REF(type) uint32_t
+#define NULL_REF 0
+
+#define REF_PTR(type, ref) ((type*)refToPointer(ref))
+#define PTR_REF(pointer) pointerToRef(pointer)
+
+extern char* cageBase;
+
+// These are functions rather than macros so that arguments such as
+// READ_CONSTANT() with side effects are only evaluated once.
+//
+// Offset zero is never handed out by the cage allocator, which is what
+// allows it to double as the null reference
+static inline void* refToPointer(uint32_t ref) {
+  return ref == NULL_REF ? NULL : cageBase + ((size_t)ref << CAGE_SHIFT);
+}
+
+static inline uint32_t pointerToRef(const void* pointer) {
+  if (pointer == NULL) return NULL_REF;
+  return (uint32_t)(((const char*)pointer - cageBase) >> CAGE_SHIFT);
+}
+
+void initCage();
+void freeCage();
+void* cageAllocate(size_t size);
+void cageFree(void* pointer, size_t size);
+
+#else
+
+#define OBJ_REF(type) type*
+#define NULL_REF NULL
+#define REF_PTR(type, ref) ((type*)(ref))
+#define PTR_REF(pointer) (pointer)
+
+#endif
+
+#endif
@@ -10,6 +10,9 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->handlers = NULL;
+  chunk->handlerCount = 0;
+  chunk->handlerCapacity = 0;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -27,8 +30,9 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(uint8_t, chunk->lines, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(ExceptionHandler, chunk->handlers, chunk->handlerCapacity);
   initChunk(chunk);
 }
 
@@ -36,8 +40,35 @@ int addConstant(Chunk* chunk, Value value) {
   // This little manoeuvre is to prevent the value from being
   // GC-ed before it can be written to the table, since a 
   // reallocation to expand the table capacity could occur
+  //
+  // The VM stack is shared with other compiling threads, if any
+  lockHeap();
   push(value);
   writeValueArray(&chunk->constants, value);
   pop();
+  unlockHeap();
   return chunk->constants.count - 1;
 }
+
+void addHandler(Chunk* chunk, int start, int end, int handler, int stackSlots) {
+  if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+    int oldCapacity = chunk->handlerCapacity;
+    chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->handlers = GROW_ARRAY(ExceptionHandler, chunk->handlers,
+                                 oldCapacity, chunk->handlerCapacity);
+  }
+
+  ExceptionHandler* entry = &chunk->handlers[chunk->handlerCount++];
+  entry->start = start;
+  entry->end = end;
+  entry->handler = handler;
+  entry->stackSlots = stackSlots;
+}
+
+ExceptionHandler* findHandler(Chunk* chunk, int offset) {
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    if (handler->start <= offset && offset < handler->end) return handler;
+  }
+  return NULL;
+}
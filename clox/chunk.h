@@ -26,6 +26,9 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  // Applies a math function to the arguments on the stack, see
+  // intrinsic.h
+  OP_INTRINSIC,
   // Directly invoking a method on a call
   OP_INVOKE,
   // Directly invoking a super class method
@@ -59,8 +62,22 @@ typedef enum {
   OP_CLASS,
   OP_INHERIT,
   OP_METHOD,
+  // Raises the value at the top of the stack as an exception
+  OP_THROW,
 } OpCode;
 
+// Code in [start, end) is protected by a catch block that starts at
+// handler. Handlers are only consulted when an exception is thrown,
+// so code in try blocks runs just like any other code.
+typedef struct {
+  int start;
+  int end;
+  int handler;
+  // Number of stack slots (i.e. locals) of the function that are in
+  // use at the try, the exception is pushed right above them
+  int stackSlots;
+} ExceptionHandler;
+
 typedef struct {
   // Array of byte-sized instructions.
   //
@@ -75,6 +92,11 @@ typedef struct {
   // An integer array that parallels each byte code to track its corresponding line number
   int* lines;
   ValueArray constants;
+
+  // Nested try blocks come before the ones that enclose them
+  ExceptionHandler* handlers;
+  int handlerCount;
+  int handlerCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -84,6 +106,10 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
 // Returns the offset in which the value was written
 // in the constants array
 int addConstant(Chunk* chunk, Value value);
+void addHandler(Chunk* chunk, int start, int end, int handler, int stackSlots);
+// Returns the innermost handler that protects the instruction at the
+// given offset, or NULL if there is none
+ExceptionHandler* findHandler(Chunk* chunk, int offset);
 
 #endif
 
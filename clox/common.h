@@ -10,6 +10,15 @@
 
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+// Count the lookups, probes and resizes of the tables by what they are
+// used for, and print the counts when the VM is freed
+//#define DEBUG_TABLE_STATS
+
+// Keep all objects in a single reserved region of memory and refer
+// to them with 32-bit offsets rather than full pointers. Objects are
+// then allocated from that region rather than through the Allocator
+// that the VM was created with.
+//#define HEAP_CAGE
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -1,22 +1,37 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "intrinsic.h"
 #include "memory.h"
 #include "object.h"
 #include "scanner.h"
+#include "verify.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// Sources at least this large have their top level functions and
+// methods compiled on worker threads
+#define PARALLEL_COMPILE_MIN_SOURCE (64 * 1024)
+#define MAX_COMPILE_THREADS 16
+// Size of the index of each function's constants, twice the number of
+// constants a chunk can have so that it stays at most half full
+#define CONSTANT_SLOTS (UINT8_COUNT * 2)
+
 typedef struct {
   Token current;
   Token previous;
   bool hadError;
   bool panicMode;
+  // Set on worker threads, whose errors are reported by compiling
+  // the same function again on the main thread
+  bool quiet;
 } Parser;
 
 typedef enum {
@@ -76,6 +91,11 @@ typedef struct Compiler {
 
   Upvalue upvalues[UINT8_COUNT];
 
+  // Finds the constants that are strings or numbers by their value, so
+  // that a name or literal that is used over and over is stored once.
+  // A slot holds the index of a constant plus one, or zero if it is free.
+  uint16_t constantSlots[CONSTANT_SLOTS];
+
   // Number blocks surrounding current bit of code we
   // are currently compiling.
   // Zero is the global scope, one is the first top-level block
@@ -89,11 +109,49 @@ typedef struct ClassCompiler {
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
+// A top level function or a method of a top level class, found by
+// scanning ahead, whose body is compiled on a worker thread. The main
+// thread then links the result in when it gets to the function.
+typedef struct {
+  Token name;
+  // The '(' that starts the parameter list
+  Token start;
+  FunctionType type;
+  bool inClass;
+  bool hasSuperclass;
+
+  // Filled in by the worker
+  ObjFunction* function;
+  Upvalue upvalues[UINT8_COUNT];
+  // Whether a method captures the 'super' local of its class
+  bool capturesSuper;
+  // The '}' that ends the body
+  Token end;
+  bool failed;
+} FunctionSpan;
 
-Compiler* current = NULL;
+typedef struct {
+  FunctionSpan* spans;
+  int count;
+  // Index of the next span that is up for grabs
+  int next;
+  pthread_mutex_t lock;
+} CompileJobs;
 
-ClassCompiler* currentClass = NULL;
+// Every thread compiles with its own state
+_Thread_local Parser parser;
+
+_Thread_local Compiler* current = NULL;
+
+_Thread_local ClassCompiler* currentClass = NULL;
+
+// Functions compiled ahead of time for the source that the main thread
+// is compiling, in the order in which they appear
+_Thread_local FunctionSpan* spans = NULL;
+_Thread_local int spanCount = 0;
+_Thread_local int spanCapacity = 0;
+// Spans before this one have either been linked or skipped
+_Thread_local int nextSpan = 0;
 
 Chunk* compilingChunk;
 
@@ -111,6 +169,8 @@ static Chunk* currentChunk() {
 static void errorAt(Token* token, const char* message) {
   if (parser.panicMode) return;
   parser.panicMode = true;
+  parser.hadError = true;
+  if (parser.quiet) return;
 
   fprintf(stderr, "[line %d] Error", token->line);
 
@@ -123,7 +183,6 @@ static void errorAt(Token* token, const char* message) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
 }
 
 static void error(const char* message) {
@@ -215,8 +274,52 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 
-// Returns an index to the constants array of the newly added value 
+static uint32_t hashConstant(Value value) {
+  if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+  double number = AS_NUMBER(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Strings are interned so they are the same if they are the same
+// object. Numbers are compared by their bits, which keeps 0 and -0
+// apart.
+static bool sameConstant(Value a, Value b) {
+  if (IS_STRING(a)) return IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+  if (!IS_NUMBER(b)) return false;
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+// Returns the slot of the index that refers to the constant, or the
+// free slot where it belongs if the chunk does not have it yet
+static uint16_t* findConstantSlot(Value value) {
+  Value* constants = currentChunk()->constants.values;
+  uint32_t index = hashConstant(value) & (CONSTANT_SLOTS - 1);
+  for (;;) {
+    uint16_t* slot = &current->constantSlots[index];
+    if (*slot == 0 || sameConstant(constants[*slot - 1], value)) return slot;
+    index = (index + 1) & (CONSTANT_SLOTS - 1);
+  }
+}
+
+// Returns an index to the constants array of the value, which is only
+// added if it is not a string or number that is already there
 static uint8_t makeConstant(Value value) {
+  // Functions and record types are new objects every time
+  uint16_t* slot = NULL;
+  if (IS_STRING(value) || IS_NUMBER(value)) {
+    slot = findConstantSlot(value);
+    if (*slot != 0) return (uint8_t)(*slot - 1);
+  }
+
   int constant = addConstant(currentChunk(), value);
   if (constant > UINT8_MAX) {
     // Since we use a single bit to represent the index of
@@ -225,6 +328,7 @@ static uint8_t makeConstant(Value value) {
     return 0;
   }
 
+  if (slot != NULL) *slot = (uint16_t)(constant + 1);
   return (uint8_t)constant;
 }
 
@@ -259,6 +363,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  memset(compiler->constantSlots, 0, sizeof(compiler->constantSlots));
   compiler->function = newFunction();
   current = compiler;
 
@@ -266,7 +371,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     // We can do this because this will be called right after we parse
     // the variable name. We take care to copy the string since this function
     // object will outlive the compiler and will be persisted until runtime
-    current->function->name = copyString(parser.previous.start, parser.previous.length);
+    current->function->name = PTR_REF(copyString(parser.previous.start, parser.previous.length));
   }
 
   // Compiler implicitly claims stack slot zero for its own
@@ -295,10 +400,11 @@ static ObjFunction* endCompiler() {
   ObjFunction* function = current->function;
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (!parser.hadError && !parser.quiet) {
     // User defined functions will have names, but the implicit function
     // we create for top-level code does not
-    disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    disassembleChunk(currentChunk(), function->name != NULL_REF
+        ? REF_PTR(ObjString, function->name)->chars : "<script>");
   }
 #endif
 
@@ -619,6 +725,17 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
+    // Calls to the math functions skip the global lookup and the call,
+    // which OP_INTRINSIC only falls back to if the global is redefined
+    int intrinsic = findIntrinsic(name.start, name.length);
+    if (intrinsic != -1 && check(TOKEN_LEFT_PAREN)) {
+      advance();
+      uint8_t argCount = argumentList();
+      emitBytes(OP_INTRINSIC, (uint8_t)intrinsic);
+      emitByte(argCount);
+      return;
+    }
+
     arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
@@ -719,6 +836,7 @@ ParseRule rules[] = {
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
   [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
+  [TOKEN_CATCH]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
@@ -728,10 +846,13 @@ ParseRule rules[] = {
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
   [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_RECORD]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
   [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
+  [TOKEN_THROW]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
+  [TOKEN_TRY]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
@@ -778,9 +899,10 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
+// Compiles the parameters and body of a function with a new compiler,
+// which is left holding the upvalues that the function captures
+static ObjFunction* functionBody(Compiler* compiler, FunctionType type) {
+  initCompiler(compiler, type);
   beginScope();
 
   // Compile the parameter list.
@@ -805,15 +927,81 @@ static void function(FunctionType type) {
   // Create the function object.
   // Note how there is no need to end scope and jump back out
   // to a lower depth
-  ObjFunction* function = endCompiler();
+  return endCompiler();
+}
+
+static void emitClosure(ObjFunction* function, Upvalue* upvalues) {
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    emitByte(upvalues[i].isLocal ? 1 : 0);
+    emitByte(upvalues[i].index);
   }
 }
 
+#ifdef DEBUG_PRINT_CODE
+// Prints a function compiled by a worker in the same order as
+// endCompiler() would have, i.e. nested functions first
+static void disassembleFunction(ObjFunction* function) {
+  for (int i = 0; i < function->chunk.constants.count; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if (IS_FUNCTION(constant)) disassembleFunction(AS_FUNCTION(constant));
+  }
+  disassembleChunk(&function->chunk, REF_PTR(ObjString, function->name)->chars);
+}
+#endif
+
+// Uses the function compiled ahead of time for the one that starts at
+// the current token, if any. The worker compiled it as if it was
+// declared at the top level or in a top level class, so we make sure
+// that this is really the case before linking it in.
+static bool linkCompiledFunction(FunctionType type) {
+  while (nextSpan < spanCount &&
+         spans[nextSpan].start.start < parser.current.start) {
+    nextSpan++;
+  }
+  if (nextSpan == spanCount) return false;
+
+  FunctionSpan* span = &spans[nextSpan];
+  if (span->start.start != parser.current.start) return false;
+  nextSpan++;
+
+  if (span->failed || span->type != type) return false;
+  if (current->enclosing != NULL) return false;
+  if (span->inClass) {
+    if (currentClass == NULL || currentClass->enclosing != NULL ||
+        currentClass->hasSuperclass != span->hasSuperclass ||
+        current->scopeDepth != (span->hasSuperclass ? 1 : 0)) {
+      return false;
+    }
+  } else if (currentClass != NULL || current->scopeDepth != 0) {
+    return false;
+  }
+
+#ifdef DEBUG_PRINT_CODE
+  disassembleFunction(span->function);
+#endif
+
+  // The 'super' local is the one right after the slot of the script
+  if (span->capturesSuper) current->locals[1].isCaptured = true;
+
+  // Carry on right after the body as if we had compiled it ourselves
+  initScannerAt(span->end.start + span->end.length, span->end.line);
+  parser.current = span->end;
+  advance();
+
+  emitClosure(span->function, span->upvalues);
+  return true;
+}
+
+static void function(FunctionType type) {
+  if (linkCompiledFunction(type)) return;
+
+  Compiler compiler;
+  ObjFunction* function = functionBody(&compiler, type);
+  emitClosure(function, compiler.upvalues);
+}
+
 // Expects the class to be at the top of the stack
 // when this is called
 static void method() {
@@ -900,6 +1088,51 @@ static void classDeclaration() {
   currentClass = currentClass->enclosing;
 }
 
+// Records are declared with their list of fields, e.g.
+// 'record Point(x, y);'. The type is complete at compile time,
+// so it is stored as a constant rather than being built at runtime.
+static void recordDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect record name.");
+  Token name = parser.previous;
+  uint8_t nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  Token fields[UINT8_COUNT];
+  int fieldCount = 0;
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after record name.");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      consume(TOKEN_IDENTIFIER, "Expect field name.");
+      if (fieldCount == UINT8_MAX) {
+        error("Can't have more than 255 fields.");
+        continue;
+      }
+
+      for (int i = 0; i < fieldCount; i++) {
+        if (identifiersEqual(&fields[i], &parser.previous)) {
+          error("Already a field with this name in this record.");
+        }
+      }
+      fields[fieldCount++] = parser.previous;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after fields.");
+  consume(TOKEN_SEMICOLON, "Expect ';' after record declaration.");
+
+  // Interning gives us back the name that identifierConstant() stored
+  // in the constant table, which keeps it alive. The same goes for the
+  // type itself while we fill in the names of its fields.
+  ObjString* nameString = copyString(name.start, name.length);
+  ObjRecordType* type = newRecordType(nameString, fieldCount);
+  uint8_t typeConstant = makeConstant(OBJ_VAL(type));
+  for (int i = 0; i < fieldCount; i++) {
+    type->fields[i] = PTR_REF(copyString(fields[i].start, fields[i].length));
+  }
+
+  emitBytes(OP_CONSTANT, typeConstant);
+  defineVariable(nameConstant);
+}
+
 static void varDeclaration() {
   uint8_t global = parseVariable("Expect variable name.");
 
@@ -1032,6 +1265,47 @@ static void returnStatement() {
   }
 }
 
+static void throwStatement() {
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after thrown value.");
+  emitByte(OP_THROW);
+}
+
+// The try block is compiled as usual, it only gets an entry in the
+// handler table of the chunk. The VM looks that table up when an
+// exception is thrown and jumps to the catch block, with the exception
+// pushed right above the locals that were in scope at the try.
+static void tryStatement() {
+  // Between statements the stack holds nothing but locals
+  int stackSlots = current->localCount;
+  int start = currentChunk()->count;
+
+  consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+  beginScope();
+  block();
+  endScope();
+
+  int end = currentChunk()->count;
+  int skipCatch = emitJump(OP_JUMP);
+  addHandler(currentChunk(), start, end, currentChunk()->count, stackSlots);
+
+  consume(TOKEN_CATCH, "Expect 'catch' after try block.");
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
+  beginScope();
+  // Declared as a local that lives in the slot the exception is
+  // pushed to
+  consume(TOKEN_IDENTIFIER, "Expect exception variable name.");
+  addLocal(parser.previous);
+  markInitialized();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after exception variable.");
+
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before catch block.");
+  block();
+  endScope();
+
+  patchJump(skipCatch);
+}
+
 static void whileStatement() {
   // Note the start of the while loop
 
@@ -1073,7 +1347,10 @@ static void synchronize() {
       case TOKEN_IF:
       case TOKEN_WHILE:
       case TOKEN_PRINT:
+      case TOKEN_RECORD:
       case TOKEN_RETURN:
+      case TOKEN_THROW:
+      case TOKEN_TRY:
         return;
 
       // Skip all other tokens that we see until we are 
@@ -1082,6 +1359,8 @@ static void synchronize() {
         // Do nothing.
         ;
     }
+
+    advance();
   }
 }
 
@@ -1094,6 +1373,10 @@ static void statement() {
     ifStatement();
   } else if (match(TOKEN_RETURN)) {
     returnStatement();
+  } else if (match(TOKEN_THROW)) {
+    throwStatement();
+  } else if (match(TOKEN_TRY)) {
+    tryStatement();
   } else if (match(TOKEN_WHILE)) {
     whileStatement();
   } else if (match(TOKEN_LEFT_BRACE)) {
@@ -1110,6 +1393,8 @@ static void declaration() {
     classDeclaration();
   } else if (match(TOKEN_FUN)) {
     funDeclaration();
+  } else if (match(TOKEN_RECORD)) {
+    recordDeclaration();
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
   } else {
@@ -1126,7 +1411,181 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
+static Token scanAhead(int* depth) {
+  Token token = scanToken();
+  if (token.type == TOKEN_LEFT_BRACE) (*depth)++;
+  if (token.type == TOKEN_RIGHT_BRACE) (*depth)--;
+  return token;
+}
+
+static void addSpan(Token name, Token start, FunctionType type,
+                    bool inClass, bool hasSuperclass) {
+  if (spanCapacity < spanCount + 1) {
+    int oldCapacity = spanCapacity;
+    spanCapacity = GROW_CAPACITY(oldCapacity);
+    spans = GROW_ARRAY(FunctionSpan, spans, oldCapacity, spanCapacity);
+  }
+
+  FunctionSpan* span = &spans[spanCount++];
+  span->name = name;
+  span->start = start;
+  span->type = type;
+  span->inClass = inClass;
+  span->hasSuperclass = hasSuperclass;
+  span->function = NULL;
+  span->capturesSuper = false;
+  span->failed = true;
+}
+
+// Scans through the source to find the functions that can be compiled
+// on their own. This only looks at tokens, anything that it gets wrong
+// is caught when linking, where we fall back to compiling the function
+// on the main thread.
+static void findFunctions(const char* source) {
+  initScanner(source);
+
+  int depth = 0;
+  bool inClass = false;
+  bool hasSuperclass = false;
+
+  Token token = scanAhead(&depth);
+  while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR && depth >= 0) {
+    if (depth == 0 && token.type == TOKEN_FUN) {
+      Token name = scanAhead(&depth);
+      if (name.type != TOKEN_IDENTIFIER) {
+        token = name;
+        continue;
+      }
+
+      token = scanAhead(&depth);
+      if (token.type == TOKEN_LEFT_PAREN) {
+        addSpan(name, token, TYPE_FUNCTION, false, false);
+      }
+    } else if (depth == 0 && token.type == TOKEN_CLASS) {
+      token = scanAhead(&depth);
+      if (token.type != TOKEN_IDENTIFIER) continue;
+
+      token = scanAhead(&depth);
+      hasSuperclass = false;
+      if (token.type == TOKEN_LESS) {
+        token = scanAhead(&depth);
+        if (token.type != TOKEN_IDENTIFIER) continue;
+        hasSuperclass = true;
+        token = scanAhead(&depth);
+      }
+
+      if (token.type == TOKEN_LEFT_BRACE) {
+        inClass = true;
+        token = scanAhead(&depth);
+      }
+    } else if (inClass && depth == 1 && token.type == TOKEN_IDENTIFIER) {
+      Token name = token;
+      token = scanAhead(&depth);
+      if (token.type == TOKEN_LEFT_PAREN) {
+        bool isInit = name.length == 4 && memcmp(name.start, "init", 4) == 0;
+        addSpan(name, token, isInit ? TYPE_INITIALIZER : TYPE_METHOD,
+                true, hasSuperclass);
+      }
+    } else {
+      if (depth == 0) inClass = false;
+      token = scanAhead(&depth);
+    }
+  }
+}
+
+// Compiles a span with the same compiler state that the main thread
+// has when it gets there
+static void compileSpan(FunctionSpan* span) {
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.quiet = true;
+
+  // Stands in for the compiler of the script, which top level
+  // functions can't capture anything from except for 'super'
+  Compiler script;
+  initCompiler(&script, TYPE_SCRIPT);
+
+  ClassCompiler classCompiler;
+  if (span->inClass) {
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = span->hasSuperclass;
+    currentClass = &classCompiler;
+
+    if (span->hasSuperclass) {
+      beginScope();
+      addLocal(syntheticToken("super"));
+      markInitialized();
+    }
+  }
+
+  // Leave the parser right after the name, as function() expects
+  initScannerAt(span->start.start, span->start.line);
+  parser.current = span->name;
+  advance();
+
+  Compiler compiler;
+  span->function = functionBody(&compiler, span->type);
+  memcpy(span->upvalues, compiler.upvalues,
+         sizeof(Upvalue) * span->function->upvalueCount);
+  span->capturesSuper = span->hasSuperclass && script.locals[1].isCaptured;
+  span->end = parser.previous;
+  span->failed = parser.hadError || span->end.type != TOKEN_RIGHT_BRACE;
+
+  current = NULL;
+  currentClass = NULL;
+}
+
+static void* compileWorker(void* argument) {
+  CompileJobs* jobs = (CompileJobs*)argument;
+
+  for (;;) {
+    pthread_mutex_lock(&jobs->lock);
+    int index = jobs->next++;
+    pthread_mutex_unlock(&jobs->lock);
+
+    if (index >= jobs->count) return NULL;
+    compileSpan(&jobs->spans[index]);
+  }
+}
+
+static void compileInParallel(const char* source) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 2 || strlen(source) < PARALLEL_COMPILE_MIN_SOURCE) return;
+
+  findFunctions(source);
+  if (spanCount < 2) return;
+
+  int threadCount = cores < MAX_COMPILE_THREADS ? (int)cores : MAX_COMPILE_THREADS;
+  if (threadCount > spanCount) threadCount = spanCount;
+
+  CompileJobs jobs;
+  jobs.spans = spans;
+  jobs.count = spanCount;
+  jobs.next = 0;
+  pthread_mutex_init(&jobs.lock, NULL);
+
+  // The functions compiled by the workers are not reachable until
+  // they are stored in spans, which happens once they are done
+  shareHeap(true);
+  // Spans that no thread gets to are compiled on the main thread later
+  pthread_t threads[MAX_COMPILE_THREADS];
+  int started = 0;
+  while (started < threadCount &&
+         pthread_create(&threads[started], NULL, compileWorker, &jobs) == 0) {
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  shareHeap(false);
+
+  pthread_mutex_destroy(&jobs.lock);
+}
+
 ObjFunction* compile(const char* source) {
+  compileInParallel(source);
+  nextSpan = 0;
+
   initScanner(source);
   Compiler compiler;
   initCompiler(&compiler, TYPE_SCRIPT);
@@ -1142,7 +1601,21 @@ ObjFunction* compile(const char* source) {
 
   ObjFunction* function = endCompiler();
 
-  return parser.hadError ? NULL : function;
+  FREE_ARRAY(FunctionSpan, spans, spanCapacity);
+  spans = NULL;
+  spanCount = 0;
+  spanCapacity = 0;
+
+  if (parser.hadError) return NULL;
+
+  // The VM relies on what the verifier works out about each function,
+  // so anything it rejects is a bug in the compiler
+  const char* error = verifyFunction(function);
+  if (error != NULL) {
+    fprintf(stderr, "Compiled invalid bytecode: %s\n", error);
+    return NULL;
+  }
+  return function;
 }
 
 void markCompilerRoots() {
@@ -1151,4 +1624,8 @@ void markCompilerRoots() {
     markObject((Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
+
+  for (int i = 0; i < spanCount; i++) {
+    markObject((Obj*)spans[i].function);
+  }
 }
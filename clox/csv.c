@@ -0,0 +1,375 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "csv.h"
+#include "memory.h"
+#include "vm.h"
+
+// Size of the first chunk read from the file, rows longer than this
+// make the buffer grow
+#define CSV_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+  size_t start;
+  size_t length;
+  // Quoted fields with escaped quotes in them are unescaped into the
+  // scratch buffer, everything else points into the read buffer
+  bool inScratch;
+} CsvField;
+
+struct CsvState {
+  int fd;
+  bool eof;
+
+  // Bytes that were read but not parsed yet are those from start to end
+  uint8_t* bytes;
+  size_t start;
+  size_t end;
+  size_t capacity;
+
+  uint8_t* scratch;
+  size_t scratchCount;
+  size_t scratchCapacity;
+
+  // Fields of the row that is being parsed
+  CsvField* fields;
+  int fieldCount;
+  int fieldCapacity;
+};
+
+typedef enum {
+  PARSE_ROW,
+  // The row continues past what has been read so far
+  PARSE_INCOMPLETE,
+  PARSE_DONE,
+} ParseResult;
+
+void closeCsvReader(ObjCsvReader* reader) {
+  CsvState* state = reader->state;
+  if (state == NULL) return;
+
+  close(state->fd);
+  FREE_ARRAY(uint8_t, state->bytes, state->capacity);
+  FREE_ARRAY(uint8_t, state->scratch, state->scratchCapacity);
+  FREE_ARRAY(CsvField, state->fields, state->fieldCapacity);
+  FREE(CsvState, state);
+  reader->state = NULL;
+}
+
+// Returns the number of bytes before the first delimiter or line break,
+// looking at 16 bytes at a time where SSE2 is available
+static size_t findFieldEnd(const uint8_t* bytes, size_t length, uint8_t delimiter) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128i delimiters = _mm_set1_epi8((char)delimiter);
+  __m128i newlines = _mm_set1_epi8('\n');
+  __m128i returns = _mm_set1_epi8('\r');
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + i));
+    __m128i matches = _mm_or_si128(
+        _mm_cmpeq_epi8(chunk, delimiters),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, newlines), _mm_cmpeq_epi8(chunk, returns)));
+
+    int mask = _mm_movemask_epi8(matches);
+    if (mask != 0) {
+      while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+      }
+      return i;
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    uint8_t byte = bytes[i];
+    if (byte == delimiter || byte == '\n' || byte == '\r') return i;
+  }
+  return length;
+}
+
+static void appendScratch(CsvState* state, const uint8_t* bytes, size_t length) {
+  if (state->scratchCapacity < state->scratchCount + length) {
+    size_t oldCapacity = state->scratchCapacity;
+    while (state->scratchCapacity < state->scratchCount + length) {
+      state->scratchCapacity = GROW_CAPACITY(state->scratchCapacity);
+    }
+    state->scratch = GROW_ARRAY(uint8_t, state->scratch, oldCapacity, state->scratchCapacity);
+  }
+
+  memcpy(state->scratch + state->scratchCount, bytes, length);
+  state->scratchCount += length;
+}
+
+static CsvField* addField(CsvState* state) {
+  if (state->fieldCapacity < state->fieldCount + 1) {
+    int oldCapacity = state->fieldCapacity;
+    state->fieldCapacity = GROW_CAPACITY(oldCapacity);
+    state->fields = GROW_ARRAY(CsvField, state->fields, oldCapacity, state->fieldCapacity);
+  }
+  return &state->fields[state->fieldCount++];
+}
+
+// Parses a quoted field starting right after the opening quote, and
+// leaves position right after the closing quote. Returns false if the
+// field continues past what has been read so far.
+static bool parseQuoted(CsvState* state, CsvField* field, size_t* position,
+                        uint8_t delimiter) {
+  const uint8_t* bytes = state->bytes;
+  size_t pos = *position;
+  size_t segment = pos;
+  bool escaped = false;
+  size_t scratchStart = state->scratchCount;
+
+  for (;;) {
+    // memchr() is vectorized by the C library already
+    const uint8_t* quote = memchr(bytes + pos, '"', state->end - pos);
+    if (quote == NULL) {
+      if (!state->eof) return false;
+      // An unterminated quote runs until the end of the file
+      pos = state->end;
+      break;
+    }
+
+    pos = quote - bytes;
+    if (pos + 1 == state->end && !state->eof) return false;
+
+    // Two quotes in a row stand for one
+    if (pos + 1 < state->end && bytes[pos + 1] == '"') {
+      appendScratch(state, bytes + segment, pos + 1 - segment);
+      escaped = true;
+      pos += 2;
+      segment = pos;
+      continue;
+    }
+    break;
+  }
+
+  size_t afterQuote = pos < state->end ? pos + 1 : pos;
+  // Anything between the closing quote and the next delimiter is kept
+  // as part of the field, rather than rejecting the row
+  size_t trailing = findFieldEnd(bytes + afterQuote, state->end - afterQuote, delimiter);
+  if (afterQuote + trailing == state->end && !state->eof) return false;
+
+  if (escaped || trailing > 0) {
+    appendScratch(state, bytes + segment, pos - segment);
+    appendScratch(state, bytes + afterQuote, trailing);
+    field->start = scratchStart;
+    field->length = state->scratchCount - scratchStart;
+    field->inScratch = true;
+  } else {
+    field->start = segment;
+    field->length = pos - segment;
+    field->inScratch = false;
+  }
+
+  *position = afterQuote + trailing;
+  return true;
+}
+
+// Splits the next row into fields, skipping blank lines
+static ParseResult parseRow(CsvState* state, uint8_t delimiter) {
+  const uint8_t* bytes = state->bytes;
+  size_t end = state->end;
+  size_t pos = state->start;
+
+  // This also skips the \n of a \r\n that ended the previous row
+  while (pos < end && (bytes[pos] == '\n' || bytes[pos] == '\r')) pos++;
+  state->start = pos;
+  if (pos == end) return state->eof ? PARSE_DONE : PARSE_INCOMPLETE;
+
+  state->fieldCount = 0;
+  state->scratchCount = 0;
+  for (;;) {
+    CsvField* field = addField(state);
+
+    if (pos < end && bytes[pos] == '"') {
+      pos++;
+      if (!parseQuoted(state, field, &pos, delimiter)) return PARSE_INCOMPLETE;
+    } else {
+      size_t length = findFieldEnd(bytes + pos, end - pos, delimiter);
+      field->start = pos;
+      field->length = length;
+      field->inScratch = false;
+      pos += length;
+    }
+
+    if (pos == end) {
+      // The last row does not need to end with a line break
+      if (!state->eof) return PARSE_INCOMPLETE;
+      break;
+    }
+
+    if (bytes[pos] != delimiter) {
+      // Skip the line break
+      pos++;
+      break;
+    }
+    pos++;
+  }
+
+  state->start = pos;
+  return PARSE_ROW;
+}
+
+// Reads the next chunk of the file, moving the unparsed bytes to the
+// front of the buffer first. Returns false if reading failed.
+static bool fill(CsvState* state) {
+  size_t unparsed = state->end - state->start;
+  memmove(state->bytes, state->bytes + state->start, unparsed);
+  state->start = 0;
+  state->end = unparsed;
+
+  // A row that does not fit into the buffer makes it grow
+  if (state->end == state->capacity) {
+    size_t oldCapacity = state->capacity;
+    state->capacity *= 2;
+    state->bytes = GROW_ARRAY(uint8_t, state->bytes, oldCapacity, state->capacity);
+  }
+
+  ssize_t count = read(state->fd, state->bytes + state->end, state->capacity - state->end);
+  if (count < 0) return false;
+  if (count == 0) state->eof = true;
+  state->end += count;
+  return true;
+}
+
+// Appends a value that is not reachable from anywhere else yet, which
+// has to be protected since growing the array can trigger a GC
+static void appendValue(ValueArray* array, Value value) {
+  push(value);
+  writeValueArray(array, value);
+  pop();
+}
+
+// Turns the fields that were parsed into strings in the row list
+static void fillRow(ObjCsvReader* reader) {
+  CsvState* state = reader->state;
+  ValueArray* row = &REF_PTR(ObjList, reader->row)->items;
+  ValueArray* previous = &reader->previous;
+  row->count = 0;
+
+  for (int i = 0; i < state->fieldCount; i++) {
+    CsvField* field = &state->fields[i];
+    const char* chars = (const char*)(field->inScratch ? state->scratch : state->bytes) + field->start;
+
+    // Columns often repeat the value of the previous row, which can be
+    // reused without hashing the field to look it up
+    Value cached = i < previous->count ? previous->values[i] : NIL_VAL;
+    Value string;
+    if (IS_STRING(cached) && AS_STRING(cached)->length == (int)field->length &&
+        memcmp(AS_CSTRING(cached), chars, field->length) == 0) {
+      string = cached;
+    } else {
+      string = OBJ_VAL(copyString(chars, (int)field->length));
+    }
+
+    if (i < previous->count) {
+      previous->values[i] = string;
+    } else {
+      appendValue(previous, string);
+    }
+    // Still reachable through previous, so growing the row is safe
+    writeValueArray(row, string);
+  }
+}
+
+// csvOpen(path) or csvOpen(path, delimiter) returns a reader for the
+// rows of a CSV file, the delimiter defaults to a comma
+static Value csvOpenNative(int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2) {
+    return nativeError("Expected 1 or 2 arguments but got %d.", argCount);
+  }
+  if (!IS_STRING(args[0])) return nativeError("Path must be a string.");
+
+  uint8_t delimiter = ',';
+  if (argCount == 2) {
+    if (!IS_STRING(args[1]) || AS_STRING(args[1])->length != 1 ||
+        strchr("\"\r\n", AS_CSTRING(args[1])[0]) != NULL) {
+      return nativeError("Delimiter must be a single character.");
+    }
+    delimiter = (uint8_t)AS_CSTRING(args[1])[0];
+  }
+
+  ObjCsvReader* reader = newCsvReader(delimiter);
+  push(OBJ_VAL(reader));
+  reader->row = PTR_REF(newList());
+
+  int fd = open(AS_CSTRING(args[0]), O_RDONLY);
+  if (fd < 0) {
+    pop();
+    return nativeError("Could not open file \"%s\".", AS_CSTRING(args[0]));
+  }
+
+  CsvState* state = ALLOCATE(CsvState, 1);
+  state->fd = fd;
+  state->eof = false;
+  state->bytes = NULL;
+  state->start = 0;
+  state->end = 0;
+  state->capacity = 0;
+  state->scratch = NULL;
+  state->scratchCount = 0;
+  state->scratchCapacity = 0;
+  state->fields = NULL;
+  state->fieldCount = 0;
+  state->fieldCapacity = 0;
+  reader->state = state;
+
+  state->bytes = ALLOCATE(uint8_t, CSV_CHUNK_SIZE);
+  state->capacity = CSV_CHUNK_SIZE;
+
+  pop();
+  return OBJ_VAL(reader);
+}
+
+static bool checkReader(Value value) {
+  if (!IS_CSV_READER(value)) {
+    nativeError("Argument must be a CSV reader.");
+    return false;
+  }
+  if (AS_CSV_READER(value)->state == NULL) {
+    nativeError("CSV reader is closed.");
+    return false;
+  }
+  return true;
+}
+
+// csvNext(reader) returns a list of the fields of the next row, or nil
+// once there are no rows left. The same list is returned every time, so
+// it has to be copied to keep a row around.
+static Value csvNextNative(int argCount, Value* args) {
+  if (!checkReader(args[0])) return NIL_VAL;
+  ObjCsvReader* reader = AS_CSV_READER(args[0]);
+
+  for (;;) {
+    ParseResult result = parseRow(reader->state, reader->delimiter);
+    if (result == PARSE_ROW) break;
+    if (result == PARSE_DONE) return NIL_VAL;
+    if (!fill(reader->state)) return nativeError("Could not read CSV file.");
+  }
+
+  fillRow(reader);
+  return OBJ_VAL(REF_PTR(ObjList, reader->row));
+}
+
+// csvClose(reader) closes the file right away rather than whenever the
+// reader is collected
+static Value csvCloseNative(int argCount, Value* args) {
+  if (!IS_CSV_READER(args[0])) return nativeError("Argument must be a CSV reader.");
+
+  closeCsvReader(AS_CSV_READER(args[0]));
+  return NIL_VAL;
+}
+
+void defineCsvNatives() {
+  defineNative("csvOpen", csvOpenNative, -1);
+  defineNative("csvNext", csvNextNative, 1);
+  defineNative("csvClose", csvCloseNative, 1);
+}
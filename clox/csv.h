@@ -0,0 +1,13 @@
+#ifndef clox_csv_h
+#define clox_csv_h
+
+#include "object.h"
+
+// Closes the file of the reader and frees its buffers, if that has not
+// happened yet
+void closeCsvReader(ObjCsvReader* reader);
+
+// Registers csvOpen(), csvNext() and csvClose()
+void defineCsvNatives();
+
+#endif
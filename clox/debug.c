@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "intrinsic.h"
 #include "object.h"
 #include "value.h"
 
@@ -12,6 +13,12 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     // Instructions can have different sizes
     offset = disassembleInstruction(chunk, offset);
   }
+
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    printf("try %04d-%04d catch %04d (%d slots)\n", handler->start,
+           handler->end, handler->handler, handler->stackSlots);
+  }
 }
 
 // Prints the name of the simple instruction,
@@ -116,6 +123,13 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_INTRINSIC: {
+      uint8_t intrinsic = chunk->code[offset + 1];
+      uint8_t argCount = chunk->code[offset + 2];
+      printf("%-16s (%d args) %s\n", "OP_INTRINSIC", argCount,
+             intrinsicName((Intrinsic)intrinsic));
+      return offset + 3;
+    }
     case OP_INVOKE:
       return invokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
@@ -158,6 +172,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_THROW:
+      return simpleInstruction("OP_THROW", offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
@@ -0,0 +1,242 @@
+#include <dlfcn.h>
+#include <string.h>
+
+#include "extension.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+_Static_assert(sizeof(LoxValue) >= sizeof(Value),
+               "LoxValue must be able to hold a Value");
+
+// Values created through the API by the natives that are currently
+// running, each native drops the ones it created when it returns
+static ValueArray temporaryRoots;
+// Values pinned by extensions, in no particular order
+static ValueArray pinnedValues;
+
+// Libraries that have been loaded, closed when the VM is freed
+static void** handles = NULL;
+static int handleCount = 0;
+static int handleCapacity = 0;
+
+static Value toValue(LoxValue value) {
+  Value result;
+  memcpy(&result, &value, sizeof(Value));
+  return result;
+}
+
+static LoxValue fromValue(Value value) {
+  LoxValue result;
+  memset(&result, 0, sizeof(LoxValue));
+  memcpy(&result, &value, sizeof(Value));
+  return result;
+}
+
+static void appendRoot(ValueArray* roots, Value value) {
+  // Growing the array can trigger a GC
+  push(value);
+  writeValueArray(roots, value);
+  pop();
+}
+
+// Hands a value that the extension did not have before over to it
+static LoxValue keepAlive(Value value) {
+  if (IS_OBJ(value)) appendRoot(&temporaryRoots, value);
+  return fromValue(value);
+}
+
+// Every native defined by an extension goes through this, the function
+// that the extension registered is stored in the native object
+static Value extensionNative(int argCount, Value* args) {
+  // The native itself sits in the stack slot right below its arguments
+  ObjNative* native = (ObjNative*)AS_OBJ(args[-1]);
+  LoxNativeFn function = (LoxNativeFn)native->data;
+
+  if (argCount > UINT8_MAX) {
+    return nativeError("Can't pass more than %d arguments to an extension.", UINT8_MAX);
+  }
+
+  LoxValue loxArgs[UINT8_MAX];
+  for (int i = 0; i < argCount; i++) {
+    loxArgs[i] = fromValue(args[i]);
+  }
+
+  int rootCount = temporaryRoots.count;
+  Value result = toValue(function(argCount, loxArgs));
+  temporaryRoots.count = rootCount;
+  return result;
+}
+
+static void apiDefineNative(const char* name, LoxNativeFn function, int arity) {
+  ObjNative* native = defineNative(name, extensionNative, arity);
+  native->data = (void*)function;
+}
+
+static LoxValue apiError(const char* message) {
+  return fromValue(nativeError("%s", message));
+}
+
+static bool apiIsNil(LoxValue value) { return IS_NIL(toValue(value)); }
+static bool apiIsBool(LoxValue value) { return IS_BOOL(toValue(value)); }
+static bool apiIsNumber(LoxValue value) { return IS_NUMBER(toValue(value)); }
+static bool apiIsString(LoxValue value) { return IS_STRING(toValue(value)); }
+
+static bool apiToBool(LoxValue value) { return !isFalsey(toValue(value)); }
+
+static double apiToNumber(LoxValue value) {
+  Value converted = toValue(value);
+  return IS_NUMBER(converted) ? AS_NUMBER(converted) : 0;
+}
+
+static const char* apiStringChars(LoxValue value) {
+  Value converted = toValue(value);
+  return IS_STRING(converted) ? AS_CSTRING(converted) : NULL;
+}
+
+static int apiStringLength(LoxValue value) {
+  Value converted = toValue(value);
+  return IS_STRING(converted) ? AS_STRING(converted)->length : 0;
+}
+
+static LoxValue apiNil() { return fromValue(NIL_VAL); }
+static LoxValue apiBoolean(bool value) { return fromValue(BOOL_VAL(value)); }
+static LoxValue apiNumber(double value) { return fromValue(NUMBER_VAL(value)); }
+
+static LoxValue apiString(const char* chars, int length) {
+  return keepAlive(OBJ_VAL(copyString(chars, length)));
+}
+
+static bool apiCall(LoxValue callee, int argCount, const LoxValue* args, LoxValue* result) {
+  if (argCount > UINT8_MAX) {
+    nativeError("Can't have more than %d arguments.", UINT8_MAX);
+    return false;
+  }
+
+  Value values[UINT8_MAX];
+  for (int i = 0; i < argCount; i++) {
+    values[i] = toValue(args[i]);
+  }
+
+  Value returned;
+  if (!callFunction(toValue(callee), argCount, values, &returned)) return false;
+
+  *result = keepAlive(returned);
+  return true;
+}
+
+static void apiPin(LoxValue value) {
+  Value converted = toValue(value);
+  if (IS_OBJ(converted)) appendRoot(&pinnedValues, converted);
+}
+
+// Pins are matched by identity, since records and the persistent
+// collections can be equal to other objects that are not pinned
+static bool samePin(Value a, Value b) {
+  if (IS_OBJ(a) && IS_OBJ(b)) return AS_OBJ(a) == AS_OBJ(b);
+  return valuesEqual(a, b);
+}
+
+static void apiUnpin(LoxValue value) {
+  Value converted = toValue(value);
+
+  for (int i = pinnedValues.count - 1; i >= 0; i--) {
+    if (samePin(pinnedValues.values[i], converted)) {
+      // Order does not matter, so we fill the hole with the last pin
+      pinnedValues.values[i] = pinnedValues.values[pinnedValues.count - 1];
+      pinnedValues.count--;
+      return;
+    }
+  }
+}
+
+static const LoxApi api = {
+  LOX_API_VERSION,
+  apiDefineNative,
+  apiError,
+  apiIsNil,
+  apiIsBool,
+  apiIsNumber,
+  apiIsString,
+  apiToBool,
+  apiToNumber,
+  apiStringChars,
+  apiStringLength,
+  apiNil,
+  apiBoolean,
+  apiNumber,
+  apiString,
+  apiCall,
+  apiPin,
+  apiUnpin,
+};
+
+static void addHandle(void* handle) {
+  if (handleCapacity < handleCount + 1) {
+    int oldCapacity = handleCapacity;
+    handleCapacity = GROW_CAPACITY(oldCapacity);
+    handles = GROW_ARRAY(void*, handles, oldCapacity, handleCapacity);
+  }
+  handles[handleCount++] = handle;
+}
+
+// loadExtension(path) loads a shared library and lets it register
+// its natives
+static Value loadExtensionNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) {
+    return nativeError("Extension path must be a string.");
+  }
+  const char* path = AS_CSTRING(args[0]);
+
+  void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    return nativeError("Could not load extension: %s", dlerror());
+  }
+
+  LoxExtensionInitFn init = (LoxExtensionInitFn)dlsym(handle, LOX_EXTENSION_INIT);
+  if (init == NULL) {
+    dlclose(handle);
+    return nativeError("'%s' is not a Lox extension.", path);
+  }
+
+  // The library has to stay loaded from here on, since init might
+  // register some natives before failing
+  addHandle(handle);
+
+  int rootCount = temporaryRoots.count;
+  bool initialized = init(&api);
+  temporaryRoots.count = rootCount;
+
+  // Nothing more to report if init raised an error itself
+  if (vm.nativeFailed) return NIL_VAL;
+  if (!initialized) {
+    return nativeError("Extension '%s' failed to initialize.", path);
+  }
+  return NIL_VAL;
+}
+
+void defineExtensionNatives() {
+  defineNative("loadExtension", loadExtensionNative, 1);
+}
+
+void markExtensionRoots() {
+  for (int i = 0; i < temporaryRoots.count; i++) {
+    markValue(temporaryRoots.values[i]);
+  }
+  for (int i = 0; i < pinnedValues.count; i++) {
+    markValue(pinnedValues.values[i]);
+  }
+}
+
+void freeExtensions() {
+  freeValueArray(&temporaryRoots);
+  freeValueArray(&pinnedValues);
+
+  for (int i = 0; i < handleCount; i++) {
+    dlclose(handles[i]);
+  }
+  FREE_ARRAY(void*, handles, handleCapacity);
+  handles = NULL;
+  handleCount = 0;
+  handleCapacity = 0;
+}
@@ -0,0 +1,14 @@
+#ifndef clox_extension_h
+#define clox_extension_h
+
+#include "lox.h"
+
+// Registers loadExtension(), which loads native extensions from
+// shared libraries (see lox.h for the API offered to them)
+void defineExtensionNatives();
+void markExtensionRoots();
+// Unloads all extensions, only to be called once no objects that
+// point into them (i.e. their natives) are left
+void freeExtensions();
+
+#endif
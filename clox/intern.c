@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "table.h"
+
+#define INTERN_MAX_LOAD 0.75
+
+// Takes the place of a removed string, so that probing goes on past it
+static ObjString tombstone;
+#define TOMBSTONE (&tombstone)
+
+static size_t slotsSize(int capacity) {
+  return sizeof(InternSlots) + sizeof(_Atomic(ObjString*)) * capacity;
+}
+
+static InternSlots* newSlots(int capacity) {
+  InternSlots* slots = (InternSlots*)reallocate(NULL, 0, slotsSize(capacity));
+  slots->capacity = capacity;
+  slots->retired = NULL;
+  for (int i = 0; i < capacity; i++) {
+    atomic_init(&slots->slots[i], NULL);
+  }
+  return slots;
+}
+
+static InternSlots* currentSlots(InternTable* table) {
+  // Only called with the lock held or from the thread that owns the
+  // heap, which makes it the only one to change the slots
+  return atomic_load_explicit(&table->slots, memory_order_relaxed);
+}
+
+void initInternTable(InternTable* table) {
+  atomic_init(&table->slots, NULL);
+  table->count = 0;
+}
+
+void freeInternTable(InternTable* table) {
+  InternSlots* slots = currentSlots(table);
+  if (slots != NULL) {
+    freeRetiredInterned(table);
+    reallocate(slots, slotsSize(slots->capacity), 0);
+  }
+  initInternTable(table);
+}
+
+static ObjString* probeInterned(InternSlots* slots, const char* chars, int length,
+                                uint32_t hash) {
+  // There is always an empty slot to stop at, as the table is never
+  // more than three quarters full
+  uint32_t mask = slots->capacity - 1;
+  for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+    ObjString* string = atomic_load_explicit(&slots->slots[index], memory_order_acquire);
+    if (string == NULL) return NULL;
+    if (string != TOMBSTONE && string->hash == hash && string->length == length &&
+        memcmp(string->chars, chars, length) == 0) {
+      return string;
+    }
+  }
+}
+
+#ifdef DEBUG_TABLE_STATS
+// Walks the same slots as the lookup that found string did
+static void countLookup(InternSlots* slots, uint32_t hash, ObjString* string) {
+  int probes = 0;
+  int tombstones = 0;
+  int capacity = slots != NULL ? slots->capacity : 0;
+  for (uint32_t index = hash; capacity > 0; index++) {
+    ObjString* slot = atomic_load_explicit(&slots->slots[index & (capacity - 1)],
+                                           memory_order_relaxed);
+    probes++;
+    if (slot == NULL || slot == string) break;
+    if (slot == TOMBSTONE) tombstones++;
+  }
+  countTableLookup(TABLE_STRINGS, probes, tombstones, string != NULL);
+}
+
+#define COUNT_LOOKUP(slots, hash, string) countLookup(slots, hash, string)
+#define COUNT_RESIZE() countTableResize(TABLE_STRINGS)
+// The count can only be read by whoever is adding a string, so the
+// load is recorded then rather than when looking strings up
+#define COUNT_LOAD(table, slots) countTableLoad(TABLE_STRINGS, (table)->count, (slots)->capacity)
+#else
+#define COUNT_LOOKUP(slots, hash, string) ((void)0)
+#define COUNT_RESIZE() ((void)0)
+#define COUNT_LOAD(table, slots) ((void)0)
+#endif
+
+ObjString* findInterned(InternTable* table, const char* chars, int length,
+                        uint32_t hash) {
+  // The acquire loads pair with the release stores that publish the
+  // slots and the strings, so that we never see either of them half
+  // initialized
+  InternSlots* slots = atomic_load_explicit(&table->slots, memory_order_acquire);
+  ObjString* string = slots != NULL ? probeInterned(slots, chars, length, hash) : NULL;
+  COUNT_LOOKUP(slots, hash, string);
+  return string;
+}
+
+void reserveInterned(InternTable* table) {
+  InternSlots* old = currentSlots(table);
+  int capacity = old != NULL ? old->capacity : 0;
+  if (table->count + 1 <= capacity * INTERN_MAX_LOAD) return;
+
+  // The capacity is always a power of two, so that a mask takes the
+  // place of the modulo
+  InternSlots* slots = newSlots(GROW_CAPACITY(capacity));
+  uint32_t mask = slots->capacity - 1;
+
+  // Tombstones are left behind, so we have to recount
+  table->count = 0;
+  for (int i = 0; i < capacity; i++) {
+    ObjString* string = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+    if (string == NULL || string == TOMBSTONE) continue;
+
+    uint32_t index = string->hash & mask;
+    while (atomic_load_explicit(&slots->slots[index], memory_order_relaxed) != NULL) {
+      index = (index + 1) & mask;
+    }
+    atomic_store_explicit(&slots->slots[index], string, memory_order_relaxed);
+    table->count++;
+  }
+
+  // Threads that are probing the old slots carry on with them, if they
+  // do not find a string there they look again with the lock held
+  if (old != NULL) {
+    slots->retired = old;
+    COUNT_RESIZE();
+  }
+  atomic_store_explicit(&table->slots, slots, memory_order_release);
+}
+
+void addInterned(InternTable* table, ObjString* string) {
+  InternSlots* slots = currentSlots(table);
+  uint32_t mask = slots->capacity - 1;
+  uint32_t index = string->hash & mask;
+  for (;;) {
+    ObjString* current = atomic_load_explicit(&slots->slots[index], memory_order_relaxed);
+    if (current == NULL) {
+      table->count++;
+      break;
+    }
+    // The string is known not to be in the table, so it can take the
+    // place of the first removed one
+    if (current == TOMBSTONE) break;
+    index = (index + 1) & mask;
+  }
+
+  atomic_store_explicit(&slots->slots[index], string, memory_order_release);
+  COUNT_LOAD(table, slots);
+}
+
+void removeWhiteInterned(InternTable* table) {
+  InternSlots* slots = currentSlots(table);
+  if (slots == NULL) return;
+
+  for (int i = 0; i < slots->capacity; i++) {
+    ObjString* string = atomic_load_explicit(&slots->slots[i], memory_order_relaxed);
+    if (string != NULL && string != TOMBSTONE && !string->obj.isMarked) {
+      atomic_store_explicit(&slots->slots[i], TOMBSTONE, memory_order_relaxed);
+    }
+  }
+}
+
+void freeRetiredInterned(InternTable* table) {
+  InternSlots* slots = currentSlots(table);
+  if (slots == NULL) return;
+
+  InternSlots* retired = slots->retired;
+  while (retired != NULL) {
+    InternSlots* next = retired->retired;
+    reallocate(retired, slotsSize(retired->capacity), 0);
+    retired = next;
+  }
+  slots->retired = NULL;
+}
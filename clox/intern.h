@@ -0,0 +1,48 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include <stdatomic.h>
+
+#include "object.h"
+
+// Slots of the intern table, a new array replaces the old one when the
+// table grows
+typedef struct InternSlots {
+  int capacity;
+  // Arrays that were replaced while other threads could still be
+  // probing them are kept in a list until that is no longer the case
+  struct InternSlots* retired;
+  _Atomic(ObjString*) slots[];
+} InternSlots;
+
+// The set of interned strings, which is an open addressing hash set.
+//
+// Finding a string never takes a lock, so threads that share the heap
+// can look up strings and compare them by identity at the same time.
+// Adding a string takes a lock of its own while the heap is shared, and
+// publishes the string only once it is fully initialized. Strings are
+// only removed by the GC, which never runs while the heap is shared.
+typedef struct {
+  _Atomic(InternSlots*) slots;
+  // Strings and tombstones in the slots
+  int count;
+} InternTable;
+
+void initInternTable(InternTable* table);
+void freeInternTable(InternTable* table);
+// Returns the interned string with these characters, or NULL
+ObjString* findInterned(InternTable* table, const char* chars, int length,
+                        uint32_t hash);
+// Adding a string is done in three steps, with the lock taken by
+// lockInterning() held throughout: reserving room in the table,
+// creating the string and adding it. Nothing is allocated while adding
+// it, so the string does not have to be rooted in the meantime.
+void reserveInterned(InternTable* table);
+void addInterned(InternTable* table, ObjString* string);
+// Drops the strings that the GC did not mark
+void removeWhiteInterned(InternTable* table);
+// Frees the arrays that were replaced, which only threads that share
+// the heap could still be looking at
+void freeRetiredInterned(InternTable* table);
+
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "intrinsic.h"
+#include "vm.h"
+
+typedef struct {
+  const char* name;
+  int arity;
+  NativeFn native;
+} IntrinsicInfo;
+
+// Each native needs its own function, as natives don't get to know
+// which global they were called through
+static Value applyNative(Intrinsic intrinsic, Value* args) {
+  int arity = intrinsicArity(intrinsic);
+  for (int i = 0; i < arity; i++) {
+    if (!IS_NUMBER(args[i])) return nativeError("Arguments must be numbers.");
+  }
+
+  double b = arity == 2 ? AS_NUMBER(args[1]) : 0;
+  return NUMBER_VAL(applyIntrinsic(intrinsic, AS_NUMBER(args[0]), b));
+}
+
+static Value absNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_ABS, args);
+}
+
+static Value ceilNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_CEIL, args);
+}
+
+static Value cosNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_COS, args);
+}
+
+static Value expNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_EXP, args);
+}
+
+static Value floorNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_FLOOR, args);
+}
+
+static Value logNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_LOG, args);
+}
+
+static Value maxNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_MAX, args);
+}
+
+static Value minNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_MIN, args);
+}
+
+static Value powNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_POW, args);
+}
+
+static Value sinNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_SIN, args);
+}
+
+static Value sqrtNative(int argCount, Value* args) {
+  return applyNative(INTRINSIC_SQRT, args);
+}
+
+// In the order of the Intrinsic enum
+static const IntrinsicInfo intrinsics[] = {
+  {"abs", 1, absNative},
+  {"ceil", 1, ceilNative},
+  {"cos", 1, cosNative},
+  {"exp", 1, expNative},
+  {"floor", 1, floorNative},
+  {"log", 1, logNative},
+  {"max", 2, maxNative},
+  {"min", 2, minNative},
+  {"pow", 2, powNative},
+  {"sin", 1, sinNative},
+  {"sqrt", 1, sqrtNative},
+};
+
+int findIntrinsic(const char* name, int length) {
+  if (length > INTRINSIC_NAME_MAX) return -1;
+
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    if ((int)strlen(intrinsics[i].name) == length &&
+        memcmp(intrinsics[i].name, name, length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char* intrinsicName(Intrinsic intrinsic) {
+  return intrinsics[intrinsic].name;
+}
+
+int intrinsicArity(Intrinsic intrinsic) {
+  return intrinsics[intrinsic].arity;
+}
+
+void defineIntrinsicNatives() {
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    defineNative(intrinsics[i].name, intrinsics[i].native, intrinsics[i].arity);
+    // The name is the key of the global that was just defined, so it
+    // is interned already
+    vm.intrinsicNames[i] = copyString(intrinsics[i].name, (int)strlen(intrinsics[i].name));
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef clox_intrinsic_h
+#define clox_intrinsic_h
+
+#include <math.h>
+
+#include "common.h"
+
+// Math functions that the compiler turns into OP_INTRINSIC rather than
+// a call, when their name refers to the global of that name. Calls with
+// the wrong number of arguments, or to a global that has been redefined,
+// fall back to calling whatever the global holds.
+typedef enum {
+  INTRINSIC_ABS,
+  INTRINSIC_CEIL,
+  INTRINSIC_COS,
+  INTRINSIC_EXP,
+  INTRINSIC_FLOOR,
+  INTRINSIC_LOG,
+  INTRINSIC_MAX,
+  INTRINSIC_MIN,
+  INTRINSIC_POW,
+  INTRINSIC_SIN,
+  INTRINSIC_SQRT,
+  INTRINSIC_COUNT,
+} Intrinsic;
+
+// None of the names are longer than this, so longer names can be ruled
+// out without comparing them
+#define INTRINSIC_NAME_MAX 5
+
+// Returns the intrinsic with the given name, or -1
+int findIntrinsic(const char* name, int length);
+const char* intrinsicName(Intrinsic intrinsic);
+int intrinsicArity(Intrinsic intrinsic);
+
+// Shared by OP_INTRINSIC and the natives, b is ignored by the functions
+// of a single argument
+static inline double applyIntrinsic(Intrinsic intrinsic, double a, double b) {
+  switch (intrinsic) {
+    case INTRINSIC_ABS: return fabs(a);
+    case INTRINSIC_CEIL: return ceil(a);
+    case INTRINSIC_COS: return cos(a);
+    case INTRINSIC_EXP: return exp(a);
+    case INTRINSIC_FLOOR: return floor(a);
+    case INTRINSIC_LOG: return log(a);
+    case INTRINSIC_MAX: return fmax(a, b);
+    case INTRINSIC_MIN: return fmin(a, b);
+    case INTRINSIC_POW: return pow(a, b);
+    case INTRINSIC_SIN: return sin(a);
+    case INTRINSIC_SQRT: return sqrt(a);
+    default: return 0;
+  }
+}
+
+// Registers the intrinsics as natives, which are what a call goes to
+// when it can't use OP_INTRINSIC (e.g. when the function is passed
+// around as a value)
+void defineIntrinsicNatives();
+
+#endif
@@ -0,0 +1,723 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "json.h"
+#include "memory.h"
+#include "persistent.h"
+#include "vm.h"
+
+// Deepest nesting of arrays and objects that parsing and encoding
+// recurse into
+#define MAX_DEPTH 10000
+
+typedef struct {
+  const char* start;
+  const char* current;
+  const char* end;
+
+  // Strings with escapes in them are decoded into here before they are
+  // copied into a string object
+  char* scratch;
+  int scratchCount;
+  int scratchCapacity;
+
+  int depth;
+  // Set once the input turns out to be invalid, after the error has
+  // been reported
+  bool failed;
+} Parser;
+
+typedef struct {
+  ByteArray output;
+  int depth;
+  // Set once a value turns out not to be encodable, after the error has
+  // been reported
+  bool failed;
+} Writer;
+
+// Returns the number of bytes before the first quote, backslash or
+// control character, which are the only ones that need a closer look
+// inside a string, both when parsing and when encoding. Looks at 16
+// bytes at a time where SSE2 is available.
+static int findSpecial(const char* chars, int length) {
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i quotes = _mm_set1_epi8('"');
+  __m128i backslashes = _mm_set1_epi8('\\');
+  __m128i lastControl = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(chars + i));
+    // A byte is a control character if it is unchanged by taking the
+    // unsigned maximum with 0x1f
+    __m128i controls = _mm_cmpeq_epi8(_mm_max_epu8(chunk, lastControl), lastControl);
+    __m128i matches = _mm_or_si128(
+        controls,
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quotes), _mm_cmpeq_epi8(chunk, backslashes)));
+
+    int mask = _mm_movemask_epi8(matches);
+    if (mask != 0) {
+      while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+      }
+      return i;
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    uint8_t c = (uint8_t)chars[i];
+    if (c == '"' || c == '\\' || c < 0x20) return i;
+  }
+  return length;
+}
+
+static void parseError(Parser* parser, const char* message) {
+  if (!parser->failed) {
+    nativeError("%s at offset %d.", message, (int)(parser->current - parser->start));
+  }
+  parser->failed = true;
+}
+
+static void skipWhitespace(Parser* parser) {
+  while (parser->current < parser->end) {
+    switch (*parser->current) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        parser->current++;
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+// Skips whitespace and then the character, which has to be there
+static bool consume(Parser* parser, char c, const char* message) {
+  skipWhitespace(parser);
+  if (parser->current < parser->end && *parser->current == c) {
+    parser->current++;
+    return true;
+  }
+  parseError(parser, parser->current == parser->end ? "Unexpected end of JSON" : message);
+  return false;
+}
+
+static bool matchLiteral(Parser* parser, const char* literal) {
+  size_t length = strlen(literal);
+  if ((size_t)(parser->end - parser->current) < length ||
+      memcmp(parser->current, literal, length) != 0) {
+    parseError(parser, "Unexpected character in JSON");
+    return false;
+  }
+  parser->current += length;
+  return true;
+}
+
+static void appendScratch(Parser* parser, const char* chars, int length) {
+  if (length == 0) return;
+  if (parser->scratchCapacity < parser->scratchCount + length) {
+    int oldCapacity = parser->scratchCapacity;
+    while (parser->scratchCapacity < parser->scratchCount + length) {
+      parser->scratchCapacity = GROW_CAPACITY(parser->scratchCapacity);
+    }
+    parser->scratch = GROW_ARRAY(char, parser->scratch, oldCapacity, parser->scratchCapacity);
+  }
+
+  memcpy(parser->scratch + parser->scratchCount, chars, length);
+  parser->scratchCount += length;
+}
+
+// Reads the 4 hex digits of a \u escape, or returns -1
+static int readHex(Parser* parser) {
+  if (parser->end - parser->current < 4) return -1;
+
+  int code = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = *parser->current++;
+    code <<= 4;
+    if (c >= '0' && c <= '9') {
+      code |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      code |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      code |= c - 'A' + 10;
+    } else {
+      return -1;
+    }
+  }
+  return code;
+}
+
+static void appendUtf8(Parser* parser, int code) {
+  char bytes[4];
+  int length;
+  if (code < 0x80) {
+    bytes[0] = (char)code;
+    length = 1;
+  } else if (code < 0x800) {
+    bytes[0] = (char)(0xc0 | (code >> 6));
+    bytes[1] = (char)(0x80 | (code & 0x3f));
+    length = 2;
+  } else if (code < 0x10000) {
+    bytes[0] = (char)(0xe0 | (code >> 12));
+    bytes[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+    bytes[2] = (char)(0x80 | (code & 0x3f));
+    length = 3;
+  } else {
+    bytes[0] = (char)(0xf0 | (code >> 18));
+    bytes[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    bytes[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    bytes[3] = (char)(0x80 | (code & 0x3f));
+    length = 4;
+  }
+  appendScratch(parser, bytes, length);
+}
+
+// Decodes a \u escape, with the backslash and 'u' already consumed.
+// Surrogate pairs are combined, and unpaired surrogates become U+FFFD.
+static bool parseUnicodeEscape(Parser* parser) {
+  int code = readHex(parser);
+  if (code < 0) return false;
+
+  if (code >= 0xd800 && code <= 0xdbff) {
+    const char* low = parser->current;
+    int next = -1;
+    if (parser->end - low >= 2 && low[0] == '\\' && low[1] == 'u') {
+      parser->current += 2;
+      next = readHex(parser);
+    }
+
+    if (next >= 0xdc00 && next <= 0xdfff) {
+      code = 0x10000 + ((code - 0xd800) << 10) + (next - 0xdc00);
+    } else {
+      // Leave whatever followed to be parsed on its own
+      parser->current = low;
+      code = 0xfffd;
+    }
+  } else if (code >= 0xdc00 && code <= 0xdfff) {
+    code = 0xfffd;
+  }
+
+  appendUtf8(parser, code);
+  return true;
+}
+
+// Parses a string after its opening quote. Strings without escapes,
+// which is most of them, are copied straight from the input.
+static ObjString* parseString(Parser* parser) {
+  const char* segment = parser->current;
+  bool escaped = false;
+  parser->scratchCount = 0;
+
+  for (;;) {
+    parser->current += findSpecial(parser->current, (int)(parser->end - parser->current));
+    if (parser->current == parser->end) {
+      parseError(parser, "Unterminated string in JSON");
+      return NULL;
+    }
+
+    char c = *parser->current;
+    if (c == '"') break;
+    if (c != '\\') {
+      parseError(parser, "Control character in JSON string");
+      return NULL;
+    }
+
+    appendScratch(parser, segment, (int)(parser->current - segment));
+    escaped = true;
+    parser->current++;
+    if (parser->current == parser->end) {
+      parseError(parser, "Unterminated string in JSON");
+      return NULL;
+    }
+
+    char escape = *parser->current++;
+    char decoded;
+    switch (escape) {
+      case '"': decoded = '"'; break;
+      case '\\': decoded = '\\'; break;
+      case '/': decoded = '/'; break;
+      case 'b': decoded = '\b'; break;
+      case 'f': decoded = '\f'; break;
+      case 'n': decoded = '\n'; break;
+      case 'r': decoded = '\r'; break;
+      case 't': decoded = '\t'; break;
+      case 'u':
+        if (!parseUnicodeEscape(parser)) {
+          parseError(parser, "Invalid escape in JSON string");
+          return NULL;
+        }
+        segment = parser->current;
+        continue;
+      default:
+        parser->current--;
+        parseError(parser, "Invalid escape in JSON string");
+        return NULL;
+    }
+    appendScratch(parser, &decoded, 1);
+    segment = parser->current;
+  }
+
+  const char* chars = segment;
+  int length = (int)(parser->current - segment);
+  if (escaped) {
+    appendScratch(parser, segment, length);
+    chars = parser->scratch;
+    length = parser->scratchCount;
+  }
+  parser->current++;
+  return copyString(chars, length);
+}
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Integers of up to 15 digits are exact as doubles, so they are
+// accumulated directly and only other numbers go through strtod()
+static Value parseNumber(Parser* parser) {
+  const char* begin = parser->current;
+  const char* current = begin;
+  const char* end = parser->end;
+  bool negative = false;
+  if (*current == '-') {
+    negative = true;
+    current++;
+  }
+
+  if (current == end || !isDigit(*current)) {
+    parser->current = current;
+    parseError(parser, "Invalid number in JSON");
+    return NIL_VAL;
+  }
+
+  int64_t integer = 0;
+  int digits = 0;
+  if (*current == '0') {
+    current++;
+    if (current < end && isDigit(*current)) {
+      parser->current = current;
+      parseError(parser, "Leading zero in JSON number");
+      return NIL_VAL;
+    }
+  } else {
+    while (current < end && isDigit(*current)) {
+      integer = integer * 10 + (*current++ - '0');
+      digits++;
+      if (digits > 15) break;
+    }
+  }
+
+  bool exact = digits <= 15;
+  if (current < end && (*current == '.' || *current == 'e' || *current == 'E' ||
+                        isDigit(*current))) {
+    exact = false;
+    while (current < end && isDigit(*current)) current++;
+
+    if (current < end && *current == '.') {
+      current++;
+      if (current == end || !isDigit(*current)) {
+        parser->current = current;
+        parseError(parser, "Invalid number in JSON");
+        return NIL_VAL;
+      }
+      while (current < end && isDigit(*current)) current++;
+    }
+
+    if (current < end && (*current == 'e' || *current == 'E')) {
+      current++;
+      if (current < end && (*current == '+' || *current == '-')) current++;
+      if (current == end || !isDigit(*current)) {
+        parser->current = current;
+        parseError(parser, "Invalid number in JSON");
+        return NIL_VAL;
+      }
+      while (current < end && isDigit(*current)) current++;
+    }
+  }
+
+  parser->current = current;
+  if (exact) {
+    // Keeps the sign of -0
+    double number = (double)integer;
+    return NUMBER_VAL(negative ? -number : number);
+  }
+
+  // The input is a string, so it is terminated and strtod() can't run
+  // off its end. What it parses has been checked to be a JSON number,
+  // which strtod() accepts all of.
+  return NUMBER_VAL(strtod(begin, NULL));
+}
+
+static Value parseValue(Parser* parser);
+
+// Parsing keeps every array and object that it is in the middle of on
+// the VM's stack, along with a key or an item, so how deep the input
+// can nest also depends on how much of the stack the caller uses
+static bool checkStack(Parser* parser, int slots) {
+  if (vm.stackTop + slots <= vm.stack + STACK_MAX) return true;
+  parseError(parser, "JSON is nested too deeply");
+  return false;
+}
+
+static Value parseArray(Parser* parser) {
+  if (!checkStack(parser, 2)) return NIL_VAL;
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+
+  skipWhitespace(parser);
+  if (parser->current < parser->end && *parser->current == ']') {
+    parser->current++;
+    return pop();
+  }
+
+  for (;;) {
+    Value item = parseValue(parser);
+    if (parser->failed) break;
+    push(item);
+    writeValueArray(&list->items, item);
+    pop();
+
+    skipWhitespace(parser);
+    if (parser->current < parser->end && *parser->current == ']') {
+      parser->current++;
+      break;
+    }
+    if (!consume(parser, ',', "Expected ',' or ']' in JSON")) break;
+  }
+  return pop();
+}
+
+// Objects become hash maps, which are filled in place since nothing
+// refers to them yet
+static Value parseObject(Parser* parser) {
+  if (!checkStack(parser, 3)) return NIL_VAL;
+  ObjHashMap* map = newHashMap();
+  push(OBJ_VAL(map));
+  beginTransient((Obj*)map);
+
+  skipWhitespace(parser);
+  if (parser->current < parser->end && *parser->current == '}') {
+    parser->current++;
+    endTransient((Obj*)map);
+    return pop();
+  }
+
+  for (;;) {
+    if (!consume(parser, '"', "Expected a string key in JSON")) break;
+    ObjString* key = parseString(parser);
+    if (key == NULL) break;
+    push(OBJ_VAL(key));
+
+    if (!consume(parser, ':', "Expected ':' in JSON")) {
+      pop();
+      break;
+    }
+    push(parseValue(parser));
+    if (!parser->failed) transientSet(map, vm.stackTop[-2], vm.stackTop[-1]);
+    pop();
+    pop();
+    if (parser->failed) break;
+
+    skipWhitespace(parser);
+    if (parser->current < parser->end && *parser->current == '}') {
+      parser->current++;
+      break;
+    }
+    if (!consume(parser, ',', "Expected ',' or '}' in JSON")) break;
+  }
+
+  endTransient((Obj*)map);
+  return pop();
+}
+
+static Value parseValue(Parser* parser) {
+  if (parser->failed) return NIL_VAL;
+  if (++parser->depth > MAX_DEPTH) {
+    parseError(parser, "JSON is nested too deeply");
+    return NIL_VAL;
+  }
+
+  skipWhitespace(parser);
+  if (parser->current == parser->end) {
+    parseError(parser, "Unexpected end of JSON");
+    return NIL_VAL;
+  }
+
+  Value value = NIL_VAL;
+  switch (*parser->current) {
+    case '{':
+      parser->current++;
+      value = parseObject(parser);
+      break;
+    case '[':
+      parser->current++;
+      value = parseArray(parser);
+      break;
+    case '"': {
+      parser->current++;
+      ObjString* string = parseString(parser);
+      if (string != NULL) value = OBJ_VAL(string);
+      break;
+    }
+    case 't':
+      if (matchLiteral(parser, "true")) value = BOOL_VAL(true);
+      break;
+    case 'f':
+      if (matchLiteral(parser, "false")) value = BOOL_VAL(false);
+      break;
+    case 'n':
+      matchLiteral(parser, "null");
+      break;
+    default:
+      if (*parser->current == '-' || isDigit(*parser->current)) {
+        value = parseNumber(parser);
+      } else {
+        parseError(parser, "Unexpected character in JSON");
+      }
+      break;
+  }
+
+  parser->depth--;
+  return parser->failed ? NIL_VAL : value;
+}
+
+static void writeChars(Writer* writer, const char* chars, int length) {
+  writeByteArray(&writer->output, chars, length);
+}
+
+static void writeChar(Writer* writer, char c) {
+  writeChars(writer, &c, 1);
+}
+
+static void encodeNumber(Writer* writer, double number) {
+  if (isnan(number) || isinf(number)) {
+    nativeError("Can't encode NaN or infinity as JSON.");
+    writer->failed = true;
+    return;
+  }
+
+  char digits[32];
+  // Integers, by far the most common numbers, are formatted by hand.
+  // -0 is left to snprintf() so that it keeps its sign.
+  if (number == floor(number) && fabs(number) < 1e15 &&
+      !(number == 0 && signbit(number))) {
+    int64_t integer = (int64_t)number;
+    uint64_t magnitude = integer < 0 ? -(uint64_t)integer : (uint64_t)integer;
+    int length = 0;
+    char* end = digits + sizeof(digits);
+    do {
+      *--end = (char)('0' + magnitude % 10);
+      magnitude /= 10;
+      length++;
+    } while (magnitude != 0);
+    if (integer < 0) {
+      *--end = '-';
+      length++;
+    }
+    writeChars(writer, end, length);
+    return;
+  }
+
+  // The fewest digits that read back as the same number, 17 always do.
+  // Any 15 digits read back as the same normal double, and %g drops the
+  // trailing zeros, so the search can start at 15. Subnormals have fewer
+  // bits, so fewer digits might still tell them apart.
+  int length;
+  int shortest = fabs(number) < DBL_MIN ? 1 : 15;
+  for (int precision = shortest; precision <= 17; precision++) {
+    length = snprintf(digits, sizeof(digits), "%.*g", precision, number);
+    if (strtod(digits, NULL) == number) break;
+  }
+  writeChars(writer, digits, length);
+}
+
+static void encodeString(Writer* writer, ObjString* string) {
+  const char* chars = string->chars;
+  int length = string->length;
+  writeChar(writer, '"');
+
+  for (;;) {
+    int plain = findSpecial(chars, length);
+    writeChars(writer, chars, plain);
+    if (plain == length) break;
+
+    uint8_t c = (uint8_t)chars[plain];
+    switch (c) {
+      case '"': writeChars(writer, "\\\"", 2); break;
+      case '\\': writeChars(writer, "\\\\", 2); break;
+      case '\b': writeChars(writer, "\\b", 2); break;
+      case '\f': writeChars(writer, "\\f", 2); break;
+      case '\n': writeChars(writer, "\\n", 2); break;
+      case '\r': writeChars(writer, "\\r", 2); break;
+      case '\t': writeChars(writer, "\\t", 2); break;
+      default: {
+        char escape[7];
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        writeChars(writer, escape, 6);
+        break;
+      }
+    }
+    chars += plain + 1;
+    length -= plain + 1;
+  }
+
+  writeChar(writer, '"');
+}
+
+static void encodeValue(Writer* writer, Value value);
+
+// Writes the key and value pairs of a hash map, with a comma before
+// each one unless first is still set
+static void encodeNode(Writer* writer, ObjTrieNode* node, bool* first) {
+  for (int i = 0; i < node->count && !writer->failed; i += 2) {
+    if (IS_TRIE_NODE(node->slots[i])) {
+      encodeNode(writer, AS_TRIE_NODE(node->slots[i]), first);
+      continue;
+    }
+
+    if (!IS_STRING(node->slots[i])) {
+      nativeError("Can only encode hash maps with string keys as JSON.");
+      writer->failed = true;
+      return;
+    }
+    if (!*first) writeChar(writer, ',');
+    *first = false;
+    encodeString(writer, AS_STRING(node->slots[i]));
+    writeChar(writer, ':');
+    encodeValue(writer, node->slots[i + 1]);
+  }
+}
+
+static void encodeObject(Writer* writer, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:
+      encodeString(writer, (ObjString*)object);
+      break;
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)object;
+      writeChar(writer, '[');
+      for (int i = 0; i < list->items.count && !writer->failed; i++) {
+        if (i > 0) writeChar(writer, ',');
+        encodeValue(writer, list->items.values[i]);
+      }
+      writeChar(writer, ']');
+      break;
+    }
+    case OBJ_VECTOR: {
+      ObjVector* vector = (ObjVector*)object;
+      writeChar(writer, '[');
+      for (int i = 0; i < vector->count && !writer->failed; i++) {
+        if (i > 0) writeChar(writer, ',');
+        encodeValue(writer, vectorGet(vector, i));
+      }
+      writeChar(writer, ']');
+      break;
+    }
+    case OBJ_HASH_MAP: {
+      ObjHashMap* map = (ObjHashMap*)object;
+      bool first = true;
+      writeChar(writer, '{');
+      if (map->root != NULL_REF) {
+        encodeNode(writer, REF_PTR(ObjTrieNode, map->root), &first);
+      }
+      writeChar(writer, '}');
+      break;
+    }
+    // The fields of an instance become the members of an object
+    case OBJ_INSTANCE: {
+      Table* fields = &((ObjInstance*)object)->fields;
+      bool first = true;
+      writeChar(writer, '{');
+      for (int i = 0; i < fields->capacity && !writer->failed; i++) {
+        Entry* entry = &fields->entries[i];
+        if (entry->key == NULL_REF) continue;
+        if (!first) writeChar(writer, ',');
+        first = false;
+        encodeString(writer, REF_PTR(ObjString, entry->key));
+        writeChar(writer, ':');
+        encodeValue(writer, entryValue(entry));
+      }
+      writeChar(writer, '}');
+      break;
+    }
+    default:
+      nativeError("Can only encode nil, booleans, numbers, strings, lists, "
+                  "vectors, hash maps and instances as JSON.");
+      writer->failed = true;
+      break;
+  }
+}
+
+static void encodeValue(Writer* writer, Value value) {
+  if (writer->failed) return;
+  // This is also what stops cycles
+  if (++writer->depth > MAX_DEPTH) {
+    nativeError("Value is nested too deeply to encode as JSON.");
+    writer->failed = true;
+    return;
+  }
+
+  if (IS_NIL(value)) {
+    writeChars(writer, "null", 4);
+  } else if (IS_BOOL(value)) {
+    if (AS_BOOL(value)) {
+      writeChars(writer, "true", 4);
+    } else {
+      writeChars(writer, "false", 5);
+    }
+  } else if (IS_NUMBER(value)) {
+    encodeNumber(writer, AS_NUMBER(value));
+  } else {
+    encodeObject(writer, AS_OBJ(value));
+  }
+
+  writer->depth--;
+}
+
+// jsonParse(string) returns the value that the JSON text stands for.
+// Arrays become lists and objects become hash maps with string keys.
+static Value jsonParseNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) return nativeError("Argument must be a string.");
+  ObjString* string = AS_STRING(args[0]);
+
+  Parser parser = { string->chars, string->chars, string->chars + string->length,
+                    NULL, 0, 0, 0, false };
+  Value value = parseValue(&parser);
+  if (!parser.failed) {
+    skipWhitespace(&parser);
+    if (parser.current != parser.end) parseError(&parser, "Unexpected character in JSON");
+  }
+
+  FREE_ARRAY(char, parser.scratch, parser.scratchCapacity);
+  return parser.failed ? NIL_VAL : value;
+}
+
+// jsonStringify(value) returns the value as compact JSON text
+static Value jsonStringifyNative(int argCount, Value* args) {
+  Writer writer = { {0, 0, NULL}, 0, false };
+  encodeValue(&writer, args[0]);
+
+  Value result = NIL_VAL;
+  if (!writer.failed) {
+    result = OBJ_VAL(copyString((const char*)writer.output.bytes, writer.output.count));
+  }
+  freeByteArray(&writer.output);
+  return result;
+}
+
+void defineJsonNatives() {
+  defineNative("jsonParse", jsonParseNative, 1);
+  defineNative("jsonStringify", jsonStringifyNative, 1);
+}
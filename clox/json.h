@@ -0,0 +1,10 @@
+#ifndef clox_json_h
+#define clox_json_h
+
+#include "object.h"
+
+// Registers jsonParse() and jsonStringify(), which convert between JSON
+// text and lists, hash maps, strings, numbers, booleans and nil
+void defineJsonNatives();
+
+#endif
@@ -0,0 +1,224 @@
+#include "list.h"
+#include "memory.h"
+#include "vm.h"
+
+// Returns false (after reporting the error) if the value is not
+// a valid index into the list
+static bool checkIndex(ObjList* list, Value index) {
+  if (!IS_NUMBER(index)) {
+    nativeError("List index must be a number.");
+    return false;
+  }
+
+  double number = AS_NUMBER(index);
+  if (number < 0 || number >= list->items.count || number != (int)number) {
+    nativeError("List index out of bounds.");
+    return false;
+  }
+  return true;
+}
+
+static bool checkList(Value value) {
+  if (!IS_LIST(value)) {
+    nativeError("Argument must be a list.");
+    return false;
+  }
+  return true;
+}
+
+// Appends a value that is not reachable from anywhere else yet, which
+// has to be protected since growing the list can trigger a GC
+static void appendValue(ObjList* list, Value value) {
+  push(value);
+  writeValueArray(&list->items, value);
+  pop();
+}
+
+// list(a, b, ...) creates a list of its arguments
+static Value listNative(int argCount, Value* args) {
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+  for (int i = 0; i < argCount; i++) {
+    writeValueArray(&list->items, args[i]);
+  }
+  pop();
+  return OBJ_VAL(list);
+}
+
+static Value listAppendNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+
+  writeValueArray(&AS_LIST(args[0])->items, args[1]);
+  return args[1];
+}
+
+static Value listGetNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+  if (!checkIndex(list, args[1])) return NIL_VAL;
+
+  return list->items.values[(int)AS_NUMBER(args[1])];
+}
+
+static Value listSetNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+  if (!checkIndex(list, args[1])) return NIL_VAL;
+
+  list->items.values[(int)AS_NUMBER(args[1])] = args[2];
+  return args[2];
+}
+
+static Value listLengthNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+
+  return NUMBER_VAL(AS_LIST(args[0])->items.count);
+}
+
+// The higher-order functions below call back into Lox for every item.
+// The callback is free to modify the list that is being iterated over,
+// so we always go through the list again instead of holding on to a
+// pointer into its items, and we stop once we run past the end.
+
+static Value forEachNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+
+  for (int i = 0; i < list->items.count; i++) {
+    Value item = list->items.values[i];
+    Value ignored;
+    if (!callFunction(args[1], 1, &item, &ignored)) return NIL_VAL;
+  }
+  return NIL_VAL;
+}
+
+static Value mapNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+
+  ObjList* result = newList();
+  push(OBJ_VAL(result));
+
+  for (int i = 0; i < list->items.count; i++) {
+    Value item = list->items.values[i];
+    Value mapped;
+    if (!callFunction(args[1], 1, &item, &mapped)) return NIL_VAL;
+    appendValue(result, mapped);
+  }
+
+  pop();
+  return OBJ_VAL(result);
+}
+
+static Value filterNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+
+  ObjList* result = newList();
+  push(OBJ_VAL(result));
+
+  for (int i = 0; i < list->items.count; i++) {
+    Value item = list->items.values[i];
+    Value keep;
+    if (!callFunction(args[1], 1, &item, &keep)) return NIL_VAL;
+    if (!isFalsey(keep)) appendValue(result, item);
+  }
+
+  pop();
+  return OBJ_VAL(result);
+}
+
+// reduce(list, fn, initial) folds the list from the left
+static Value reduceNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+
+  Value accumulator = args[2];
+  for (int i = 0; i < list->items.count; i++) {
+    Value callArgs[2] = { accumulator, list->items.values[i] };
+    if (!callFunction(args[1], 2, callArgs, &accumulator)) return NIL_VAL;
+  }
+  return accumulator;
+}
+
+// Merges the sorted runs from[start, middle) and from[middle, end)
+// into the same range of to
+static bool merge(Value less, ValueArray* from, ValueArray* to,
+                  int start, int middle, int end) {
+  int left = start;
+  int right = middle;
+
+  for (int i = start; i < end; i++) {
+    bool takeRight;
+    if (left >= middle) {
+      takeRight = true;
+    } else if (right >= end) {
+      takeRight = false;
+    } else {
+      // Only taking from the right when it is strictly less keeps
+      // the sort stable
+      Value callArgs[2] = { from->values[right], from->values[left] };
+      Value isLess;
+      if (!callFunction(less, 2, callArgs, &isLess)) return false;
+      takeRight = !isFalsey(isLess);
+    }
+
+    to->values[i] = takeRight ? from->values[right++] : from->values[left++];
+  }
+  return true;
+}
+
+// sort(list, less) returns a sorted copy of the list, where less(a, b)
+// tells whether a belongs before b. The sort is stable.
+static Value sortNative(int argCount, Value* args) {
+  if (!checkList(args[0])) return NIL_VAL;
+  ObjList* list = AS_LIST(args[0]);
+
+  // Bottom-up merge sort that goes back and forth between two lists,
+  // both of which are on the stack since the comparator can trigger a GC
+  ObjList* result = newList();
+  push(OBJ_VAL(result));
+  ObjList* scratch = newList();
+  push(OBJ_VAL(scratch));
+
+  int count = list->items.count;
+  for (int i = 0; i < count; i++) {
+    writeValueArray(&result->items, list->items.values[i]);
+    writeValueArray(&scratch->items, list->items.values[i]);
+  }
+
+  ValueArray* from = &result->items;
+  ValueArray* to = &scratch->items;
+  for (int width = 1; width < count; width *= 2) {
+    for (int start = 0; start < count; start += 2 * width) {
+      int middle = start + width < count ? start + width : count;
+      int end = start + 2 * width < count ? start + 2 * width : count;
+      if (!merge(args[1], from, to, start, middle, end)) return NIL_VAL;
+    }
+
+    ValueArray* swap = from;
+    from = to;
+    to = swap;
+  }
+
+  // Depending on the number of passes, the sorted values
+  // might have ended up in the scratch list
+  Value sorted = from == &result->items ? OBJ_VAL(result) : OBJ_VAL(scratch);
+  pop();
+  pop();
+  return sorted;
+}
+
+void defineListNatives() {
+  defineNative("list", listNative, -1);
+  defineNative("listAppend", listAppendNative, 2);
+  defineNative("listGet", listGetNative, 2);
+  defineNative("listSet", listSetNative, 3);
+  defineNative("listLength", listLengthNative, 1);
+
+  defineNative("forEach", forEachNative, 2);
+  defineNative("map", mapNative, 2);
+  defineNative("filter", filterNative, 2);
+  defineNative("reduce", reduceNative, 3);
+  defineNative("sort", sortNative, 2);
+}
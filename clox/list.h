@@ -0,0 +1,10 @@
+#ifndef clox_list_h
+#define clox_list_h
+
+#include "object.h"
+
+// Registers the natives for creating and manipulating lists, along with
+// the higher-order functions (map, filter, etc) that operate on them
+void defineListNatives();
+
+#endif
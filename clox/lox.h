@@ -0,0 +1,86 @@
+#ifndef clox_lox_h
+#define clox_lox_h
+
+// This is the only clox header that native extensions include. It does
+// not depend on any other part of clox, and everything in here is kept
+// stable across versions of the VM, the layout of values and objects is
+// hidden behind the functions of LoxApi.
+//
+// An extension is a shared library that exports a loxExtensionInit
+// function, which clox calls once when the library is loaded through
+// loadExtension("path/to/lib.so"):
+//
+//   static const LoxApi* lox;
+//
+//   static LoxValue square(int argCount, const LoxValue* args) {
+//     if (!lox->isNumber(args[0])) return lox->error("Expected a number.");
+//     double n = lox->toNumber(args[0]);
+//     return lox->number(n * n);
+//   }
+//
+//   bool loxExtensionInit(const LoxApi* api) {
+//     if (api->version < LOX_API_VERSION) return false;
+//     lox = api;
+//     lox->defineNative("square", square, 1);
+//     return true;
+//   }
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bumped whenever functions are added to the end of LoxApi
+#define LOX_API_VERSION 1
+
+// Name of the function that every extension has to export
+#define LOX_EXTENSION_INIT "loxExtensionInit"
+
+// Opaque handle to a Lox value
+typedef struct {
+  uint64_t opaque[2];
+} LoxValue;
+
+typedef LoxValue (*LoxNativeFn)(int argCount, const LoxValue* args);
+
+// Values created while a native runs (including results of calls into
+// Lox) stay alive until that native returns. Values that the extension
+// holds on to beyond that have to be pinned.
+typedef struct {
+  int version;
+
+  // Makes the function available to Lox code as a global. An arity of
+  // -1 lets the native accept any number of arguments.
+  void (*defineNative)(const char* name, LoxNativeFn function, int arity);
+  // Raises a runtime error, natives should return its result right away
+  LoxValue (*error)(const char* message);
+
+  bool (*isNil)(LoxValue value);
+  bool (*isBool)(LoxValue value);
+  bool (*isNumber)(LoxValue value);
+  bool (*isString)(LoxValue value);
+
+  bool (*toBool)(LoxValue value);
+  double (*toNumber)(LoxValue value);
+  // The characters are null terminated and remain valid for as long
+  // as the string is alive
+  const char* (*stringChars)(LoxValue value);
+  int (*stringLength)(LoxValue value);
+
+  LoxValue (*nil)(void);
+  LoxValue (*boolean)(bool value);
+  LoxValue (*number)(double value);
+  // Copies the characters into a new Lox string
+  LoxValue (*string)(const char* chars, int length);
+
+  // Calls a Lox callable. Returns false if the call raised a runtime
+  // error, in which case the native has to return right away.
+  bool (*call)(LoxValue callee, int argCount, const LoxValue* args, LoxValue* result);
+
+  // Keeps the value alive until it is unpinned, pins are counted so
+  // a value has to be unpinned as many times as it was pinned
+  void (*pin)(LoxValue value);
+  void (*unpin)(LoxValue value);
+} LoxApi;
+
+typedef bool (*LoxExtensionInitFn)(const LoxApi* api);
+
+#endif
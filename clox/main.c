@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bundle.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 
@@ -70,15 +72,33 @@ static void runFile(const char* path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Compiles the script at path and writes an executable that runs it
+// without needing the source
+static void bundleFile(const char* path, const char* output) {
+  char* source = readFile(path);
+  ObjFunction* script = compile(source);
+  free(source);
+
+  if (script == NULL) exit(65);
+  if (!writeBundle(script, output)) exit(74);
+}
+
 int main(int argc, const char* argv[]) {
-  initVM();
+  initVM(NULL);
 
-  if (argc == 1) {
+  // An executable written by --bundle only ever runs its own script
+  ObjFunction* bundled = loadBundle();
+  if (bundled != NULL) {
+    if (interpretCompiled(bundled) == INTERPRET_RUNTIME_ERROR) exit(70);
+  } else if (argc == 1) {
     repl();
   } else if (argc == 2) {
     runFile(argv[1]);
+  } else if (argc == 5 && strcmp(argv[1], "--bundle") == 0 &&
+             strcmp(argv[3], "-o") == 0) {
+    bundleFile(argv[2], argv[4]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
+    fprintf(stderr, "Usage: clox [path]\n       clox --bundle path -o output\n");
     exit(64);
   }
 
@@ -0,0 +1,221 @@
+#include "memo.h"
+#include "memory.h"
+#include "vm.h"
+
+#define MEMO_MAX_LOAD 0.75
+
+#define ENTRY_SIZE(argCount) \
+  (sizeof(MemoEntry) + sizeof(Value) * (argCount))
+
+uint32_t hashArguments(Value* args, int argCount) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < argCount; i++) {
+    hash ^= hashValue(args[i]);
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static bool argumentsEqual(MemoEntry* entry, Value* args, int argCount) {
+  if (entry->argCount != argCount) return false;
+  for (int i = 0; i < argCount; i++) {
+    if (!valuesEqual(entry->args[i], args[i])) return false;
+  }
+  return true;
+}
+
+static MemoEntry* findEntry(ObjMemo* memo, Value* args, int argCount, uint32_t hash) {
+  if (memo->count == 0) return NULL;
+
+  MemoEntry* entry = memo->buckets[hash & (memo->capacity - 1)];
+  for (; entry != NULL; entry = entry->chain) {
+    if (entry->hash == hash && argumentsEqual(entry, args, argCount)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void unlinkEntry(MemoEntry** head, MemoEntry** tail, MemoEntry* entry) {
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    *head = entry->next;
+  }
+
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else if (tail != NULL) {
+    *tail = entry->prev;
+  }
+}
+
+static void linkNewest(ObjMemo* memo, MemoEntry* entry) {
+  entry->prev = NULL;
+  entry->next = memo->newest;
+  if (memo->newest != NULL) memo->newest->prev = entry;
+  memo->newest = entry;
+  if (memo->oldest == NULL) memo->oldest = entry;
+}
+
+bool memoGet(ObjMemo* memo, Value* args, int argCount, uint32_t hash, Value* result) {
+  MemoEntry* entry = findEntry(memo, args, argCount, hash);
+  if (entry == NULL) return false;
+
+  // The recency of entries only matters if we ever evict them
+  if (memo->maxSize > 0 && entry != memo->newest) {
+    unlinkEntry(&memo->newest, &memo->oldest, entry);
+    linkNewest(memo, entry);
+  }
+
+  *result = entry->result;
+  return true;
+}
+
+MemoEntry* memoBegin(ObjMemo* memo, Value* args, int argCount, uint32_t hash) {
+  MemoEntry* entry = (MemoEntry*)reallocate(NULL, 0, ENTRY_SIZE(argCount));
+  entry->hash = hash;
+  entry->result = NIL_VAL;
+  entry->chain = NULL;
+  entry->argCount = argCount;
+  for (int i = 0; i < argCount; i++) {
+    entry->args[i] = args[i];
+  }
+
+  // Pending entries are kept in their own list so that the GC
+  // still sees their arguments while the call is running
+  entry->prev = NULL;
+  entry->next = memo->pending;
+  if (memo->pending != NULL) memo->pending->prev = entry;
+  memo->pending = entry;
+  return entry;
+}
+
+static void freeEntry(MemoEntry* entry) {
+  reallocate(entry, ENTRY_SIZE(entry->argCount), 0);
+}
+
+static void adjustCapacity(ObjMemo* memo, int capacity) {
+  MemoEntry** buckets = ALLOCATE(MemoEntry*, capacity);
+  for (int i = 0; i < capacity; i++) {
+    buckets[i] = NULL;
+  }
+
+  for (int i = 0; i < memo->capacity; i++) {
+    MemoEntry* entry = memo->buckets[i];
+    while (entry != NULL) {
+      MemoEntry* chain = entry->chain;
+      MemoEntry** bucket = &buckets[entry->hash & (capacity - 1)];
+      entry->chain = *bucket;
+      *bucket = entry;
+      entry = chain;
+    }
+  }
+
+  FREE_ARRAY(MemoEntry*, memo->buckets, memo->capacity);
+  memo->buckets = buckets;
+  memo->capacity = capacity;
+}
+
+static void evictOldest(ObjMemo* memo) {
+  MemoEntry* entry = memo->oldest;
+
+  MemoEntry** link = &memo->buckets[entry->hash & (memo->capacity - 1)];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+
+  unlinkEntry(&memo->newest, &memo->oldest, entry);
+  memo->count--;
+  freeEntry(entry);
+}
+
+void memoAbandon(ObjMemo* memo, MemoEntry* entry) {
+  unlinkEntry(&memo->pending, NULL, entry);
+  freeEntry(entry);
+}
+
+void memoComplete(ObjMemo* memo, MemoEntry* entry, Value result) {
+  // Grow the buckets while the entry is still safely in the pending
+  // list, since this might trigger a GC
+  if (memo->count + 1 > memo->capacity * MEMO_MAX_LOAD) {
+    adjustCapacity(memo, GROW_CAPACITY(memo->capacity));
+  }
+
+  unlinkEntry(&memo->pending, NULL, entry);
+
+  // A nested call with the same arguments might have finished first
+  MemoEntry* existing = findEntry(memo, entry->args, entry->argCount, entry->hash);
+  if (existing != NULL) {
+    existing->result = result;
+    freeEntry(entry);
+    return;
+  }
+
+  entry->result = result;
+
+  MemoEntry** bucket = &memo->buckets[entry->hash & (memo->capacity - 1)];
+  entry->chain = *bucket;
+  *bucket = entry;
+  linkNewest(memo, entry);
+  memo->count++;
+
+  if (memo->maxSize > 0 && memo->count > memo->maxSize) {
+    evictOldest(memo);
+  }
+}
+
+static void markEntries(MemoEntry* entry) {
+  for (; entry != NULL; entry = entry->next) {
+    for (int i = 0; i < entry->argCount; i++) {
+      markValue(entry->args[i]);
+    }
+    markValue(entry->result);
+  }
+}
+
+void markMemo(ObjMemo* memo) {
+  markObject(REF_PTR(Obj, memo->function));
+  markEntries(memo->newest);
+  markEntries(memo->pending);
+}
+
+static void freeEntries(MemoEntry* entry) {
+  while (entry != NULL) {
+    MemoEntry* next = entry->next;
+    freeEntry(entry);
+    entry = next;
+  }
+}
+
+void freeMemo(ObjMemo* memo) {
+  freeEntries(memo->newest);
+  freeEntries(memo->pending);
+  FREE_ARRAY(MemoEntry*, memo->buckets, memo->capacity);
+}
+
+// memoize(fn) or memoize(fn, maxSize), the results of fn are cached
+// without limit unless a maximum number of results to keep is given
+static Value memoizeNative(int argCount, Value* args) {
+  if (argCount != 1 && argCount != 2) {
+    return nativeError("Expected 1 or 2 arguments but got %d.", argCount);
+  }
+  if (!IS_CLOSURE(args[0])) {
+    return nativeError("Can only memoize functions.");
+  }
+
+  int maxSize = 0;
+  if (argCount == 2 && !IS_NIL(args[1])) {
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1 ||
+        AS_NUMBER(args[1]) > INT32_MAX ||
+        AS_NUMBER(args[1]) != (int)AS_NUMBER(args[1])) {
+      return nativeError("Memoization cache size must be a positive integer.");
+    }
+    maxSize = (int)AS_NUMBER(args[1]);
+  }
+
+  return OBJ_VAL(newMemo(AS_CLOSURE(args[0]), maxSize));
+}
+
+void defineMemoNatives() {
+  defineNative("memoize", memoizeNative, -1);
+}
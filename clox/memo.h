@@ -0,0 +1,23 @@
+#ifndef clox_memo_h
+#define clox_memo_h
+
+#include "object.h"
+
+uint32_t hashArguments(Value* args, int argCount);
+// Returns true if a result was cached for these arguments, storing it in
+// the result param. The hash has to come from hashArguments().
+bool memoGet(ObjMemo* memo, Value* args, int argCount, uint32_t hash, Value* result);
+// Records that the function is about to be called with these arguments,
+// the returned entry is filled in by memoComplete() once the call returns
+MemoEntry* memoBegin(ObjMemo* memo, Value* args, int argCount, uint32_t hash);
+void memoComplete(ObjMemo* memo, MemoEntry* entry, Value result);
+// Drops an entry whose call is never going to return, i.e. because
+// an exception unwound its frame
+void memoAbandon(ObjMemo* memo, MemoEntry* entry);
+
+void markMemo(ObjMemo* memo);
+void freeMemo(ObjMemo* memo);
+
+void defineMemoNatives();
+
+#endif
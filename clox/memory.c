@@ -1,21 +1,120 @@
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "buffer.h"
 #include "compiler.h"
+#include "csv.h"
+#include "extension.h"
+#include "memo.h"
 #include "memory.h"
+#include "regex.h"
 #include "vm.h"
+#include "weak.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+static bool heapShared = false;
+static pthread_mutex_t heapLock;
+static pthread_mutex_t internLock;
+static pthread_once_t heapLockOnce = PTHREAD_ONCE_INIT;
+
+static void initHeapLock() {
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&heapLock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  pthread_mutex_init(&internLock, NULL);
+}
+
+void shareHeap(bool shared) {
+  pthread_once(&heapLockOnce, initHeapLock);
+  heapShared = shared;
+}
+
+void lockHeap() {
+  if (heapShared) pthread_mutex_lock(&heapLock);
+}
+
+void unlockHeap() {
+  if (heapShared) pthread_mutex_unlock(&heapLock);
+}
+
+bool lockInterning() {
+  if (heapShared) pthread_mutex_lock(&internLock);
+  return heapShared;
+}
+
+void unlockInterning() {
+  if (heapShared) pthread_mutex_unlock(&internLock);
+}
+
+static void* defaultAllocate(void* userData, size_t size) {
+  return malloc(size);
+}
+
+static void* defaultReallocate(void* userData, void* pointer,
+                               size_t oldSize, size_t newSize) {
+  return realloc(pointer, newSize);
+}
+
+static void defaultFree(void* userData, void* pointer, size_t size) {
+  free(pointer);
+}
+
+const Allocator defaultAllocator = {
+  defaultAllocate,
+  defaultReallocate,
+  defaultFree,
+  NULL,
+};
+
+// Hands the request over to the allocator that the host installed in
+// the VM, without any of the GC bookkeeping done by reallocate()
+static void* hostReallocate(void* pointer, size_t oldSize, size_t newSize) {
+  Allocator* allocator = &vm.allocator;
+
+  if (newSize == 0) {
+    if (pointer != NULL) {
+      allocator->free(allocator->userData, pointer, oldSize);
+    }
+    return NULL;
+  }
+
+  void* result;
+  if (pointer == NULL) {
+    result = allocator->allocate(allocator->userData, newSize);
+  } else {
+    result = allocator->reallocate(allocator->userData, pointer,
+                                   oldSize, newSize);
+  }
+
+  // If for some reason we are out of memory
+  if (result == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+
+  return result;
+}
+
+static void trackAllocation(size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
 
   // When asking for memory, trigger GC
   if (newSize > oldSize) {
+    vm.bytesRequested += newSize - oldSize;
+
+    // Other threads hold pointers to objects that are not rooted
+    // anywhere, the next allocation after they are done collects
+    if (heapShared) return;
+
 #ifdef DEBUG_STRESS_GC
     collectGarbage();
 #endif
@@ -24,18 +123,59 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
       collectGarbage();
     }
   }
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  lockHeap();
+  trackAllocation(oldSize, newSize);
+  void* result = hostReallocate(pointer, oldSize, newSize);
+  unlockHeap();
+  return result;
+}
+
+void* reallocateObject(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef HEAP_CAGE
+  lockHeap();
+  trackAllocation(oldSize, newSize);
 
+  void* result = NULL;
   if (newSize == 0) {
-    free(pointer);
-    return NULL;
+    cageFree(pointer, oldSize);
+  } else {
+    // Objects are never resized after being allocated, they are
+    // only ever created or freed
+    result = cageAllocate(newSize);
   }
+  unlockHeap();
+  return result;
+#else
+  return reallocate(pointer, oldSize, newSize);
+#endif
+}
 
-  void* result = realloc(pointer, newSize);
+void initByteArray(ByteArray* array) {
+  array->capacity = 0;
+  array->count = 0;
+  array->bytes = NULL;
+}
 
-  // If for some reason we are out of memory
-  if (result == NULL) exit(1);
+void writeByteArray(ByteArray* array, const void* bytes, int length) {
+  if (length == 0) return;
+  if (array->capacity < array->count + length) {
+    int oldCapacity = array->capacity;
+    while (array->capacity < array->count + length) {
+      array->capacity = GROW_CAPACITY(array->capacity);
+    }
+    array->bytes = GROW_ARRAY(uint8_t, array->bytes, oldCapacity, array->capacity);
+  }
 
-  return result;
+  memcpy(array->bytes + array->count, bytes, length);
+  array->count += length;
+}
+
+void freeByteArray(ByteArray* array) {
+  FREE_ARRAY(uint8_t, array->bytes, array->capacity);
+  initByteArray(array);
 }
 
 void markObject(Obj* object) {
@@ -52,17 +192,18 @@ void markObject(Obj* object) {
   object->isMarked = true;
 
   if (vm.grayCapacity < vm.grayCount + 1) {
+    int oldCapacity = vm.grayCapacity;
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    // Using system realloc since we do not want this to trigger
-    // a new GC
-    vm.grayStack = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-
+    // Going straight to the host allocator since we do not want this
+    // to be counted towards the heap and trigger a new GC.
+    //
     // To be more robust, we can allocate a “rainy day fund” block 
     // of memory when we start the VM. If the gray stack allocation 
     // fails, we free the rainy day block and try again. That may 
     // give us enough wiggle room on the heap to create the gray stack, 
     // finish the GC, and free up more memory.
-    if (vm.grayStack == NULL) exit(1);
+    vm.grayStack = hostReallocate(vm.grayStack, sizeof(Obj*) * oldCapacity,
+                                  sizeof(Obj*) * vm.grayCapacity);
   }
 
   vm.grayStack[vm.grayCount++] = object;
@@ -90,26 +231,35 @@ static void blackenObject(Obj* object) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod* bound = (ObjBoundMethod*)object;
       markValue(bound->receiver);
-      markObject((Obj*)bound->method);
+      markObject(REF_PTR(Obj, bound->method));
       break;
     }
+    case OBJ_BUFFER:
+      markObject(REF_PTR(Obj, ((ObjBuffer*)object)->owner));
+      break;
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
-      markObject((Obj*)klass->name);
+      markObject(REF_PTR(Obj, klass->name));
       markTable(&klass->methods);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      markObject((Obj*)closure->function);
+      markObject(REF_PTR(Obj, closure->function));
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        markObject((Obj*)REF_PTR(ObjUpvalue, closure->upvalues[i]));
       }
       break;
     }
+    case OBJ_CSV_READER: {
+      ObjCsvReader* reader = (ObjCsvReader*)object;
+      markObject(REF_PTR(Obj, reader->row));
+      markArray(&reader->previous);
+      break;
+    }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
-      markObject((Obj*)function->name);
+      markObject(REF_PTR(Obj, function->name));
       markArray(&function->chunk.constants);
       break;
     }
@@ -117,13 +267,71 @@ static void blackenObject(Obj* object) {
       ObjInstance* instance = (ObjInstance*)object;
       // As long as the instance is alive, we should never
       // deallocate its class
-      markObject((Obj*)instance->klass);
+      markObject(REF_PTR(Obj, instance->klass));
       markTable(&instance->fields);
       break;
     }
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
+    case OBJ_HASH_MAP:
+      markObject(REF_PTR(Obj, ((ObjHashMap*)object)->root));
+      break;
+    case OBJ_LIST:
+      markArray(&((ObjList*)object)->items);
+      break;
+    case OBJ_TRIE_NODE: {
+      ObjTrieNode* node = (ObjTrieNode*)object;
+      for (int i = 0; i < node->count; i++) {
+        markValue(node->slots[i]);
+      }
+      break;
+    }
+    case OBJ_VECTOR: {
+      ObjVector* vector = (ObjVector*)object;
+      markObject(REF_PTR(Obj, vector->root));
+      markObject(REF_PTR(Obj, vector->tail));
+      break;
+    }
+    case OBJ_MEMO:
+      markMemo((ObjMemo*)object);
+      break;
+    case OBJ_WEAK_MAP: {
+      // Neither the keys nor the values are marked here, the values
+      // are taken care of by markWeakMapValues() once we know which
+      // keys are reachable
+      ObjWeakMap* map = (ObjWeakMap*)object;
+      map->nextWeak = PTR_REF(vm.weakMaps);
+      vm.weakMaps = map;
+      break;
+    }
+    case OBJ_WEAK_REF: {
+      // The target is intentionally not marked, we only keep track of
+      // the reference so that it can be cleared if the target dies
+      ObjWeakRef* ref = (ObjWeakRef*)object;
+      ref->nextWeak = PTR_REF(vm.weakRefs);
+      vm.weakRefs = ref;
+      break;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      markObject(REF_PTR(Obj, record->type));
+      for (int i = 0; i < record->fieldCount; i++) {
+        markValue(record->fields[i]);
+      }
+      break;
+    }
+    case OBJ_RECORD_TYPE: {
+      ObjRecordType* type = (ObjRecordType*)object;
+      markObject(REF_PTR(Obj, type->name));
+      for (int i = 0; i < type->fieldCount; i++) {
+        markObject(REF_PTR(Obj, type->fields[i]));
+      }
+      break;
+    }
+    case OBJ_REGEX:
+      markObject(REF_PTR(Obj, ((ObjRegex*)object)->pattern));
+      break;
     case OBJ_NATIVE:
     case OBJ_STRING:
       break;
@@ -139,12 +347,12 @@ static void freeObject(Obj* object) {
     case OBJ_BOUND_METHOD:
       // Does not own the references, hence we just free the
       // obj itself
-      FREE(ObjBoundMethod, object);
+      FREE_OBJ(ObjBoundMethod, object);
       break;
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       freeTable(&klass->methods);
-      FREE(ObjClass, object);
+      FREE_OBJ(ObjClass, object);
       break;
     }
     case OBJ_CLOSURE: {
@@ -154,15 +362,15 @@ static void freeObject(Obj* object) {
       ObjClosure* closure = (ObjClosure*) object;
       // Although closure does not own the upvalues, it owns the array
       // of pointers and we need to free this
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE_ARRAY(OBJ_REF(ObjUpvalue), closure->upvalues, closure->upvalueCount);
+      FREE_OBJ(ObjClosure, object);
       break;
     }
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       // +1 to take into account the null termination char
       FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      FREE_OBJ(ObjString, object);
       break;
     }
     case OBJ_FUNCTION: {
@@ -171,7 +379,7 @@ static void freeObject(Obj* object) {
       // for us
       ObjFunction* function = (ObjFunction*) object;
       freeChunk(&function->chunk);
-      FREE(OBJ_FUNCTION, object);
+      FREE_OBJ(ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
@@ -179,15 +387,77 @@ static void freeObject(Obj* object) {
       // We do not handle the entries in the table, there could
       // be other references to them, the GC will take care of them
       freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      FREE_OBJ(ObjInstance, object);
+      break;
+    }
+    case OBJ_HASH_MAP: {
+      FREE_OBJ(ObjHashMap, object);
+      break;
+    }
+    case OBJ_LIST: {
+      freeValueArray(&((ObjList*)object)->items);
+      FREE_OBJ(ObjList, object);
+      break;
+    }
+    case OBJ_BUFFER: {
+      freeBuffer((ObjBuffer*)object);
+      FREE_OBJ(ObjBuffer, object);
+      break;
+    }
+    case OBJ_CSV_READER: {
+      ObjCsvReader* reader = (ObjCsvReader*)object;
+      closeCsvReader(reader);
+      freeValueArray(&reader->previous);
+      FREE_OBJ(ObjCsvReader, object);
+      break;
+    }
+    case OBJ_MEMO: {
+      freeMemo((ObjMemo*)object);
+      FREE_OBJ(ObjMemo, object);
       break;
     }
     case OBJ_NATIVE: {
-      FREE(ObjNative, object);
+      FREE_OBJ(ObjNative, object);
+      break;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      reallocateObject(object, sizeof(ObjRecord) +
+                       sizeof(Value) * record->fieldCount, 0);
+      break;
+    }
+    case OBJ_RECORD_TYPE: {
+      ObjRecordType* type = (ObjRecordType*)object;
+      reallocateObject(object, sizeof(ObjRecordType) +
+                       sizeof(OBJ_REF(ObjString)) * type->fieldCount, 0);
+      break;
+    }
+    case OBJ_REGEX: {
+      freeRegexProgram(((ObjRegex*)object)->program);
+      FREE_OBJ(ObjRegex, object);
+      break;
+    }
+    case OBJ_TRIE_NODE: {
+      ObjTrieNode* node = (ObjTrieNode*)object;
+      reallocateObject(object, sizeof(ObjTrieNode) +
+                       sizeof(Value) * node->capacity, 0);
       break;
     }
     case OBJ_UPVALUE: {
-      FREE(ObjUpvalue, object);
+      FREE_OBJ(ObjUpvalue, object);
+      break;
+    }
+    case OBJ_VECTOR: {
+      FREE_OBJ(ObjVector, object);
+      break;
+    }
+    case OBJ_WEAK_MAP: {
+      freeWeakMap((ObjWeakMap*)object);
+      FREE_OBJ(ObjWeakMap, object);
+      break;
+    }
+    case OBJ_WEAK_REF: {
+      FREE_OBJ(ObjWeakRef, object);
       break;
     }
   }
@@ -205,15 +475,26 @@ static void markRoots() {
   }
 
   // Mark list of open upvalues
-  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = REF_PTR(ObjUpvalue, upvalue->next)) {
     markObject((Obj*)upvalue);
   }
 
   // Mark all variables that live in the VM's hash table
   markTable(&vm.globals);
+  markTable(&vm.baseGlobals);
+
+  // Off the stack while the frames are unwound
+  markValue(vm.exception);
 
   markCompilerRoots();
+  markExtensionRoots();
+  markRegexRoots();
+  markSnippetCache(&vm.snippets);
   markObject((Obj*)vm.initString);
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    markObject((Obj*)vm.intrinsicNames[i]);
+  }
 }
 
 void traceReferences() {
@@ -234,12 +515,12 @@ static void sweep() {
       // in anticipation of the next GC
       object->isMarked = false;
       previous = object;
-      object = object->next;
+      object = REF_PTR(Obj, object->next);
     } else {
       Obj* unreached = object;
-      object = object->next;
+      object = REF_PTR(Obj, object->next);
       if (previous != NULL) {
-        previous->next = object;
+        previous->next = PTR_REF(object);
       } else {
         vm.objects = object;
       }
@@ -257,10 +538,15 @@ void collectGarbage() {
 
   markRoots();
   traceReferences();
+  markWeakMapValues();
 
   // Before sweeping strings, we first clear them from the 
-  // string table to prevent dangling references
-  tableRemoveWhite(&vm.strings);
+  // string table to prevent dangling references, and the
+  // same goes for weak references and weak maps
+  sweepWeakReferences();
+  removeWhiteInterned(&vm.strings);
+  // The GC never runs while other threads could be probing them
+  freeRetiredInterned(&vm.strings);
   sweep();
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
@@ -276,10 +562,14 @@ void collectGarbage() {
 void freeObjects() {
   Obj* object = vm.objects;
   while (object != NULL) {
-    Obj* next = object->next;
+    Obj* next = REF_PTR(Obj, object->next);
     freeObject(object);
     object = next;
   }
 
-  free(vm.grayStack);
+  hostReallocate(vm.grayStack, sizeof(Obj*) * vm.grayCapacity, 0);
+
+#ifdef HEAP_CAGE
+  freeCage();
+#endif
 }
@@ -19,12 +19,69 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+#define FREE_OBJ(type, pointer) reallocateObject(pointer, sizeof(type), 0)
+
+// Table of hooks that the VM uses to obtain memory, allowing the host to
+// supply its own allocator (arenas, accounting, etc) when creating the VM.
+//
+// The sizes passed to reallocate and free are the sizes that the block
+// was last allocated with. Returning NULL from either allocation hook is
+// treated as being out of memory.
+//
+// With HEAP_CAGE enabled the objects themselves bypass these hooks, as
+// they have to be carved out of the cage which is reserved with mmap.
+// Everything else (arrays, strings' characters, tables) still goes
+// through them.
+typedef struct {
+  void* (*allocate)(void* userData, size_t size);
+  void* (*reallocate)(void* userData, void* pointer, size_t oldSize, size_t newSize);
+  void (*free)(void* userData, void* pointer, size_t size);
+  // Passed along untouched to every hook
+  void* userData;
+} Allocator;
+
+// Allocator that is used when the host does not provide one, it
+// simply forwards to malloc, realloc and free
+extern const Allocator defaultAllocator;
+
 // If the old size is zero and the new size is non-zero, allocate new block
 // If the old size is non zero and the new size is zero, free the allocation
 // If the old size is lesser than the new size, grow the allocation and vice versa.
 void *reallocate(void* pointer, size_t oldSize, size_t newSize);
+// Same contract as reallocate but for the memory of objects themselves,
+// which have to be placed in the heap cage when it is enabled. The cage
+// does not go through the host's Allocator.
+void* reallocateObject(void* pointer, size_t oldSize, size_t newSize);
+
+// Growable array of raw bytes, which bundles, JSON and serialized
+// values are written into. Growing it goes through reallocate and can
+// therefore trigger a GC.
+typedef struct {
+  int capacity;
+  int count;
+  uint8_t* bytes;
+} ByteArray;
+
+void initByteArray(ByteArray* array);
+void writeByteArray(ByteArray* array, const void* bytes, int length);
+void freeByteArray(ByteArray* array);
+// While functions are compiled on worker threads the heap is shared
+// between them, which puts off collection until it is no longer shared.
+// Code that changes the heap (or the VM stack) must hold the heap lock
+// in the meantime, locking is a no-op the rest of the time. The lock
+// is recursive.
+void shareHeap(bool shared);
+void lockHeap();
+void unlockHeap();
+// Guards adding strings to the intern table while the heap is shared,
+// finding them needs no lock at all. Returns whether the heap is shared,
+// i.e. whether other threads may have added strings in the meantime.
+bool lockInterning();
+void unlockInterning();
 void markObject(Obj* object);
 void markValue(Value value);
+// Blackens gray objects until there are none left
+void traceReferences();
 void collectGarbage();
 void freeObjects();
 
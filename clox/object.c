@@ -3,6 +3,7 @@
 
 #include "memory.h"
 #include "object.h"
+#include "persistent.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -11,12 +12,15 @@
   (type *)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj *)reallocate(NULL, 0, size);
+  Obj* object = (Obj *)reallocateObject(NULL, 0, size);
   object->type = type;
   object->isMarked = false;
 
-  object->next = vm.objects;
+  lockHeap();
+  object->next = PTR_REF(vm.objects);
   vm.objects = object;
+  vm.objectsAllocated++;
+  unlockHeap();
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -28,51 +32,102 @@ static Obj* allocateObject(size_t size, ObjType type) {
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
   ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
   bound->receiver = receiver;
-  bound->method = method;
+  bound->method = PTR_REF(method);
   return bound;
 }
 
+ObjBuffer* newBuffer(uint8_t* bytes, size_t length) {
+  ObjBuffer* buffer = ALLOCATE_OBJ(ObjBuffer, OBJ_BUFFER);
+  buffer->bytes = bytes;
+  buffer->length = length;
+  buffer->owner = NULL_REF;
+  buffer->mapped = false;
+  buffer->readOnly = false;
+  return buffer;
+}
+
 ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-  klass->name = name;
+  klass->name = PTR_REF(name);
   initTable(&klass->methods);
+  SET_TABLE_ROLE(&klass->methods, TABLE_METHODS);
   return klass;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+  OBJ_REF(ObjUpvalue)* upvalues = ALLOCATE(OBJ_REF(ObjUpvalue), function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
     // Ensuring memory manager never sees uninitialized memory
-    upvalues[i] = NULL;
+    upvalues[i] = NULL_REF;
   } 
 
   ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-  closure->function = function;
+  closure->function = PTR_REF(function);
   closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
   return closure;
 }
 
+ObjCsvReader* newCsvReader(uint8_t delimiter) {
+  ObjCsvReader* reader = ALLOCATE_OBJ(ObjCsvReader, OBJ_CSV_READER);
+  reader->state = NULL;
+  reader->delimiter = delimiter;
+  reader->row = NULL_REF;
+  initValueArray(&reader->previous);
+  return reader;
+}
+
 ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 
   function->arity = 0;
   function->upvalueCount = 0;
-  function->name = NULL;
+  function->maxSlots = 0;
+  function->name = NULL_REF;
   initChunk(&function->chunk);
   return function;
 } 
 
+ObjHashMap* newHashMap() {
+  ObjHashMap* map = ALLOCATE_OBJ(ObjHashMap, OBJ_HASH_MAP);
+  map->count = 0;
+  map->root = NULL_REF;
+  map->edit = 0;
+  return map;
+}
+
 ObjInstance* newInstance(ObjClass* klass) {
   ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-  instance->klass = klass;
+  instance->klass = PTR_REF(klass);
   initTable(&instance->fields);
+  SET_TABLE_ROLE(&instance->fields, TABLE_FIELDS);
   return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjList* newList() {
+  ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+ObjMemo* newMemo(ObjClosure* function, int maxSize) {
+  ObjMemo* memo = ALLOCATE_OBJ(ObjMemo, OBJ_MEMO);
+  memo->function = PTR_REF(function);
+  memo->maxSize = maxSize;
+  memo->count = 0;
+  memo->capacity = 0;
+  memo->buckets = NULL;
+  memo->newest = NULL;
+  memo->oldest = NULL;
+  memo->pending = NULL;
+  return memo;
+}
+
+ObjNative* newNative(NativeFn function, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
+  native->data = NULL;
   return native;
 }
 
@@ -82,14 +137,9 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
   string->chars = chars;
   string->hash = hash;
 
-  // Prevent string object from being GC-ed before being
-  // written to the table
-  push(OBJ_VAL(string));
-
-  tableSet(&vm.strings, string, NIL_VAL);
-
-  pop();
-
+  // Room for the string was reserved before it was allocated, so adding
+  // it allocates nothing and the GC cannot miss it
+  addInterned(&vm.strings, string);
   return string;
 }
 
@@ -113,12 +163,20 @@ static uint32_t hashString(const char* key, int length) {
 ObjString* takeString(char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+  ObjString* interned = findInterned(&vm.strings, chars, length, hash);
+  if (interned == NULL) {
+    // Another thread may have interned the string in the meantime
+    if (lockInterning()) interned = findInterned(&vm.strings, chars, length, hash);
+    if (interned == NULL) {
+      reserveInterned(&vm.strings);
+      interned = allocateString(chars, length, hash);
+      chars = NULL;
+    }
+    unlockInterning();
   }
-  return allocateString(chars, length, hash);
+
+  if (chars != NULL) FREE_ARRAY(char, chars, length + 1);
+  return interned;
 }
 
 // To note that we cannot just create an object that points
@@ -130,57 +188,200 @@ ObjString* takeString(char* chars, int length) {
 // table, and we just return a reference to it if it already exists
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+
+  // Most strings that are copied, e.g. the names in the source, are
+  // already interned and found without taking any lock
+  ObjString* interned = findInterned(&vm.strings, chars, length, hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
+  if (lockInterning()) interned = findInterned(&vm.strings, chars, length, hash);
+  if (interned == NULL) {
+    char* heapChars = ALLOCATE(char, length + 1);
+    memcpy(heapChars, chars, length);
+    heapChars[length] = '\0';
 
-  return allocateString(heapChars, length, hash);
+    reserveInterned(&vm.strings);
+    interned = allocateString(heapChars, length, hash);
+  }
+  unlockInterning();
+  return interned;
+}
+
+ObjTrieNode* newTrieNode(uint64_t edit, int capacity) {
+  ObjTrieNode* node = (ObjTrieNode*)allocateObject(
+      sizeof(ObjTrieNode) + sizeof(Value) * capacity, OBJ_TRIE_NODE);
+  node->edit = edit;
+  node->bitmap = 0;
+  node->collision = false;
+  node->count = 0;
+  node->capacity = capacity;
+  for (int i = 0; i < capacity; i++) {
+    node->slots[i] = NIL_VAL;
+  }
+  return node;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
-  upvalue->next = NULL;
+  upvalue->next = NULL_REF;
   return upvalue;
 }
 
+ObjVector* newVector() {
+  ObjVector* vector = ALLOCATE_OBJ(ObjVector, OBJ_VECTOR);
+  vector->count = 0;
+  vector->shift = TRIE_BITS;
+  vector->root = NULL_REF;
+  vector->tail = NULL_REF;
+  vector->edit = 0;
+  return vector;
+}
+
+ObjWeakMap* newWeakMap() {
+  ObjWeakMap* map = ALLOCATE_OBJ(ObjWeakMap, OBJ_WEAK_MAP);
+  map->count = 0;
+  map->capacity = 0;
+  map->entries = NULL;
+  map->nextWeak = NULL_REF;
+  return map;
+}
+
+ObjWeakRef* newWeakRef(Obj* target) {
+  ObjWeakRef* ref = ALLOCATE_OBJ(ObjWeakRef, OBJ_WEAK_REF);
+  ref->target = PTR_REF(target);
+  ref->nextWeak = NULL_REF;
+  return ref;
+}
+
+ObjRecord* newRecord(ObjRecordType* type, Value* fields) {
+  ObjRecord* record = (ObjRecord*)allocateObject(
+      sizeof(ObjRecord) + sizeof(Value) * type->fieldCount, OBJ_RECORD);
+  record->type = PTR_REF(type);
+  record->fieldCount = type->fieldCount;
+  memcpy(record->fields, fields, sizeof(Value) * type->fieldCount);
+  return record;
+}
+
+ObjRecordType* newRecordType(ObjString* name, int fieldCount) {
+  ObjRecordType* type = (ObjRecordType*)allocateObject(
+      sizeof(ObjRecordType) + sizeof(OBJ_REF(ObjString)) * fieldCount, OBJ_RECORD_TYPE);
+  type->name = PTR_REF(name);
+  type->fieldCount = fieldCount;
+  for (int i = 0; i < fieldCount; i++) {
+    type->fields[i] = NULL_REF;
+  }
+  return type;
+}
+
+ObjRegex* newRegex(ObjString* pattern, RegexProgram* program) {
+  ObjRegex* regex = ALLOCATE_OBJ(ObjRegex, OBJ_REGEX);
+  regex->pattern = PTR_REF(pattern);
+  regex->program = program;
+  return regex;
+}
+
+int recordFieldIndex(ObjRecordType* type, ObjString* name) {
+  // Field names are interned and records are small, so comparing
+  // pointers one by one beats hashing
+  for (int i = 0; i < type->fieldCount; i++) {
+    if (type->fields[i] == PTR_REF(name)) return i;
+  }
+  return -1;
+}
+
+static void printList(ObjList* list) {
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) printf(", ");
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+}
+
+static void printRecord(ObjRecord* record) {
+  ObjRecordType* type = REF_PTR(ObjRecordType, record->type);
+  printf("%s(", REF_PTR(ObjString, type->name)->chars);
+  for (int i = 0; i < record->fieldCount; i++) {
+    if (i > 0) printf(", ");
+    printValue(record->fields[i]);
+  }
+  printf(")");
+}
+
 static void printFunction(ObjFunction* function) {
-  if (function->name == NULL) {
+  if (function->name == NULL_REF) {
     printf("<script>");
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  printf("<fn %s>", REF_PTR(ObjString, function->name)->chars);
 }
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
     case OBJ_BOUND_METHOD:
-      printFunction(AS_BOUND_METHOD(value)->method->function);
+      printFunction(REF_PTR(ObjFunction,
+          REF_PTR(ObjClosure, AS_BOUND_METHOD(value)->method)->function));
+      break;
+    case OBJ_BUFFER:
+      printf("<buffer %zu bytes>", AS_BUFFER(value)->length);
       break;
     case OBJ_CLASS:
-      printf("%s", AS_CLASS(value)->name->chars);
+      printf("%s", REF_PTR(ObjString, AS_CLASS(value)->name)->chars);
       break;
     case OBJ_CLOSURE:
-      printFunction(AS_CLOSURE(value)->function);
+      printFunction(REF_PTR(ObjFunction, AS_CLOSURE(value)->function));
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
+    case OBJ_CSV_READER:
+      printf("<csv reader>");
+      break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
+    case OBJ_HASH_MAP:
+      printHashMap(AS_HASH_MAP(value));
+      break;
     case OBJ_INSTANCE:
-      printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+      printf("%s instance", REF_PTR(ObjString,
+          REF_PTR(ObjClass, AS_INSTANCE(value)->klass)->name)->chars);
+      break;
+    case OBJ_LIST:
+      printList(AS_LIST(value));
+      break;
+    case OBJ_MEMO:
+      printFunction(REF_PTR(ObjFunction,
+          REF_PTR(ObjClosure, AS_MEMO(value)->function)->function));
       break;
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_RECORD:
+      printRecord(AS_RECORD(value));
+      break;
+    case OBJ_RECORD_TYPE:
+      printf("%s", REF_PTR(ObjString, AS_RECORD_TYPE(value)->name)->chars);
+      break;
+    case OBJ_REGEX:
+      printf("<regex %s>", REF_PTR(ObjString, AS_REGEX(value)->pattern)->chars);
+      break;
+    case OBJ_TRIE_NODE:
+      printf("<trie node>");
+      break;
     case OBJ_UPVALUE:
       printf("upvalue");
       break;
+    case OBJ_VECTOR:
+      printVector(AS_VECTOR(value));
+      break;
+    case OBJ_WEAK_MAP:
+      printf("<weak map>");
+      break;
+    case OBJ_WEAK_REF:
+      printf("<weak ref>");
+      break;
     default: return;
   }
 }
@@ -12,38 +12,77 @@
 // function here so that calls such as IS_STRING(pop()) will not
 // cause the side effects to occur twice
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_BUFFER(value) isObjType(value, OBJ_BUFFER)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_CSV_READER(value) isObjType(value, OBJ_CSV_READER)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_HASH_MAP(value) isObjType(value, OBJ_HASH_MAP)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MEMO(value) isObjType(value, OBJ_MEMO)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_RECORD(value) isObjType(value, OBJ_RECORD)
+#define IS_RECORD_TYPE(value) isObjType(value, OBJ_RECORD_TYPE)
+#define IS_REGEX(value) isObjType(value, OBJ_REGEX)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_TRIE_NODE(value) isObjType(value, OBJ_TRIE_NODE)
+#define IS_VECTOR(value) isObjType(value, OBJ_VECTOR)
+#define IS_WEAK_MAP(value) isObjType(value, OBJ_WEAK_MAP)
+#define IS_WEAK_REF(value) isObjType(value, OBJ_WEAK_REF)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_BUFFER(value) ((ObjBuffer*)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_CSV_READER(value) ((ObjCsvReader*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_HASH_MAP(value) ((ObjHashMap*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MEMO(value) ((ObjMemo*)AS_OBJ(value))
 #define AS_NATIVE(value) \
  (((ObjNative*)AS_OBJ(value))->function)
+#define AS_RECORD(value) ((ObjRecord*)AS_OBJ(value))
+#define AS_RECORD_TYPE(value) ((ObjRecordType*)AS_OBJ(value))
+#define AS_REGEX(value) ((ObjRegex*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_TRIE_NODE(value) ((ObjTrieNode*)AS_OBJ(value))
+#define AS_VECTOR(value) ((ObjVector*)AS_OBJ(value))
+#define AS_WEAK_MAP(value) ((ObjWeakMap*)AS_OBJ(value))
+#define AS_WEAK_REF(value) ((ObjWeakRef*)AS_OBJ(value))
 
 typedef enum {
   OBJ_BOUND_METHOD,
+  OBJ_BUFFER,
   OBJ_CLASS,
   OBJ_CLOSURE,
+  OBJ_CSV_READER,
   OBJ_FUNCTION,
+  OBJ_HASH_MAP,
   OBJ_INSTANCE,
+  OBJ_LIST,
+  OBJ_MEMO,
   OBJ_NATIVE,
+  OBJ_RECORD,
+  OBJ_RECORD_TYPE,
+  OBJ_REGEX,
   OBJ_STRING,
+  OBJ_TRIE_NODE,
   OBJ_UPVALUE,
+  OBJ_VECTOR,
+  OBJ_WEAK_MAP,
+  OBJ_WEAK_REF,
 } ObjType;
 
+// With HEAP_CAGE the header takes 12 bytes, objects put a reference
+// or an int right after it rather than leave a gap in front of the
+// first pointer or value
 struct Obj {
   ObjType type;
   bool isMarked;
-  struct Obj* next;
+  OBJ_REF(struct Obj) next;
 };
 
 // Functions are first-class in Lox and hence they
@@ -55,9 +94,12 @@ typedef struct {
 
   // Number of upvalues defined
   int upvalueCount;
+  // Most stack slots a call uses, counting the callee and arguments,
+  // as worked out by the verifier
+  int maxSlots;
   Chunk chunk;
   // Function name, useful for runtime error reporting
-  ObjString* name;
+  OBJ_REF(ObjString) name;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -65,6 +107,12 @@ typedef Value (*NativeFn)(int argCount, Value* args);
 typedef struct {
   Obj obj;
   NativeFn function;
+  // Number of arguments the native expects, or -1 if it
+  // accepts any number of them
+  int arity;
+  // Extra data for natives that wrap foreign functions, e.g. the
+  // function that an extension registered
+  void* data;
 } ObjNative;
 
 struct ObjString {
@@ -76,49 +124,255 @@ struct ObjString {
 
 typedef struct ObjUpvalue {
   Obj obj;
+  // Pointer to the next one in a linked list
+  OBJ_REF(struct ObjUpvalue) next;
   Value* location;
   // Value that is owned by this struct after the
   // upvalue has been closed
   Value closed;
-  // Pointer to the next one in a linked list
-  struct ObjUpvalue* next;
 } ObjUpvalue;
 
 typedef struct {
   Obj obj;
-  ObjFunction* function;
-
-  ObjUpvalue** upvalues;
+  OBJ_REF(ObjFunction) function;
   int upvalueCount;
+  OBJ_REF(ObjUpvalue)* upvalues;
 } ObjClosure;
 
 typedef struct {
   Obj obj;
-  ObjString* name;
+  OBJ_REF(ObjString) name;
   Table methods;
 } ObjClass;
 
 typedef struct {
   Obj obj;
-  ObjClass* klass;
+  OBJ_REF(ObjClass) klass;
   Table fields;
 } ObjInstance;
 
 typedef struct {
   Obj obj;
+  OBJ_REF(ObjClosure) method;
   Value receiver;
-  ObjClosure* method;
 } ObjBoundMethod;
 
+// Declared with 'record Name(field, ...);', calling it creates a record
+typedef struct {
+  Obj obj;
+  OBJ_REF(ObjString) name;
+  int fieldCount;
+  OBJ_REF(ObjString) fields[];
+} ObjRecordType;
+
+// Immutable aggregate whose fields are laid out in the same allocation
+// as the object itself. Records are compared by value rather than by
+// identity.
+typedef struct {
+  Obj obj;
+  OBJ_REF(ObjRecordType) type;
+  // Same as in the type, which might be freed first during a sweep
+  int fieldCount;
+  Value fields[];
+} ObjRecord;
+
+// Growable array of values, created and manipulated through natives
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+// Mutable raw bytes, either owned by the buffer or a slice of the
+// bytes of another buffer
+typedef struct ObjBuffer {
+  Obj obj;
+  // Buffer that owns the bytes of a slice, NULL if the buffer owns them.
+  // Slices keep their owner alive.
+  OBJ_REF(struct ObjBuffer) owner;
+  uint8_t* bytes;
+  size_t length;
+  // Bytes are either allocated or a mapping of a file
+  bool mapped;
+  // Mappings of files can't be written to
+  bool readOnly;
+} ObjBuffer;
+
+typedef struct CsvState CsvState;
+
+// Reads the rows of a CSV file a chunk at a time, created by csvOpen()
+typedef struct {
+  Obj obj;
+  // The same list is refilled for every row
+  OBJ_REF(ObjList) row;
+  // File and parsing state, which is private to csv.c. NULL once the
+  // reader has been closed.
+  CsvState* state;
+  uint8_t delimiter;
+  // Strings of the previous row, which are reused for fields that are
+  // the same in the next row
+  ValueArray previous;
+} ObjCsvReader;
+
+typedef struct RegexProgram RegexProgram;
+
+// A compiled regular expression, created by regex()
+typedef struct {
+  Obj obj;
+  OBJ_REF(ObjString) pattern;
+  // The automata that do the matching, which are private to regex.c
+  RegexProgram* program;
+} ObjRegex;
+
+// Node of the tries behind vectors and hash maps. Nodes are shared
+// between versions of a collection and never change once the edit that
+// created them is over, so an update only copies the nodes on the path
+// to the value that changed.
+typedef struct {
+  Obj obj;
+  // Id of the edit that owns the node, which is the only one allowed
+  // to modify it in place
+  uint64_t edit;
+  // Which of the 32 children of a hash map node are present, or the hash
+  // that all keys of a collision node share
+  uint32_t bitmap;
+  bool collision;
+  // Number of slots in use and allocated
+  int count;
+  int capacity;
+  // Children or values of a vector node, and pairs of key and value in a
+  // hash map node. A child of a hash map node takes up a pair whose key
+  // is the child node itself, which can never be a key of the map.
+  Value slots[];
+} ObjTrieNode;
+
+// Persistent vector, a trie of 32-way nodes with the last (up to) 32
+// values kept in a separate tail node so that appending is cheap
+typedef struct {
+  Obj obj;
+  int count;
+  // Bits of an index used above the leaves of the trie
+  int shift;
+  // Either is NULL while the vector does not need it
+  OBJ_REF(ObjTrieNode) root;
+  OBJ_REF(ObjTrieNode) tail;
+  // Id of the edit while the vector is transient, zero otherwise
+  uint64_t edit;
+} ObjVector;
+
+// Persistent hash map, a hash array mapped trie
+typedef struct {
+  Obj obj;
+  int count;
+  // NULL while the map is empty
+  OBJ_REF(ObjTrieNode) root;
+  // Id of the edit while the map is transient, zero otherwise
+  uint64_t edit;
+} ObjHashMap;
+
+// A cached result of calling a memoized function with a particular
+// list of arguments
+typedef struct MemoEntry {
+  uint32_t hash;
+  Value result;
+  // Links to the neighbouring entries in least-recently-used order
+  // (or in the list of pending entries)
+  struct MemoEntry* prev;
+  struct MemoEntry* next;
+  // Next entry in the same hash bucket
+  struct MemoEntry* chain;
+  int argCount;
+  Value args[];
+} MemoEntry;
+
+// Callable wrapper around a closure that caches its results by
+// arguments, created by the memoize() native
+typedef struct {
+  Obj obj;
+  OBJ_REF(ObjClosure) function;
+  // Maximum number of cached results, the least recently used
+  // result is evicted beyond this. Zero means unlimited.
+  int maxSize;
+  int count;
+  // Number of buckets, always a power of two
+  int capacity;
+  MemoEntry** buckets;
+  // Most and least recently used entries
+  MemoEntry* newest;
+  MemoEntry* oldest;
+  // Entries whose calls have not returned yet
+  MemoEntry* pending;
+} ObjMemo;
+
+// Refers to an object without keeping it alive, once the target
+// is collected the reference is cleared
+typedef struct ObjWeakRef {
+  Obj obj;
+  OBJ_REF(Obj) target;
+  // Links together the weak references that the GC comes across
+  // while tracing, so that they can be cleared before sweeping
+  OBJ_REF(struct ObjWeakRef) nextWeak;
+} ObjWeakRef;
+
+// Laid out like an Entry of a Table, with the key between the type and
+// the data of the value
+typedef struct {
+  ValueType valueType;
+  // A NULL key together with a non-nil value is a tombstone,
+  // just like in Table
+  OBJ_REF(Obj) key;
+  ValueData valueData;
+} WeakEntry;
+
+static inline Value weakEntryValue(const WeakEntry* entry) {
+  return (Value){entry->valueType, entry->valueData};
+}
+
+static inline void setWeakEntryValue(WeakEntry* entry, Value value) {
+  entry->valueType = value.type;
+  entry->valueData = value.as;
+}
+
+// Hash map keyed by object identity that does not keep its keys alive.
+// Values are only kept alive for as long as their keys are, i.e. the
+// entries are ephemerons, and entries are dropped once the key is collected
+typedef struct ObjWeakMap {
+  Obj obj;
+  // Links together the weak maps that the GC comes across while tracing
+  OBJ_REF(struct ObjWeakMap) nextWeak;
+  int count;
+  int capacity;
+  WeakEntry* entries;
+} ObjWeakMap;
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+// Takes ownership of the bytes, which are assumed to be allocated
+ObjBuffer* newBuffer(uint8_t* bytes, size_t length);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
+ObjCsvReader* newCsvReader(uint8_t delimiter);
 ObjFunction* newFunction();
+ObjHashMap* newHashMap();
 ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
+ObjList* newList();
+ObjMemo* newMemo(ObjClosure* function, int maxSize);
+ObjNative* newNative(NativeFn function, int arity);
+// Copies the fields from the given array, which has to hold as many
+// values as the type has fields
+ObjRecord* newRecord(ObjRecordType* type, Value* fields);
+// The names of the fields start out as NULL
+ObjRecordType* newRecordType(ObjString* name, int fieldCount);
+// Takes ownership of the program, which is assumed to be allocated
+ObjRegex* newRegex(ObjString* pattern, RegexProgram* program);
+// Returns the index of the field with the given name, or -1
+int recordFieldIndex(ObjRecordType* type, ObjString* name);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+// The slots of the node start out as nil
+ObjTrieNode* newTrieNode(uint64_t edit, int capacity);
 ObjUpvalue* newUpvalue(Value* slot);
+ObjVector* newVector();
+ObjWeakMap* newWeakMap();
+ObjWeakRef* newWeakRef(Obj* target);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -0,0 +1,762 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "persistent.h"
+#include "vm.h"
+
+// Every update of a persistent collection is an edit of its own, as is
+// the whole lifetime of a transient one. Nodes remember the edit that
+// created them and only that edit gets to modify them in place, which
+// is how updates avoid touching nodes that other versions still share.
+// Ids are never reused, so the nodes of a finished edit are frozen.
+static uint64_t nextEdit = 1;
+
+typedef struct {
+  uint64_t id;
+  // Transient edits are likely to grow the same nodes again, so their
+  // nodes get some room to spare
+  bool transient;
+} Edit;
+
+// Transient collections carry the id of their edit, while persistent
+// ones get a fresh id for every update
+static void beginEdit(Edit* edit, uint64_t transientEdit) {
+  edit->transient = transientEdit != 0;
+  edit->id = edit->transient ? transientEdit : nextEdit++;
+}
+
+// Returns a node that the edit is allowed to modify with room for at
+// least the given number of slots, which is a copy unless the edit
+// already owns such a node. The caller has to store the result in the
+// parent of the node before allocating anything else.
+static ObjTrieNode* editableNode(Edit* edit, ObjTrieNode* node, int capacity) {
+  if (node->edit == edit->id && node->capacity >= capacity) return node;
+
+  if (edit->transient && capacity < TRIE_WIDTH) capacity += 4;
+  ObjTrieNode* copy = newTrieNode(edit->id, capacity);
+  copy->bitmap = node->bitmap;
+  copy->collision = node->collision;
+  copy->count = node->count;
+  memcpy(copy->slots, node->slots, sizeof(Value) * node->count);
+  return copy;
+}
+
+// Copies the header of a persistent collection for an update, while
+// transient collections are updated in place. The result is pushed
+// onto the stack as nothing else refers to it yet.
+static ObjVector* editVector(ObjVector* vector, Edit* edit) {
+  beginEdit(edit, vector->edit);
+  if (!edit->transient) {
+    ObjVector* copy = newVector();
+    copy->count = vector->count;
+    copy->shift = vector->shift;
+    copy->root = vector->root;
+    copy->tail = vector->tail;
+    vector = copy;
+  }
+  push(OBJ_VAL(vector));
+  return vector;
+}
+
+static ObjHashMap* editHashMap(ObjHashMap* map, Edit* edit) {
+  beginEdit(edit, map->edit);
+  if (!edit->transient) {
+    ObjHashMap* copy = newHashMap();
+    copy->count = map->count;
+    copy->root = map->root;
+    map = copy;
+  }
+  push(OBJ_VAL(map));
+  return map;
+}
+
+// Vectors
+
+// Index of the first value in the tail
+static int tailOffset(ObjVector* vector) {
+  if (vector->count < TRIE_WIDTH) return 0;
+  return ((vector->count - 1) >> TRIE_BITS) << TRIE_BITS;
+}
+
+// Returns the leaf that holds the value at the index
+static ObjTrieNode* leafFor(ObjVector* vector, int index) {
+  if (index >= tailOffset(vector)) return REF_PTR(ObjTrieNode, vector->tail);
+
+  ObjTrieNode* node = REF_PTR(ObjTrieNode, vector->root);
+  for (int level = vector->shift; level > 0; level -= TRIE_BITS) {
+    node = AS_TRIE_NODE(node->slots[(index >> level) & TRIE_MASK]);
+  }
+  return node;
+}
+
+Value vectorGet(ObjVector* vector, int index) {
+  return leafFor(vector, index)->slots[index & TRIE_MASK];
+}
+
+static void vectorAssoc(Edit* edit, ObjVector* vector, int index, Value value) {
+  if (index >= tailOffset(vector)) {
+    ObjTrieNode* tail = editableNode(edit, REF_PTR(ObjTrieNode, vector->tail), TRIE_WIDTH);
+    vector->tail = PTR_REF(tail);
+    tail->slots[index & TRIE_MASK] = value;
+    return;
+  }
+
+  // Copy the path down to the leaf, linking in every node right away
+  ObjTrieNode* node = editableNode(edit, REF_PTR(ObjTrieNode, vector->root), TRIE_WIDTH);
+  vector->root = PTR_REF(node);
+  for (int level = vector->shift; level > 0; level -= TRIE_BITS) {
+    int slot = (index >> level) & TRIE_MASK;
+    ObjTrieNode* child = editableNode(edit, AS_TRIE_NODE(node->slots[slot]), TRIE_WIDTH);
+    node->slots[slot] = OBJ_VAL(child);
+    node = child;
+  }
+  node->slots[index & TRIE_MASK] = value;
+}
+
+// Moves the full tail into the trie, growing the trie by a level if it
+// has no room left
+static void pushTail(Edit* edit, ObjVector* vector) {
+  // Index of the last value in the tail
+  int index = vector->count - 1;
+
+  ObjTrieNode* node;
+  if (vector->root == NULL_REF) {
+    node = newTrieNode(edit->id, TRIE_WIDTH);
+  } else if ((vector->count >> TRIE_BITS) > (1 << vector->shift)) {
+    node = newTrieNode(edit->id, TRIE_WIDTH);
+    node->slots[0] = OBJ_VAL(REF_PTR(ObjTrieNode, vector->root));
+    node->count = 1;
+    vector->shift += TRIE_BITS;
+  } else {
+    node = editableNode(edit, REF_PTR(ObjTrieNode, vector->root), TRIE_WIDTH);
+  }
+  vector->root = PTR_REF(node);
+
+  for (int level = vector->shift; level > TRIE_BITS; level -= TRIE_BITS) {
+    int slot = (index >> level) & TRIE_MASK;
+    ObjTrieNode* child;
+    if (slot < node->count) {
+      child = editableNode(edit, AS_TRIE_NODE(node->slots[slot]), TRIE_WIDTH);
+    } else {
+      child = newTrieNode(edit->id, TRIE_WIDTH);
+      node->count = slot + 1;
+    }
+    node->slots[slot] = OBJ_VAL(child);
+    node = child;
+  }
+
+  int slot = (index >> TRIE_BITS) & TRIE_MASK;
+  node->slots[slot] = OBJ_VAL(REF_PTR(ObjTrieNode, vector->tail));
+  node->count = slot + 1;
+}
+
+static void vectorAppend(Edit* edit, ObjVector* vector, Value value) {
+  ObjTrieNode* tail = REF_PTR(ObjTrieNode, vector->tail);
+  if (tail == NULL) {
+    tail = newTrieNode(edit->id, TRIE_WIDTH);
+  } else if (tail->count == TRIE_WIDTH) {
+    pushTail(edit, vector);
+    tail = newTrieNode(edit->id, TRIE_WIDTH);
+  } else {
+    tail = editableNode(edit, tail, TRIE_WIDTH);
+  }
+  vector->tail = PTR_REF(tail);
+
+  tail->slots[tail->count++] = value;
+  vector->count++;
+}
+
+// Removes the last leaf from the subtrie, which is the one that holds
+// the value at the index
+static void popLeaf(Edit* edit, ObjTrieNode* node, int level, int index) {
+  int slot = (index >> level) & TRIE_MASK;
+  if (level > TRIE_BITS) {
+    ObjTrieNode* child = editableNode(edit, AS_TRIE_NODE(node->slots[slot]), TRIE_WIDTH);
+    node->slots[slot] = OBJ_VAL(child);
+    popLeaf(edit, child, level - TRIE_BITS, index);
+    if (child->count > 0) return;
+  }
+
+  node->slots[slot] = NIL_VAL;
+  node->count--;
+}
+
+static void vectorRemoveLast(Edit* edit, ObjVector* vector) {
+  if (vector->count == 1) {
+    vector->count = 0;
+    vector->shift = TRIE_BITS;
+    vector->root = NULL_REF;
+    vector->tail = NULL_REF;
+    return;
+  }
+
+  ObjTrieNode* tail = REF_PTR(ObjTrieNode, vector->tail);
+  if (tail->count > 1) {
+    tail = editableNode(edit, tail, TRIE_WIDTH);
+    vector->tail = PTR_REF(tail);
+    tail->slots[--tail->count] = NIL_VAL;
+    vector->count--;
+    return;
+  }
+
+  // The tail is about to be empty, so the last leaf of the trie takes
+  // its place
+  int index = vector->count - 2;
+  vector->tail = PTR_REF(leafFor(vector, index));
+  ObjTrieNode* root = editableNode(edit, REF_PTR(ObjTrieNode, vector->root), TRIE_WIDTH);
+  vector->root = PTR_REF(root);
+  popLeaf(edit, root, vector->shift, index);
+
+  if (root->count == 0) {
+    vector->root = NULL_REF;
+  } else if (vector->shift > TRIE_BITS && root->count == 1) {
+    vector->root = PTR_REF(AS_TRIE_NODE(root->slots[0]));
+    vector->shift -= TRIE_BITS;
+  }
+  vector->count--;
+}
+
+bool vectorsEqual(ObjVector* a, ObjVector* b) {
+  if (a->count != b->count) return false;
+
+  for (int start = 0; start < a->count; start += TRIE_WIDTH) {
+    ObjTrieNode* leafA = leafFor(a, start);
+    ObjTrieNode* leafB = leafFor(b, start);
+    // Versions of a vector share most of their leaves
+    if (leafA == leafB) continue;
+
+    for (int i = 0; i < leafA->count; i++) {
+      if (!valuesEqual(leafA->slots[i], leafB->slots[i])) return false;
+    }
+  }
+  return true;
+}
+
+uint32_t hashVector(ObjVector* vector) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < vector->count; i++) {
+    hash = (hash ^ hashValue(vectorGet(vector, i))) * 16777619u;
+  }
+  return hash;
+}
+
+void printVector(ObjVector* vector) {
+  printf("vector(");
+  for (int i = 0; i < vector->count; i++) {
+    if (i > 0) printf(", ");
+    printValue(vectorGet(vector, i));
+  }
+  printf(")");
+}
+
+// Hash maps
+
+static int countBits(uint32_t bits) {
+  bits = bits - ((bits >> 1) & 0x55555555u);
+  bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+  return (int)((((bits + (bits >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+}
+
+// Returns the slot of the key's pair in a collision node, or -1
+static int findCollision(ObjTrieNode* node, Value key) {
+  for (int i = 0; i < node->count; i += 2) {
+    if (valuesEqual(node->slots[i], key)) return i;
+  }
+  return -1;
+}
+
+bool hashMapGet(ObjHashMap* map, Value key, Value* value) {
+  uint32_t hash = hashValue(key);
+  ObjTrieNode* node = REF_PTR(ObjTrieNode, map->root);
+
+  for (int shift = 0; node != NULL; shift += TRIE_BITS) {
+    int slot;
+    if (node->collision) {
+      slot = findCollision(node, key);
+      if (slot < 0) return false;
+    } else {
+      uint32_t bit = 1u << ((hash >> shift) & TRIE_MASK);
+      if (!(node->bitmap & bit)) return false;
+      slot = 2 * countBits(node->bitmap & (bit - 1));
+
+      if (IS_TRIE_NODE(node->slots[slot])) {
+        node = AS_TRIE_NODE(node->slots[slot]);
+        continue;
+      }
+      if (!valuesEqual(node->slots[slot], key)) return false;
+    }
+
+    *value = node->slots[slot + 1];
+    return true;
+  }
+  return false;
+}
+
+// Inserts a pair into the node that ref points to, replacing the node
+// with one the edit owns if needed. Refs point into nodes the edit
+// already owns (or onto the stack), so every new node is reachable as
+// soon as it is stored there.
+static void nodeAssoc(Edit* edit, Value* ref, int shift, uint32_t hash,
+                      Value key, Value value, bool* added) {
+  ObjTrieNode* node = AS_TRIE_NODE(*ref);
+
+  if (node->collision) {
+    int slot = findCollision(node, key);
+    if (slot < 0) {
+      node = editableNode(edit, node, node->count + 2);
+      *ref = OBJ_VAL(node);
+      node->slots[node->count++] = key;
+      node->slots[node->count++] = value;
+      *added = true;
+    } else {
+      node = editableNode(edit, node, node->count);
+      *ref = OBJ_VAL(node);
+      node->slots[slot + 1] = value;
+    }
+    return;
+  }
+
+  uint32_t bit = 1u << ((hash >> shift) & TRIE_MASK);
+  int slot = 2 * countBits(node->bitmap & (bit - 1));
+
+  if (!(node->bitmap & bit)) {
+    node = editableNode(edit, node, node->count + 2);
+    *ref = OBJ_VAL(node);
+    memmove(&node->slots[slot + 2], &node->slots[slot],
+            sizeof(Value) * (node->count - slot));
+    node->slots[slot] = key;
+    node->slots[slot + 1] = value;
+    node->count += 2;
+    node->bitmap |= bit;
+    *added = true;
+    return;
+  }
+
+  node = editableNode(edit, node, node->count);
+  *ref = OBJ_VAL(node);
+  Value entry = node->slots[slot];
+
+  if (IS_TRIE_NODE(entry)) {
+    nodeAssoc(edit, &node->slots[slot], shift + TRIE_BITS, hash, key, value, added);
+    return;
+  }
+
+  if (valuesEqual(entry, key)) {
+    node->slots[slot + 1] = value;
+    return;
+  }
+
+  // Two keys want the same slot, so the pair that is already there
+  // moves down into a node of its own which then takes the new pair.
+  // Keys whose hashes are equal end up in a collision node once all
+  // bits of the hash have been used.
+  int childShift = shift + TRIE_BITS;
+  uint32_t entryHash = hashValue(entry);
+  ObjTrieNode* child = newTrieNode(edit->id, 4);
+  if (childShift >= 32) {
+    child->collision = true;
+    child->bitmap = entryHash;
+  } else {
+    child->bitmap = 1u << ((entryHash >> childShift) & TRIE_MASK);
+  }
+  child->slots[0] = entry;
+  child->slots[1] = node->slots[slot + 1];
+  child->count = 2;
+
+  node->slots[slot] = OBJ_VAL(child);
+  node->slots[slot + 1] = NIL_VAL;
+  nodeAssoc(edit, &node->slots[slot], childShift, hash, key, value, added);
+}
+
+// Removes the pair of a key that is known to be in the node that ref
+// points to. Nodes that end up empty are left for the parent to remove.
+static void nodeDissoc(Edit* edit, Value* ref, int shift, uint32_t hash, Value key) {
+  ObjTrieNode* node = editableNode(edit, AS_TRIE_NODE(*ref), AS_TRIE_NODE(*ref)->count);
+  *ref = OBJ_VAL(node);
+
+  int slot;
+  if (node->collision) {
+    slot = findCollision(node, key);
+  } else {
+    uint32_t bit = 1u << ((hash >> shift) & TRIE_MASK);
+    slot = 2 * countBits(node->bitmap & (bit - 1));
+
+    if (IS_TRIE_NODE(node->slots[slot])) {
+      nodeDissoc(edit, &node->slots[slot], shift + TRIE_BITS, hash, key);
+      if (AS_TRIE_NODE(node->slots[slot])->count > 0) return;
+    }
+    node->bitmap &= ~bit;
+  }
+
+  memmove(&node->slots[slot], &node->slots[slot + 2],
+          sizeof(Value) * (node->count - slot - 2));
+  node->count -= 2;
+  node->slots[node->count] = NIL_VAL;
+  node->slots[node->count + 1] = NIL_VAL;
+}
+
+static void hashMapAssoc(Edit* edit, ObjHashMap* map, Value key, Value value) {
+  if (map->root == NULL_REF) map->root = PTR_REF(newTrieNode(edit->id, 2));
+
+  // The root is kept on the stack while it is being replaced
+  push(OBJ_VAL(REF_PTR(ObjTrieNode, map->root)));
+  bool added = false;
+  nodeAssoc(edit, vm.stackTop - 1, 0, hashValue(key), key, value, &added);
+  map->root = PTR_REF(AS_TRIE_NODE(pop()));
+
+  if (added) map->count++;
+}
+
+static void hashMapDissoc(Edit* edit, ObjHashMap* map, Value key) {
+  push(OBJ_VAL(REF_PTR(ObjTrieNode, map->root)));
+  nodeDissoc(edit, vm.stackTop - 1, 0, hashValue(key), key);
+  map->root = PTR_REF(AS_TRIE_NODE(pop()));
+
+  if (--map->count == 0) map->root = NULL_REF;
+}
+
+// Returns false if any pair of the node is missing from the map
+static bool nodeEntriesIn(ObjTrieNode* node, ObjHashMap* map) {
+  for (int i = 0; i < node->count; i += 2) {
+    if (IS_TRIE_NODE(node->slots[i])) {
+      if (!nodeEntriesIn(AS_TRIE_NODE(node->slots[i]), map)) return false;
+      continue;
+    }
+
+    Value value;
+    if (!hashMapGet(map, node->slots[i], &value) ||
+        !valuesEqual(value, node->slots[i + 1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool hashMapsEqual(ObjHashMap* a, ObjHashMap* b) {
+  if (a->count != b->count) return false;
+  if (a->root == b->root) return true;
+  return nodeEntriesIn(REF_PTR(ObjTrieNode, a->root), b);
+}
+
+static uint32_t hashNode(ObjTrieNode* node) {
+  uint32_t hash = 0;
+  for (int i = 0; i < node->count; i += 2) {
+    if (IS_TRIE_NODE(node->slots[i])) {
+      hash += hashNode(AS_TRIE_NODE(node->slots[i]));
+    } else {
+      // Summing the pairs makes the hash independent of their order
+      hash += hashValue(node->slots[i]) ^ (hashValue(node->slots[i + 1]) * 16777619u);
+    }
+  }
+  return hash;
+}
+
+uint32_t hashHashMap(ObjHashMap* map) {
+  return map->root == NULL_REF ? 0 : hashNode(REF_PTR(ObjTrieNode, map->root));
+}
+
+static void printNode(ObjTrieNode* node, bool* first) {
+  for (int i = 0; i < node->count; i += 2) {
+    if (IS_TRIE_NODE(node->slots[i])) {
+      printNode(AS_TRIE_NODE(node->slots[i]), first);
+      continue;
+    }
+
+    if (!*first) printf(", ");
+    *first = false;
+    printValue(node->slots[i]);
+    printf(", ");
+    printValue(node->slots[i + 1]);
+  }
+}
+
+void printHashMap(ObjHashMap* map) {
+  printf("hashMap(");
+  bool first = true;
+  if (map->root != NULL_REF) printNode(REF_PTR(ObjTrieNode, map->root), &first);
+  printf(")");
+}
+
+void beginTransient(Obj* collection) {
+  if (collection->type == OBJ_VECTOR) {
+    ((ObjVector*)collection)->edit = nextEdit++;
+  } else {
+    ((ObjHashMap*)collection)->edit = nextEdit++;
+  }
+}
+
+void endTransient(Obj* collection) {
+  if (collection->type == OBJ_VECTOR) {
+    ((ObjVector*)collection)->edit = 0;
+  } else {
+    ((ObjHashMap*)collection)->edit = 0;
+  }
+}
+
+bool isTransient(Value value) {
+  if (IS_VECTOR(value)) return AS_VECTOR(value)->edit != 0;
+  if (IS_HASH_MAP(value)) return AS_HASH_MAP(value)->edit != 0;
+  return false;
+}
+
+void transientAppend(ObjVector* vector, Value value) {
+  Edit edit;
+  beginEdit(&edit, vector->edit);
+  vectorAppend(&edit, vector, value);
+}
+
+void transientSet(ObjHashMap* map, Value key, Value value) {
+  Edit edit;
+  beginEdit(&edit, map->edit);
+  hashMapAssoc(&edit, map, key, value);
+}
+
+// Natives
+
+static bool checkVector(Value value) {
+  if (!IS_VECTOR(value)) {
+    nativeError("Argument must be a vector.");
+    return false;
+  }
+  return true;
+}
+
+static bool checkHashMap(Value value) {
+  if (!IS_HASH_MAP(value)) {
+    nativeError("Argument must be a hash map.");
+    return false;
+  }
+  return true;
+}
+
+// Returns false (after reporting the error) if the value is not a valid
+// index into the vector, which may be one past the end if allowed
+static bool checkIndex(ObjVector* vector, Value index, bool allowEnd) {
+  if (!IS_NUMBER(index)) {
+    nativeError("Vector index must be a number.");
+    return false;
+  }
+
+  double number = AS_NUMBER(index);
+  int end = allowEnd ? vector->count + 1 : vector->count;
+  if (number < 0 || number >= end || number != (int)number) {
+    nativeError("Vector index out of bounds.");
+    return false;
+  }
+  return true;
+}
+
+// vector(a, b, ...) creates a vector of its arguments
+static Value vectorNative(int argCount, Value* args) {
+  ObjVector* vector = newVector();
+  push(OBJ_VAL(vector));
+
+  // A single edit fills the vector in place
+  Edit edit;
+  beginEdit(&edit, 0);
+  for (int i = 0; i < argCount; i++) {
+    vectorAppend(&edit, vector, args[i]);
+  }
+
+  pop();
+  return OBJ_VAL(vector);
+}
+
+static Value vectorGetNative(int argCount, Value* args) {
+  if (!checkVector(args[0])) return NIL_VAL;
+  ObjVector* vector = AS_VECTOR(args[0]);
+  if (!checkIndex(vector, args[1], false)) return NIL_VAL;
+
+  return vectorGet(vector, (int)AS_NUMBER(args[1]));
+}
+
+// vectorSet(vector, index, value) returns a vector with the value at the
+// index replaced, or appended if the index is the length of the vector
+static Value vectorSetNative(int argCount, Value* args) {
+  if (!checkVector(args[0])) return NIL_VAL;
+  if (!checkIndex(AS_VECTOR(args[0]), args[1], true)) return NIL_VAL;
+
+  Edit edit;
+  ObjVector* vector = editVector(AS_VECTOR(args[0]), &edit);
+  int index = (int)AS_NUMBER(args[1]);
+  if (index == vector->count) {
+    vectorAppend(&edit, vector, args[2]);
+  } else {
+    vectorAssoc(&edit, vector, index, args[2]);
+  }
+  return pop();
+}
+
+static Value vectorPushNative(int argCount, Value* args) {
+  if (!checkVector(args[0])) return NIL_VAL;
+
+  Edit edit;
+  ObjVector* vector = editVector(AS_VECTOR(args[0]), &edit);
+  vectorAppend(&edit, vector, args[1]);
+  return pop();
+}
+
+// vectorPop(vector) returns a vector without the last value
+static Value vectorPopNative(int argCount, Value* args) {
+  if (!checkVector(args[0])) return NIL_VAL;
+  if (AS_VECTOR(args[0])->count == 0) {
+    return nativeError("Can't pop from an empty vector.");
+  }
+
+  Edit edit;
+  ObjVector* vector = editVector(AS_VECTOR(args[0]), &edit);
+  vectorRemoveLast(&edit, vector);
+  return pop();
+}
+
+static Value vectorLengthNative(int argCount, Value* args) {
+  if (!checkVector(args[0])) return NIL_VAL;
+
+  return NUMBER_VAL(AS_VECTOR(args[0])->count);
+}
+
+// hashMap(key, value, ...) creates a hash map of its arguments
+static Value hashMapNative(int argCount, Value* args) {
+  if (argCount % 2 != 0) {
+    return nativeError("Expected pairs of keys and values.");
+  }
+
+  ObjHashMap* map = newHashMap();
+  push(OBJ_VAL(map));
+
+  Edit edit;
+  beginEdit(&edit, 0);
+  for (int i = 0; i < argCount; i += 2) {
+    hashMapAssoc(&edit, map, args[i], args[i + 1]);
+  }
+
+  pop();
+  return OBJ_VAL(map);
+}
+
+// hashMapGet(map, key) returns nil if the key is missing
+static Value hashMapGetNative(int argCount, Value* args) {
+  if (!checkHashMap(args[0])) return NIL_VAL;
+
+  Value value;
+  if (!hashMapGet(AS_HASH_MAP(args[0]), args[1], &value)) return NIL_VAL;
+  return value;
+}
+
+static Value hashMapHasNative(int argCount, Value* args) {
+  if (!checkHashMap(args[0])) return NIL_VAL;
+
+  Value value;
+  return BOOL_VAL(hashMapGet(AS_HASH_MAP(args[0]), args[1], &value));
+}
+
+static Value hashMapSetNative(int argCount, Value* args) {
+  if (!checkHashMap(args[0])) return NIL_VAL;
+
+  Edit edit;
+  ObjHashMap* map = editHashMap(AS_HASH_MAP(args[0]), &edit);
+  hashMapAssoc(&edit, map, args[1], args[2]);
+  return pop();
+}
+
+static Value hashMapRemoveNative(int argCount, Value* args) {
+  if (!checkHashMap(args[0])) return NIL_VAL;
+  ObjHashMap* map = AS_HASH_MAP(args[0]);
+
+  // Removing a missing key changes nothing, so nothing is copied
+  Value value;
+  if (!hashMapGet(map, args[1], &value)) return args[0];
+
+  Edit edit;
+  map = editHashMap(map, &edit);
+  hashMapDissoc(&edit, map, args[1]);
+  return pop();
+}
+
+static Value hashMapLengthNative(int argCount, Value* args) {
+  if (!checkHashMap(args[0])) return NIL_VAL;
+
+  return NUMBER_VAL(AS_HASH_MAP(args[0])->count);
+}
+
+static void appendKeys(ObjList* keys, ObjTrieNode* node) {
+  for (int i = 0; i < node->count; i += 2) {
+    if (IS_TRIE_NODE(node->slots[i])) {
+      appendKeys(keys, AS_TRIE_NODE(node->slots[i]));
+    } else {
+      writeValueArray(&keys->items, node->slots[i]);
+    }
+  }
+}
+
+// hashMapKeys(map) returns a list of the keys, in no particular order
+static Value hashMapKeysNative(int argCount, Value* args) {
+  if (!checkHashMap(args[0])) return NIL_VAL;
+  ObjHashMap* map = AS_HASH_MAP(args[0]);
+
+  ObjList* keys = newList();
+  push(OBJ_VAL(keys));
+  if (map->root != NULL_REF) appendKeys(keys, REF_PTR(ObjTrieNode, map->root));
+  pop();
+  return OBJ_VAL(keys);
+}
+
+// transient(collection) returns a copy of a vector or hash map that the
+// update natives modify in place (returning the collection itself),
+// until persistent() is called on it. Nothing is copied up front, nodes
+// are copied the first time the transient touches them.
+static Value transientNative(int argCount, Value* args) {
+  if (IS_VECTOR(args[0])) {
+    ObjVector* vector = AS_VECTOR(args[0]);
+    ObjVector* copy = newVector();
+    copy->count = vector->count;
+    copy->shift = vector->shift;
+    copy->root = vector->root;
+    copy->tail = vector->tail;
+    beginTransient((Obj*)copy);
+    return OBJ_VAL(copy);
+  }
+
+  if (IS_HASH_MAP(args[0])) {
+    ObjHashMap* map = AS_HASH_MAP(args[0]);
+    ObjHashMap* copy = newHashMap();
+    copy->count = map->count;
+    copy->root = map->root;
+    beginTransient((Obj*)copy);
+    return OBJ_VAL(copy);
+  }
+
+  return nativeError("Argument must be a vector or a hash map.");
+}
+
+// persistent(collection) ends the edit of a transient collection, which
+// from then on behaves like any other persistent one
+static Value persistentNative(int argCount, Value* args) {
+  if (!IS_VECTOR(args[0]) && !IS_HASH_MAP(args[0])) {
+    return nativeError("Argument must be a vector or a hash map.");
+  }
+
+  endTransient(AS_OBJ(args[0]));
+  return args[0];
+}
+
+void definePersistentNatives() {
+  defineNative("vector", vectorNative, -1);
+  defineNative("vectorGet", vectorGetNative, 2);
+  defineNative("vectorSet", vectorSetNative, 3);
+  defineNative("vectorPush", vectorPushNative, 2);
+  defineNative("vectorPop", vectorPopNative, 1);
+  defineNative("vectorLength", vectorLengthNative, 1);
+
+  defineNative("hashMap", hashMapNative, -1);
+  defineNative("hashMapGet", hashMapGetNative, 2);
+  defineNative("hashMapHas", hashMapHasNative, 2);
+  defineNative("hashMapSet", hashMapSetNative, 3);
+  defineNative("hashMapRemove", hashMapRemoveNative, 2);
+  defineNative("hashMapLength", hashMapLengthNative, 1);
+  defineNative("hashMapKeys", hashMapKeysNative, 1);
+
+  defineNative("transient", transientNative, 1);
+  defineNative("persistent", persistentNative, 1);
+}
@@ -0,0 +1,42 @@
+#ifndef clox_persistent_h
+#define clox_persistent_h
+
+#include "object.h"
+
+// Each level of the tries behind vectors and hash maps consumes this many
+// bits of an index or a hash, i.e. nodes have up to 32 children
+#define TRIE_BITS 5
+#define TRIE_WIDTH (1 << TRIE_BITS)
+#define TRIE_MASK (TRIE_WIDTH - 1)
+
+// The index has to be in bounds
+Value vectorGet(ObjVector* vector, int index);
+// Returns false if the key is not in the map
+bool hashMapGet(ObjHashMap* map, Value key, Value* value);
+
+// Lets a vector or hash map that nothing else refers to yet be filled in
+// place, e.g. while deserializing, until endTransient() is called
+void beginTransient(Obj* collection);
+void endTransient(Obj* collection);
+// Whether the value is a vector or hash map that is still transient
+bool isTransient(Value value);
+// Update a transient collection in place, the values have to be
+// reachable by the GC
+void transientAppend(ObjVector* vector, Value value);
+void transientSet(ObjHashMap* map, Value key, Value value);
+
+// Collections are compared (and hashed) by their contents, just
+// like records
+bool vectorsEqual(ObjVector* a, ObjVector* b);
+bool hashMapsEqual(ObjHashMap* a, ObjHashMap* b);
+uint32_t hashVector(ObjVector* vector);
+uint32_t hashHashMap(ObjHashMap* map);
+
+void printVector(ObjVector* vector);
+void printHashMap(ObjHashMap* map);
+
+// Registers the natives for creating and updating vectors and hash maps,
+// along with transient() and persistent() for batches of updates
+void definePersistentNatives();
+
+#endif
@@ -0,0 +1,1189 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "regex.h"
+#include "vm.h"
+
+// Patterns are parsed into a tree, which is compiled into an NFA, i.e. a
+// program of instructions like in Thompson's construction. The NFA is
+// never run directly. Instead, states of a DFA (sets of NFA
+// instructions) are built lazily as the input calls for them, and cached
+// along with their transitions, so that matching takes a table lookup
+// per byte and never backtracks.
+//
+// Matches are leftmost-longest. A DFA for the reversed pattern scans the
+// input backwards to find where matches start, and the DFA for the
+// pattern then finds the longest match from the leftmost start.
+
+// Limits that keep pathological patterns from using up all memory
+#define MAX_REPEAT 1000
+#define MAX_INSTRUCTIONS 100000
+#define MAX_NESTING 1000
+// Once there are this many states, the cache of a DFA is thrown away
+// and built up again as needed
+#define MAX_DFA_STATES 2000
+// Patterns compiled through a string are cached, until there are too
+// many of them
+#define REGEX_CACHE_SIZE 64
+
+// The state that no match can come out of, once a DFA reaches it there
+// is no point in reading any further
+#define DEAD_STATE 0
+
+typedef struct {
+  uint32_t bits[8];
+} ByteSet;
+
+static bool setHas(const ByteSet* set, uint8_t byte) {
+  return (set->bits[byte >> 5] >> (byte & 31)) & 1;
+}
+
+static void setAdd(ByteSet* set, uint8_t byte) {
+  set->bits[byte >> 5] |= 1u << (byte & 31);
+}
+
+static void setAddRange(ByteSet* set, uint8_t from, uint8_t to) {
+  for (int byte = from; byte <= to; byte++) {
+    setAdd(set, (uint8_t)byte);
+  }
+}
+
+static void setAddAll(ByteSet* set, const ByteSet* other) {
+  for (int i = 0; i < 8; i++) {
+    set->bits[i] |= other->bits[i];
+  }
+}
+
+static void setInvert(ByteSet* set) {
+  for (int i = 0; i < 8; i++) {
+    set->bits[i] = ~set->bits[i];
+  }
+}
+
+typedef enum {
+  // Any byte of a set
+  NODE_SET,
+  // ^ and $, which only hold at the start and end of the input
+  NODE_START,
+  NODE_END,
+  NODE_CONCAT,
+  NODE_ALTERNATE,
+  NODE_REPEAT,
+} NodeType;
+
+// Nodes refer to each other by their index, since the array of nodes
+// grows as the pattern is parsed. Concatenations and alternations have
+// a list of children linked through next, rather than nesting once per
+// child, so that long patterns don't make compiling recurse deeply.
+typedef struct {
+  NodeType type;
+  int set;
+  int first;
+  int last;
+  int next;
+  // For repetitions, max is -1 if there is no upper bound
+  int min;
+  int max;
+} Node;
+
+typedef struct {
+  const char* start;
+  const char* current;
+  const char* end;
+
+  Node* nodes;
+  int nodeCount;
+  int nodeCapacity;
+
+  ByteSet* sets;
+  int setCount;
+  int setCapacity;
+
+  int depth;
+  // Set once the pattern turns out to be invalid, after the error has
+  // been reported
+  bool failed;
+} PatternParser;
+
+typedef enum {
+  // Consumes a byte of the set in x
+  INST_SET,
+  // Continues at both x and y
+  INST_SPLIT,
+  INST_JUMP,
+  // Only hold if the scan started or ends at the edge of the input,
+  // which for the reversed pattern are the end and start of the input
+  INST_SCAN_START,
+  INST_SCAN_END,
+  INST_MATCH,
+} InstType;
+
+typedef struct {
+  InstType type;
+  int x;
+  int y;
+} Inst;
+
+typedef struct {
+  // Sorted instructions the NFA could be at, only those that consume a
+  // byte, wait for the end of the scan, or match are kept
+  int* insts;
+  int instCount;
+  uint32_t hash;
+  // Whether the scan started at the edge of the input and has not
+  // consumed anything since, which decides whether INST_SCAN_START holds
+  bool atStart;
+  // Whether the state is a match, and whether it is one if the input
+  // ends right here
+  bool matching;
+  bool matchingAtEnd;
+  // States reached on each byte, -1 where they are not known yet
+  int next[256];
+} DfaState;
+
+typedef struct {
+  Inst* code;
+  int codeCount;
+  int codeCapacity;
+
+  DfaState* states;
+  int stateCount;
+  int stateCapacity;
+  // Open addressing table of state indices by their contents, -1 for
+  // empty buckets
+  int* buckets;
+  int bucketCapacity;
+  // Start states for scans that do and don't start at the edge of the
+  // input, -1 until they are needed
+  int starts[2];
+  // Counts how many times the cache was thrown away, so that callers
+  // can tell whether a state they held on to is gone
+  int flushes;
+
+  // Scratch space for building the set of instructions of a state, with
+  // marks for the instructions that were added by the current build
+  int* stack;
+  int* set;
+  int setCount;
+  uint32_t* marks;
+  uint32_t generation;
+} Dfa;
+
+struct RegexProgram {
+  ByteSet* sets;
+  int setCapacity;
+  // Runs the pattern forwards from a given start
+  Dfa forward;
+  // Runs the reversed pattern backwards from the end of the input, and
+  // is in a matching state wherever a match of the pattern starts
+  Dfa reverse;
+};
+
+// Regexes by their pattern strings
+static Table regexCache;
+
+static void patternError(PatternParser* parser, const char* message) {
+  if (!parser->failed) {
+    nativeError("%s in regex at offset %d.", message, (int)(parser->current - parser->start));
+  }
+  parser->failed = true;
+}
+
+static int addNode(PatternParser* parser, NodeType type, int child) {
+  if (parser->nodeCapacity < parser->nodeCount + 1) {
+    int oldCapacity = parser->nodeCapacity;
+    parser->nodeCapacity = GROW_CAPACITY(oldCapacity);
+    parser->nodes = GROW_ARRAY(Node, parser->nodes, oldCapacity, parser->nodeCapacity);
+  }
+
+  Node* node = &parser->nodes[parser->nodeCount];
+  node->type = type;
+  node->set = -1;
+  node->first = child;
+  node->last = child;
+  node->next = -1;
+  node->min = 0;
+  node->max = 0;
+  return parser->nodeCount++;
+}
+
+static int addSet(PatternParser* parser, const ByteSet* set) {
+  if (parser->setCapacity < parser->setCount + 1) {
+    int oldCapacity = parser->setCapacity;
+    parser->setCapacity = GROW_CAPACITY(oldCapacity);
+    parser->sets = GROW_ARRAY(ByteSet, parser->sets, oldCapacity, parser->setCapacity);
+  }
+
+  parser->sets[parser->setCount] = *set;
+  return parser->setCount++;
+}
+
+static int addSetNode(PatternParser* parser, const ByteSet* set) {
+  int index = addSet(parser, set);
+  int node = addNode(parser, NODE_SET, -1);
+  parser->nodes[node].set = index;
+  return node;
+}
+
+static bool isAtEnd(PatternParser* parser) {
+  return parser->current == parser->end;
+}
+
+static char peekChar(PatternParser* parser) {
+  return isAtEnd(parser) ? '\0' : *parser->current;
+}
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool isAlphanumeric(char c) {
+  return isDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Adds the bytes that a class escape like \d stands for, or returns
+// false if the character does not name a class
+static bool addClassEscape(ByteSet* set, char c) {
+  ByteSet class;
+  memset(&class, 0, sizeof(class));
+
+  switch (c) {
+    case 'd': case 'D':
+      setAddRange(&class, '0', '9');
+      break;
+    case 'w': case 'W':
+      setAddRange(&class, '0', '9');
+      setAddRange(&class, 'a', 'z');
+      setAddRange(&class, 'A', 'Z');
+      setAdd(&class, '_');
+      break;
+    case 's': case 'S':
+      setAddRange(&class, '\t', '\r');
+      setAdd(&class, ' ');
+      break;
+    default:
+      return false;
+  }
+
+  if (c >= 'A' && c <= 'Z') setInvert(&class);
+  setAddAll(set, &class);
+  return true;
+}
+
+// Parses the character after a backslash that stands for a single byte,
+// or returns -1
+static int parseEscapedByte(PatternParser* parser) {
+  if (isAtEnd(parser)) {
+    patternError(parser, "Trailing backslash");
+    return -1;
+  }
+
+  char c = *parser->current++;
+  switch (c) {
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case '0': return '\0';
+    default:
+      // Other letters and digits are reserved for escapes that might
+      // be added later
+      if (isAlphanumeric(c)) {
+        parser->current--;
+        patternError(parser, "Unknown escape");
+        return -1;
+      }
+      return (uint8_t)c;
+  }
+}
+
+// Parses a single byte of a class, which might be escaped, or returns -1
+static int parseClassByte(PatternParser* parser) {
+  char c = *parser->current++;
+  if (c != '\\') return (uint8_t)c;
+  return parseEscapedByte(parser);
+}
+
+// Parses a class like [a-z_] after its opening bracket
+static int parseClass(PatternParser* parser) {
+  ByteSet set;
+  memset(&set, 0, sizeof(set));
+  bool negated = false;
+  if (peekChar(parser) == '^') {
+    negated = true;
+    parser->current++;
+  }
+
+  // A ] right at the start is taken literally
+  bool first = true;
+  while (!isAtEnd(parser) && (first || *parser->current != ']')) {
+    first = false;
+
+    if (parser->current[0] == '\\' && parser->end - parser->current >= 2 &&
+        addClassEscape(&set, parser->current[1])) {
+      parser->current += 2;
+      continue;
+    }
+
+    int from = parseClassByte(parser);
+    if (from < 0) return -1;
+    int to = from;
+    if (parser->end - parser->current >= 2 && parser->current[0] == '-' &&
+        parser->current[1] != ']') {
+      parser->current++;
+      to = parseClassByte(parser);
+      if (to < 0) return -1;
+      if (to < from) {
+        patternError(parser, "Invalid range");
+        return -1;
+      }
+    }
+    setAddRange(&set, (uint8_t)from, (uint8_t)to);
+  }
+
+  if (isAtEnd(parser)) {
+    patternError(parser, "Missing ']'");
+    return -1;
+  }
+  parser->current++;
+
+  if (negated) setInvert(&set);
+  return addSetNode(parser, &set);
+}
+
+static int parseAlternation(PatternParser* parser);
+
+static int parseAtom(PatternParser* parser) {
+  char c = *parser->current++;
+  ByteSet set;
+  memset(&set, 0, sizeof(set));
+
+  switch (c) {
+    case '(': {
+      // Groups don't capture anything, so (?:...) is the same thing
+      if (parser->end - parser->current >= 2 && parser->current[0] == '?' &&
+          parser->current[1] == ':') {
+        parser->current += 2;
+      }
+      int node = parseAlternation(parser);
+      if (parser->failed) return -1;
+      if (peekChar(parser) != ')') {
+        patternError(parser, "Missing ')'");
+        return -1;
+      }
+      parser->current++;
+      return node;
+    }
+    case '[':
+      return parseClass(parser);
+    case '.':
+      // Any byte but a line break
+      setInvert(&set);
+      set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+      return addSetNode(parser, &set);
+    case '^':
+      return addNode(parser, NODE_START, -1);
+    case '$':
+      return addNode(parser, NODE_END, -1);
+    case '*': case '+': case '?': case '{':
+      parser->current--;
+      patternError(parser, "Nothing to repeat");
+      return -1;
+    case '\\': {
+      if (!isAtEnd(parser) && addClassEscape(&set, *parser->current)) {
+        parser->current++;
+        return addSetNode(parser, &set);
+      }
+      int byte = parseEscapedByte(parser);
+      if (byte < 0) return -1;
+      setAdd(&set, (uint8_t)byte);
+      return addSetNode(parser, &set);
+    }
+    default:
+      setAdd(&set, (uint8_t)c);
+      return addSetNode(parser, &set);
+  }
+}
+
+static bool parseCount(PatternParser* parser, int* count) {
+  if (!isDigit(peekChar(parser))) {
+    patternError(parser, "Expected a repetition count");
+    return false;
+  }
+
+  *count = 0;
+  while (isDigit(peekChar(parser))) {
+    *count = *count * 10 + (*parser->current++ - '0');
+    if (*count > MAX_REPEAT) {
+      patternError(parser, "Repetition count is too large");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses the bounds of {m}, {m,} or {m,n} after the opening brace
+static bool parseBounds(PatternParser* parser, int* min, int* max) {
+  if (!parseCount(parser, min)) return false;
+  *max = *min;
+  if (peekChar(parser) == ',') {
+    parser->current++;
+    *max = -1;
+    if (peekChar(parser) != '}' && !parseCount(parser, max)) return false;
+  }
+
+  if (peekChar(parser) != '}') {
+    patternError(parser, "Missing '}'");
+    return false;
+  }
+  parser->current++;
+
+  if (*max != -1 && *max < *min) {
+    patternError(parser, "Invalid repetition bounds");
+    return false;
+  }
+  return true;
+}
+
+static int parseRepeat(PatternParser* parser) {
+  int node = parseAtom(parser);
+
+  while (!parser->failed && !isAtEnd(parser)) {
+    int min;
+    int max;
+    switch (*parser->current) {
+      case '*': min = 0; max = -1; break;
+      case '+': min = 1; max = -1; break;
+      case '?': min = 0; max = 1; break;
+      case '{': break;
+      default: return node;
+    }
+
+    if (*parser->current++ == '{' && !parseBounds(parser, &min, &max)) return -1;
+
+    node = addNode(parser, NODE_REPEAT, node);
+    parser->nodes[node].min = min;
+    parser->nodes[node].max = max;
+  }
+  return parser->failed ? -1 : node;
+}
+
+// Adds a node to the end of the children of a concatenation or
+// alternation
+static void addChild(PatternParser* parser, int parent, int child) {
+  Node* node = &parser->nodes[parent];
+  if (node->first == -1) {
+    node->first = child;
+  } else {
+    parser->nodes[node->last].next = child;
+  }
+  node->last = child;
+}
+
+static int parseConcat(PatternParser* parser) {
+  int node = addNode(parser, NODE_CONCAT, -1);
+  while (!parser->failed && !isAtEnd(parser) && *parser->current != '|' &&
+         *parser->current != ')') {
+    int child = parseRepeat(parser);
+    if (child < 0) return -1;
+    addChild(parser, node, child);
+  }
+  return parser->failed ? -1 : node;
+}
+
+static int parseAlternation(PatternParser* parser) {
+  if (++parser->depth > MAX_NESTING) {
+    patternError(parser, "Pattern is nested too deeply");
+    return -1;
+  }
+
+  int node = addNode(parser, NODE_ALTERNATE, -1);
+  for (;;) {
+    int child = parseConcat(parser);
+    if (child < 0) return -1;
+    addChild(parser, node, child);
+
+    if (peekChar(parser) != '|') break;
+    parser->current++;
+  }
+
+  parser->depth--;
+  return parser->failed ? -1 : node;
+}
+
+// Appends an instruction, or returns -1 once the program is too large
+static int emit(Dfa* dfa, InstType type, int x, int y) {
+  if (dfa->codeCount == MAX_INSTRUCTIONS) return -1;
+  if (dfa->codeCapacity < dfa->codeCount + 1) {
+    int oldCapacity = dfa->codeCapacity;
+    dfa->codeCapacity = GROW_CAPACITY(oldCapacity);
+    dfa->code = GROW_ARRAY(Inst, dfa->code, oldCapacity, dfa->codeCapacity);
+  }
+
+  Inst* inst = &dfa->code[dfa->codeCount];
+  inst->type = type;
+  inst->x = x;
+  inst->y = y;
+  return dfa->codeCount++;
+}
+
+static bool compileNode(Dfa* dfa, Node* nodes, int index, bool reversed);
+
+// Compiles a list of children from the last to the first
+static bool compileReversed(Dfa* dfa, Node* nodes, int first, bool reversed) {
+  int count = 0;
+  for (int child = first; child != -1; child = nodes[child].next) count++;
+  int* children = ALLOCATE(int, count);
+  int i = count;
+  for (int child = first; child != -1; child = nodes[child].next) children[--i] = child;
+
+  bool compiled = true;
+  for (i = 0; i < count && compiled; i++) {
+    compiled = compileNode(dfa, nodes, children[i], reversed);
+  }
+  FREE_ARRAY(int, children, count);
+  return compiled;
+}
+
+// Compiles up to count optional repetitions of a node, nested so that
+// each one can skip to the end
+static bool compileOptional(Dfa* dfa, Node* nodes, int index, int count, bool reversed) {
+  if (count == 0) return true;
+
+  int split = emit(dfa, INST_SPLIT, 0, 0);
+  if (split < 0) return false;
+  dfa->code[split].x = dfa->codeCount;
+  if (!compileNode(dfa, nodes, index, reversed) ||
+      !compileOptional(dfa, nodes, index, count - 1, reversed)) {
+    return false;
+  }
+  dfa->code[split].y = dfa->codeCount;
+  return true;
+}
+
+// Compiles a node into the program of the DFA, backwards if reversed is
+// set, and returns false if the program gets too large
+static bool compileNode(Dfa* dfa, Node* nodes, int index, bool reversed) {
+  Node* node = &nodes[index];
+  switch (node->type) {
+    case NODE_SET:
+      return emit(dfa, INST_SET, node->set, 0) >= 0;
+    case NODE_START:
+      return emit(dfa, reversed ? INST_SCAN_END : INST_SCAN_START, 0, 0) >= 0;
+    case NODE_END:
+      return emit(dfa, reversed ? INST_SCAN_START : INST_SCAN_END, 0, 0) >= 0;
+    case NODE_CONCAT:
+      if (!reversed) {
+        for (int child = node->first; child != -1; child = nodes[child].next) {
+          if (!compileNode(dfa, nodes, child, reversed)) return false;
+        }
+        return true;
+      }
+      return compileReversed(dfa, nodes, node->first, reversed);
+    case NODE_ALTERNATE: {
+      // Every alternative but the last is preceded by a split that skips
+      // it, and followed by a jump to the end. The jumps are chained
+      // through their targets until the end is known.
+      int jumps = -1;
+      for (int child = node->first; child != -1; child = nodes[child].next) {
+        int split = -1;
+        if (nodes[child].next != -1) {
+          split = emit(dfa, INST_SPLIT, 0, 0);
+          if (split < 0) return false;
+          dfa->code[split].x = dfa->codeCount;
+        }
+
+        if (!compileNode(dfa, nodes, child, reversed)) return false;
+        if (split == -1) break;
+
+        int jump = emit(dfa, INST_JUMP, jumps, 0);
+        if (jump < 0) return false;
+        jumps = jump;
+        dfa->code[split].y = dfa->codeCount;
+      }
+
+      while (jumps != -1) {
+        int previous = dfa->code[jumps].x;
+        dfa->code[jumps].x = dfa->codeCount;
+        jumps = previous;
+      }
+      return true;
+    }
+    case NODE_REPEAT: {
+      // The required repetitions are copies of the node
+      for (int i = 0; i < node->min; i++) {
+        if (!compileNode(dfa, nodes, node->first, reversed)) return false;
+      }
+
+      if (node->max == -1) {
+        int split = emit(dfa, INST_SPLIT, 0, 0);
+        if (split < 0) return false;
+        dfa->code[split].x = dfa->codeCount;
+        if (!compileNode(dfa, nodes, node->first, reversed)) return false;
+        if (emit(dfa, INST_JUMP, split, 0) < 0) return false;
+        dfa->code[split].y = dfa->codeCount;
+        return true;
+      }
+
+      return compileOptional(dfa, nodes, node->first, node->max - node->min, reversed);
+    }
+  }
+  return false;
+}
+
+static void initDfa(Dfa* dfa) {
+  dfa->code = NULL;
+  dfa->codeCount = 0;
+  dfa->codeCapacity = 0;
+  dfa->states = NULL;
+  dfa->stateCount = 0;
+  dfa->stateCapacity = 0;
+  dfa->buckets = NULL;
+  dfa->bucketCapacity = 0;
+  dfa->starts[0] = -1;
+  dfa->starts[1] = -1;
+  dfa->flushes = 0;
+  dfa->stack = NULL;
+  dfa->set = NULL;
+  dfa->setCount = 0;
+  dfa->marks = NULL;
+  dfa->generation = 0;
+}
+
+static void freeStates(Dfa* dfa) {
+  for (int i = 0; i < dfa->stateCount; i++) {
+    FREE_ARRAY(int, dfa->states[i].insts, dfa->states[i].instCount);
+  }
+  dfa->stateCount = 0;
+}
+
+static void freeDfa(Dfa* dfa) {
+  freeStates(dfa);
+  FREE_ARRAY(DfaState, dfa->states, dfa->stateCapacity);
+  FREE_ARRAY(int, dfa->buckets, dfa->bucketCapacity);
+  FREE_ARRAY(Inst, dfa->code, dfa->codeCapacity);
+  FREE_ARRAY(int, dfa->stack, dfa->codeCount);
+  FREE_ARRAY(int, dfa->set, dfa->codeCount);
+  FREE_ARRAY(uint32_t, dfa->marks, dfa->codeCount);
+}
+
+void freeRegexProgram(RegexProgram* program) {
+  freeDfa(&program->forward);
+  freeDfa(&program->reverse);
+  FREE_ARRAY(ByteSet, program->sets, program->setCapacity);
+  FREE(RegexProgram, program);
+}
+
+// Adds the instructions reachable from pc without consuming a byte to
+// the set that is being built
+static void addClosure(Dfa* dfa, int pc, bool atStart) {
+  int top = 0;
+  if (dfa->marks[pc] == dfa->generation) return;
+  dfa->marks[pc] = dfa->generation;
+  dfa->stack[top++] = pc;
+
+  while (top > 0) {
+    pc = dfa->stack[--top];
+    Inst* inst = &dfa->code[pc];
+    int targets[2];
+    int targetCount = 0;
+
+    switch (inst->type) {
+      case INST_SET:
+      case INST_SCAN_END:
+      case INST_MATCH:
+        dfa->set[dfa->setCount++] = pc;
+        break;
+      case INST_SPLIT:
+        targets[targetCount++] = inst->x;
+        targets[targetCount++] = inst->y;
+        break;
+      case INST_JUMP:
+        targets[targetCount++] = inst->x;
+        break;
+      case INST_SCAN_START:
+        if (atStart) targets[targetCount++] = pc + 1;
+        break;
+    }
+
+    for (int i = 0; i < targetCount; i++) {
+      if (dfa->marks[targets[i]] == dfa->generation) continue;
+      dfa->marks[targets[i]] = dfa->generation;
+      dfa->stack[top++] = targets[i];
+    }
+  }
+}
+
+// Whether the instructions reach a match once the scan is over, i.e.
+// when INST_SCAN_END holds as well
+static bool matchesAtEnd(Dfa* dfa, const int* insts, int count, bool atStart) {
+  dfa->generation++;
+  int top = 0;
+  for (int i = 0; i < count; i++) {
+    dfa->marks[insts[i]] = dfa->generation;
+    dfa->stack[top++] = insts[i];
+  }
+
+  while (top > 0) {
+    int pc = dfa->stack[--top];
+    Inst* inst = &dfa->code[pc];
+    int targets[2];
+    int targetCount = 0;
+
+    switch (inst->type) {
+      case INST_MATCH:
+        return true;
+      case INST_SET:
+        break;
+      case INST_SPLIT:
+        targets[targetCount++] = inst->x;
+        targets[targetCount++] = inst->y;
+        break;
+      case INST_JUMP:
+        targets[targetCount++] = inst->x;
+        break;
+      case INST_SCAN_START:
+        if (atStart) targets[targetCount++] = pc + 1;
+        break;
+      case INST_SCAN_END:
+        targets[targetCount++] = pc + 1;
+        break;
+    }
+
+    for (int i = 0; i < targetCount; i++) {
+      if (dfa->marks[targets[i]] == dfa->generation) continue;
+      dfa->marks[targets[i]] = dfa->generation;
+      dfa->stack[top++] = targets[i];
+    }
+  }
+  return false;
+}
+
+static int compareInts(const void* a, const void* b) {
+  int left = *(const int*)a;
+  int right = *(const int*)b;
+  return (left > right) - (left < right);
+}
+
+static uint32_t hashSet(const int* insts, int count, bool atStart) {
+  uint32_t hash = atStart ? 2166136261u : 16777619u;
+  for (int i = 0; i < count; i++) {
+    hash = (hash ^ (uint32_t)insts[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void insertBucket(Dfa* dfa, int index) {
+  uint32_t bucket = dfa->states[index].hash & (dfa->bucketCapacity - 1);
+  while (dfa->buckets[bucket] != -1) {
+    bucket = (bucket + 1) & (dfa->bucketCapacity - 1);
+  }
+  dfa->buckets[bucket] = index;
+}
+
+static void clearBuckets(Dfa* dfa) {
+  for (int i = 0; i < dfa->bucketCapacity; i++) {
+    dfa->buckets[i] = -1;
+  }
+}
+
+static int addState(Dfa* dfa, const int* insts, int count, bool atStart, uint32_t hash) {
+  if (dfa->stateCapacity < dfa->stateCount + 1) {
+    int oldCapacity = dfa->stateCapacity;
+    dfa->stateCapacity = GROW_CAPACITY(oldCapacity);
+    dfa->states = GROW_ARRAY(DfaState, dfa->states, oldCapacity, dfa->stateCapacity);
+  }
+
+  // Keep the table at most half full
+  if (dfa->bucketCapacity < (dfa->stateCount + 1) * 2) {
+    int oldCapacity = dfa->bucketCapacity;
+    dfa->bucketCapacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+    dfa->buckets = GROW_ARRAY(int, dfa->buckets, oldCapacity, dfa->bucketCapacity);
+    clearBuckets(dfa);
+    for (int i = 0; i < dfa->stateCount; i++) {
+      insertBucket(dfa, i);
+    }
+  }
+
+  int* copy = ALLOCATE(int, count);
+  if (count > 0) memcpy(copy, insts, sizeof(int) * count);
+
+  int index = dfa->stateCount++;
+  DfaState* state = &dfa->states[index];
+  state->insts = copy;
+  state->instCount = count;
+  state->hash = hash;
+  state->atStart = atStart;
+  state->matching = false;
+  for (int i = 0; i < count; i++) {
+    if (dfa->code[insts[i]].type == INST_MATCH) state->matching = true;
+  }
+  state->matchingAtEnd = state->matching || matchesAtEnd(dfa, insts, count, atStart);
+  for (int i = 0; i < 256; i++) {
+    state->next[i] = index == DEAD_STATE ? DEAD_STATE : -1;
+  }
+
+  insertBucket(dfa, index);
+  return index;
+}
+
+// Throws away all states but the dead one
+static void flushStates(Dfa* dfa) {
+  freeStates(dfa);
+  clearBuckets(dfa);
+  dfa->starts[0] = -1;
+  dfa->starts[1] = -1;
+  dfa->flushes++;
+  addState(dfa, NULL, 0, false, hashSet(NULL, 0, false));
+}
+
+// Returns the state for the set that was just built, adding it if it is
+// not there yet
+static int internState(Dfa* dfa, bool atStart) {
+  int* insts = dfa->set;
+  int count = dfa->setCount;
+  // Without anything to wait for at the start, the flag makes no
+  // difference and would only make for duplicate states
+  if (count == 0) atStart = false;
+  qsort(insts, count, sizeof(int), compareInts);
+  uint32_t hash = hashSet(insts, count, atStart);
+
+  uint32_t bucket = hash & (dfa->bucketCapacity - 1);
+  for (;;) {
+    int index = dfa->buckets[bucket];
+    if (index == -1) break;
+    DfaState* state = &dfa->states[index];
+    if (state->hash == hash && state->instCount == count && state->atStart == atStart &&
+        (count == 0 || memcmp(state->insts, insts, sizeof(int) * count) == 0)) {
+      return index;
+    }
+    bucket = (bucket + 1) & (dfa->bucketCapacity - 1);
+  }
+
+  if (dfa->stateCount == MAX_DFA_STATES) flushStates(dfa);
+  return addState(dfa, insts, count, atStart, hash);
+}
+
+static int startState(Dfa* dfa, bool atStart) {
+  if (dfa->starts[atStart] < 0) {
+    dfa->generation++;
+    dfa->setCount = 0;
+    addClosure(dfa, 0, atStart);
+    int index = internState(dfa, atStart);
+    dfa->starts[atStart] = index;
+  }
+  return dfa->starts[atStart];
+}
+
+static int nextState(Dfa* dfa, const ByteSet* sets, int index, uint8_t byte) {
+  int next = dfa->states[index].next[byte];
+  if (next >= 0) return next;
+
+  dfa->generation++;
+  dfa->setCount = 0;
+  DfaState* state = &dfa->states[index];
+  for (int i = 0; i < state->instCount; i++) {
+    Inst* inst = &dfa->code[state->insts[i]];
+    if (inst->type == INST_SET && setHas(&sets[inst->x], byte)) {
+      addClosure(dfa, state->insts[i] + 1, false);
+    }
+  }
+
+  int flushes = dfa->flushes;
+  next = internState(dfa, false);
+  // The state might have been thrown away to make room
+  if (dfa->flushes == flushes) dfa->states[index].next[byte] = next;
+  return next;
+}
+
+// Makes the DFA ready to build states, once its program is complete
+static void finishDfa(Dfa* dfa) {
+  dfa->stack = ALLOCATE(int, dfa->codeCount);
+  dfa->set = ALLOCATE(int, dfa->codeCount);
+  dfa->marks = ALLOCATE(uint32_t, dfa->codeCount);
+  for (int i = 0; i < dfa->codeCount; i++) {
+    dfa->marks[i] = 0;
+  }
+  addState(dfa, NULL, 0, false, hashSet(NULL, 0, false));
+}
+
+// Returns the compiled program, or NULL if the pattern is invalid
+static RegexProgram* compilePattern(ObjString* pattern) {
+  PatternParser parser;
+  parser.start = pattern->chars;
+  parser.current = pattern->chars;
+  parser.end = pattern->chars + pattern->length;
+  parser.nodes = NULL;
+  parser.nodeCount = 0;
+  parser.nodeCapacity = 0;
+  parser.sets = NULL;
+  parser.setCount = 0;
+  parser.setCapacity = 0;
+  parser.depth = 0;
+  parser.failed = false;
+
+  int root = parseAlternation(&parser);
+  // Only a stray ) can stop the parser early
+  if (!parser.failed && !isAtEnd(&parser)) patternError(&parser, "Unmatched ')'");
+
+  // Any byte at all, for the reversed pattern to skip what comes after
+  // the match
+  ByteSet any;
+  memset(&any, 0, sizeof(any));
+  setInvert(&any);
+  int anySet = parser.failed ? -1 : addSet(&parser, &any);
+
+  RegexProgram* program = NULL;
+  if (!parser.failed) {
+    program = ALLOCATE(RegexProgram, 1);
+    program->sets = parser.sets;
+    program->setCapacity = parser.setCapacity;
+    parser.sets = NULL;
+    parser.setCapacity = 0;
+    initDfa(&program->forward);
+    initDfa(&program->reverse);
+
+    Dfa* forward = &program->forward;
+    Dfa* reverse = &program->reverse;
+    // The reversed pattern is unanchored, i.e. starts with an implicit
+    // loop over any bytes
+    bool compiled = compileNode(forward, parser.nodes, root, false) &&
+                    emit(forward, INST_MATCH, 0, 0) >= 0 &&
+                    emit(reverse, INST_SPLIT, 3, 1) >= 0 &&
+                    emit(reverse, INST_SET, anySet, 0) >= 0 &&
+                    emit(reverse, INST_JUMP, 0, 0) >= 0 &&
+                    compileNode(reverse, parser.nodes, root, true) &&
+                    emit(reverse, INST_MATCH, 0, 0) >= 0;
+    if (compiled) {
+      finishDfa(forward);
+      finishDfa(reverse);
+    } else {
+      freeRegexProgram(program);
+      program = NULL;
+      nativeError("Regex is too large.");
+    }
+  }
+
+  FREE_ARRAY(Node, parser.nodes, parser.nodeCapacity);
+  FREE_ARRAY(ByteSet, parser.sets, parser.setCapacity);
+  return program;
+}
+
+// Returns the end of the longest match that starts at start, or -1
+static long longestMatch(RegexProgram* program, const uint8_t* text, size_t length,
+                         size_t start) {
+  Dfa* dfa = &program->forward;
+  int state = startState(dfa, start == 0);
+  long end = -1;
+
+  for (size_t i = start;; i++) {
+    DfaState* current = &dfa->states[state];
+    if (i == length) {
+      if (current->matchingAtEnd) end = (long)i;
+      break;
+    }
+    if (current->matching) end = (long)i;
+
+    state = nextState(dfa, program->sets, state, text[i]);
+    if (state == DEAD_STATE) break;
+  }
+  return end;
+}
+
+// Scans the text backwards down to from, and returns the first position
+// at which a match starts, or -1. If starts is not NULL, it is set for
+// every position from there on that a match starts at.
+static long findStarts(RegexProgram* program, const uint8_t* text, size_t length,
+                       size_t from, bool* starts) {
+  Dfa* dfa = &program->reverse;
+  // Scans always start at the end of the input
+  int state = startState(dfa, true);
+  long first = -1;
+
+  for (size_t i = length;; i--) {
+    DfaState* current = &dfa->states[state];
+    bool matching = i == 0 ? current->matchingAtEnd : current->matching;
+    if (matching) first = (long)i;
+    if (starts != NULL) starts[i - from] = matching;
+
+    if (i == from) break;
+    state = nextState(dfa, program->sets, state, text[i - 1]);
+  }
+  return first;
+}
+
+// Calls found for each leftmost-longest match in the text that does not
+// overlap with the previous one, which returns false to stop early
+typedef bool (*MatchFn)(size_t start, size_t end, void* context);
+
+static void forEachMatch(RegexProgram* program, ObjString* string, MatchFn found,
+                         void* context) {
+  const uint8_t* text = (const uint8_t*)string->chars;
+  size_t length = string->length;
+
+  bool* starts = ALLOCATE(bool, length + 1);
+  findStarts(program, text, length, 0, starts);
+
+  size_t position = 0;
+  while (position <= length) {
+    while (position <= length && !starts[position]) position++;
+    if (position > length) break;
+
+    long end = longestMatch(program, text, length, position);
+    if (!found(position, (size_t)end, context)) break;
+    // Empty matches don't advance by themselves
+    position = (size_t)end > position ? (size_t)end : position + 1;
+  }
+
+  FREE_ARRAY(bool, starts, length + 1);
+}
+
+// Returns the compiled regex for a regex or a pattern string, or NULL
+// after reporting an error
+static ObjRegex* toRegex(Value value) {
+  if (IS_REGEX(value)) return AS_REGEX(value);
+  if (!IS_STRING(value)) {
+    nativeError("Pattern must be a regex or a string.");
+    return NULL;
+  }
+
+  ObjString* pattern = AS_STRING(value);
+  Value cached;
+  if (tableGet(&regexCache, pattern, &cached)) return AS_REGEX(cached);
+
+  RegexProgram* program = compilePattern(pattern);
+  if (program == NULL) return NULL;
+  ObjRegex* regex = newRegex(pattern, program);
+
+  push(OBJ_VAL(regex));
+  if (regexCache.count >= REGEX_CACHE_SIZE) freeTable(&regexCache);
+  tableSet(&regexCache, pattern, OBJ_VAL(regex));
+  pop();
+  return regex;
+}
+
+static bool checkString(Value value) {
+  if (!IS_STRING(value)) {
+    nativeError("Text must be a string.");
+    return false;
+  }
+  return true;
+}
+
+// regex(pattern) compiles a pattern, which the other natives also do
+// when they are given a pattern string
+static Value regexNative(int argCount, Value* args) {
+  ObjRegex* regex = toRegex(args[0]);
+  return regex == NULL ? NIL_VAL : OBJ_VAL(regex);
+}
+
+// regexMatch(regex, text) returns whether the whole text matches
+static Value regexMatchNative(int argCount, Value* args) {
+  ObjRegex* regex = toRegex(args[0]);
+  if (regex == NULL || !checkString(args[1])) return NIL_VAL;
+  ObjString* text = AS_STRING(args[1]);
+
+  long end = longestMatch(regex->program, (const uint8_t*)text->chars, text->length, 0);
+  return BOOL_VAL(end == text->length);
+}
+
+// regexSearch(regex, text) returns a list of the start and end of the
+// first match, or nil
+static Value regexSearchNative(int argCount, Value* args) {
+  ObjRegex* regex = toRegex(args[0]);
+  if (regex == NULL || !checkString(args[1])) return NIL_VAL;
+  ObjString* text = AS_STRING(args[1]);
+  const uint8_t* chars = (const uint8_t*)text->chars;
+
+  long start = findStarts(regex->program, chars, text->length, 0, NULL);
+  if (start < 0) return NIL_VAL;
+  long end = longestMatch(regex->program, chars, text->length, (size_t)start);
+
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+  writeValueArray(&list->items, NUMBER_VAL((double)start));
+  writeValueArray(&list->items, NUMBER_VAL((double)end));
+  pop();
+  return OBJ_VAL(list);
+}
+
+typedef struct {
+  ObjString* text;
+  ObjList* list;
+} FindAllContext;
+
+static bool addMatch(size_t start, size_t end, void* context) {
+  FindAllContext* findAll = (FindAllContext*)context;
+  Value match = OBJ_VAL(copyString(findAll->text->chars + start, (int)(end - start)));
+  push(match);
+  writeValueArray(&findAll->list->items, match);
+  pop();
+  return true;
+}
+
+// regexFindAll(regex, text) returns a list of the text of every match
+static Value regexFindAllNative(int argCount, Value* args) {
+  ObjRegex* regex = toRegex(args[0]);
+  if (regex == NULL || !checkString(args[1])) return NIL_VAL;
+
+  FindAllContext context = { AS_STRING(args[1]), newList() };
+  push(OBJ_VAL(context.list));
+  forEachMatch(regex->program, context.text, addMatch, &context);
+  pop();
+  return OBJ_VAL(context.list);
+}
+
+typedef struct {
+  ObjString* text;
+  ObjString* replacement;
+  // Characters of the result so far, and how far the text has been
+  // copied into them
+  ByteArray result;
+  size_t copied;
+} ReplaceContext;
+
+static bool replaceMatch(size_t start, size_t end, void* context) {
+  ReplaceContext* replace = (ReplaceContext*)context;
+  writeByteArray(&replace->result, replace->text->chars + replace->copied,
+                 (int)(start - replace->copied));
+  writeByteArray(&replace->result, replace->replacement->chars, replace->replacement->length);
+  replace->copied = end;
+  return true;
+}
+
+// regexReplace(regex, text, replacement) returns the text with every
+// match replaced by the replacement
+static Value regexReplaceNative(int argCount, Value* args) {
+  ObjRegex* regex = toRegex(args[0]);
+  if (regex == NULL || !checkString(args[1])) return NIL_VAL;
+  if (!IS_STRING(args[2])) return nativeError("Replacement must be a string.");
+
+  ReplaceContext context = { AS_STRING(args[1]), AS_STRING(args[2]), {0, 0, NULL}, 0 };
+  forEachMatch(regex->program, context.text, replaceMatch, &context);
+  writeByteArray(&context.result, context.text->chars + context.copied,
+                 (int)(context.text->length - context.copied));
+
+  const char* chars = context.result.bytes == NULL ? "" : (const char*)context.result.bytes;
+  ObjString* result = copyString(chars, context.result.count);
+  freeByteArray(&context.result);
+  return OBJ_VAL(result);
+}
+
+void defineRegexNatives() {
+  SET_TABLE_ROLE(&regexCache, TABLE_REGEXES);
+  defineNative("regex", regexNative, 1);
+  defineNative("regexMatch", regexMatchNative, 2);
+  defineNative("regexSearch", regexSearchNative, 2);
+  defineNative("regexFindAll", regexFindAllNative, 2);
+  defineNative("regexReplace", regexReplaceNative, 3);
+}
+
+void markRegexRoots() {
+  markTable(&regexCache);
+}
+
+void freeRegexCache() {
+  freeTable(&regexCache);
+}
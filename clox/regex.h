@@ -0,0 +1,15 @@
+#ifndef clox_regex_h
+#define clox_regex_h
+
+#include "object.h"
+
+void freeRegexProgram(RegexProgram* program);
+
+// Registers regex() along with the natives that match, search, find and
+// replace with a regex or a pattern string
+void defineRegexNatives();
+// Regexes compiled from pattern strings are cached by their pattern
+void markRegexRoots();
+void freeRegexCache();
+
+#endif
@@ -16,15 +16,20 @@ typedef struct {
   int line;
 } Scanner;
 
-// We create another global variable for the scanner to avoid having to pass an instance around everywhere
-Scanner scanner;
+// We create another global variable for the scanner to avoid having to pass an instance around everywhere.
+// Every thread gets its own so that functions can be compiled in parallel
+_Thread_local Scanner scanner;
 
 // We initiate the start and current char pointer to the
 // beginning of the source string and set current line to 1
 void initScanner(const char* source) {
+  initScannerAt(source, 1);
+}
+
+void initScannerAt(const char* source, int line) {
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
 }
 
 static bool isAlpha(char c) {
@@ -140,7 +145,14 @@ static TokenType checkKeyword(int start, int length, const char* rest, TokenType
 static TokenType identifierType() {
   switch (scanner.start[0]) {
     case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+    case 'c':
+      if (scanner.current - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'a': return checkKeyword(2, 3, "tch", TOKEN_CATCH);
+          case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+        }
+      }
+      break;
     case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
     case 'f':
       // First check if there is indeed more than one char
@@ -156,14 +168,31 @@ static TokenType identifierType() {
     case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
     case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
     case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+    case 'r':
+      if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e') {
+        switch (scanner.start[2]) {
+          case 'c': return checkKeyword(3, 3, "ord", TOKEN_RECORD);
+          case 't': return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+        }
+      }
+      break;
     case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
     case 't':
       // Check for existence of more than one char
-      if (scanner.current - scanner.start > 1) {
+      if (scanner.current - scanner.start > 2) {
         switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+          case 'h':
+            switch (scanner.start[2]) {
+              case 'i': return checkKeyword(3, 1, "s", TOKEN_THIS);
+              case 'r': return checkKeyword(3, 2, "ow", TOKEN_THROW);
+            }
+            break;
+          case 'r':
+            switch (scanner.start[2]) {
+              case 'u': return checkKeyword(3, 1, "e", TOKEN_TRUE);
+              case 'y': return checkKeyword(3, 0, "", TOKEN_TRY);
+            }
+            break;
         }
       }
       break;
@@ -0,0 +1,668 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "persistent.h"
+#include "serialize.h"
+#include "vm.h"
+
+// Leads every serialized value, the last character is the version of
+// the format
+#define SERIALIZE_MAGIC "LOXV2"
+#define SERIALIZE_MAGIC_LENGTH 5
+
+// Limits how far writeValue() and readValue() call themselves for
+// vectors, hash maps and records nested inside each other
+#define MAX_DEPTH 10000
+
+// Every value starts with a tag. Objects are numbered in the order in
+// which they first appear, and later appearances of the same object are
+// written as a reference to its number, which preserves both sharing
+// and cycles.
+//
+// Vectors, hash maps and records can only be created once what they
+// hold has been read, as they are hashed by value, so they get their
+// number after it. Lists and instances get theirs right away and are
+// filled in after the whole value, in the order of their numbers. Any
+// cycle has to go through one of them, so a vector, hash map or record
+// never holds something that is not complete yet.
+typedef enum {
+  TAG_NIL,
+  TAG_FALSE,
+  TAG_TRUE,
+  // Numbers that are integers are stored as a zigzag varint, all
+  // others as the 8 bytes of the double
+  TAG_INTEGER,
+  TAG_NUMBER,
+  TAG_STRING,
+  TAG_REFERENCE,
+  TAG_LIST,
+  TAG_VECTOR,
+  TAG_HASH_MAP,
+  // Instances and records refer to their class or record type by name,
+  // which has to be a global of that kind when deserializing
+  TAG_INSTANCE,
+  TAG_RECORD,
+} Tag;
+
+typedef struct {
+  Obj* object;
+  int number;
+} SeenEntry;
+
+typedef struct {
+  ByteArray output;
+
+  // Numbers of the objects written so far, by identity
+  SeenEntry* seen;
+  int seenCount;
+  int seenCapacity;
+  // The same objects in the order of their numbers
+  Obj** objects;
+  int objectCapacity;
+
+  int depth;
+  // Set once a value turns out not to be serializable, after the error
+  // has been reported
+  bool failed;
+} Writer;
+
+typedef struct {
+  const uint8_t* current;
+  const uint8_t* end;
+  // Objects read so far by their number, a list on the stack so that
+  // the GC sees them
+  ObjList* objects;
+  // Vectors and hash maps that are still being read, which have no
+  // number yet
+  ObjList* unfinished;
+  int depth;
+  // Set once the data turns out to be malformed (or refers to a class
+  // that does not exist), after the error has been reported
+  bool failed;
+} Reader;
+
+static void writeBytes(Writer* writer, const void* bytes, int length) {
+  writeByteArray(&writer->output, bytes, length);
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+  writeBytes(writer, &byte, 1);
+}
+
+// Seven bits at a time, least significant first
+static void writeVarint(Writer* writer, uint64_t value) {
+  while (value >= 0x80) {
+    writeByte(writer, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  writeByte(writer, (uint8_t)value);
+}
+
+// Unlike bundles, serialized values may be read on other machines, so
+// doubles are always stored little-endian
+static void writeDouble(Writer* writer, double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  for (int i = 0; i < 8; i++) {
+    writeByte(writer, (uint8_t)(bits >> (8 * i)));
+  }
+}
+
+static SeenEntry* findSeen(SeenEntry* entries, int capacity, Obj* object) {
+  uint32_t index = hashAddress(object) & (capacity - 1);
+  for (;;) {
+    SeenEntry* entry = &entries[index];
+    if (entry->object == object || entry->object == NULL) return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+// Returns the number of an object that was written before, or -1
+static int seenNumber(Writer* writer, Obj* object) {
+  if (writer->seenCount == 0) return -1;
+  SeenEntry* entry = findSeen(writer->seen, writer->seenCapacity, object);
+  return entry->object == NULL ? -1 : entry->number;
+}
+
+// Gives the object the next number
+static void addSeen(Writer* writer, Obj* object) {
+  if (writer->seenCount + 1 > writer->seenCapacity * 0.75) {
+    int capacity = GROW_CAPACITY(writer->seenCapacity);
+    SeenEntry* entries = ALLOCATE(SeenEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+      entries[i].object = NULL;
+    }
+
+    for (int i = 0; i < writer->seenCapacity; i++) {
+      SeenEntry* entry = &writer->seen[i];
+      if (entry->object == NULL) continue;
+      *findSeen(entries, capacity, entry->object) = *entry;
+    }
+
+    FREE_ARRAY(SeenEntry, writer->seen, writer->seenCapacity);
+    writer->seen = entries;
+    writer->seenCapacity = capacity;
+  }
+
+  if (writer->seenCount + 1 > writer->objectCapacity) {
+    int oldCapacity = writer->objectCapacity;
+    writer->objectCapacity = GROW_CAPACITY(oldCapacity);
+    writer->objects = GROW_ARRAY(Obj*, writer->objects, oldCapacity, writer->objectCapacity);
+  }
+  writer->objects[writer->seenCount] = object;
+
+  SeenEntry* entry = findSeen(writer->seen, writer->seenCapacity, object);
+  entry->object = object;
+  entry->number = writer->seenCount++;
+}
+
+static void writeValue(Writer* writer, Value value);
+
+static void writeString(Writer* writer, ObjString* string) {
+  writeByte(writer, TAG_STRING);
+  writeVarint(writer, string->length);
+  writeBytes(writer, string->chars, string->length);
+}
+
+static void writeNode(Writer* writer, ObjTrieNode* node) {
+  for (int i = 0; i < node->count && !writer->failed; i += 2) {
+    if (IS_TRIE_NODE(node->slots[i])) {
+      writeNode(writer, AS_TRIE_NODE(node->slots[i]));
+    } else {
+      writeValue(writer, node->slots[i]);
+      writeValue(writer, node->slots[i + 1]);
+    }
+  }
+}
+
+static void writeInstance(Writer* writer, ObjInstance* instance) {
+  Table* fields = &instance->fields;
+  int fieldCount = 0;
+  for (int i = 0; i < fields->capacity; i++) {
+    if (fields->entries[i].key != NULL_REF) fieldCount++;
+  }
+
+  writeVarint(writer, fieldCount);
+  for (int i = 0; i < fields->capacity && !writer->failed; i++) {
+    Entry* entry = &fields->entries[i];
+    if (entry->key == NULL_REF) continue;
+    writeValue(writer, OBJ_VAL(REF_PTR(ObjString, entry->key)));
+    writeValue(writer, entryValue(entry));
+  }
+}
+
+static void writeObject(Writer* writer, Obj* object) {
+  int number = seenNumber(writer, object);
+  if (number >= 0) {
+    writeByte(writer, TAG_REFERENCE);
+    writeVarint(writer, number);
+    return;
+  }
+
+  switch (object->type) {
+    case OBJ_STRING:
+      writeString(writer, (ObjString*)object);
+      break;
+    // What lists and instances hold is written by writeContents()
+    case OBJ_LIST:
+      writeByte(writer, TAG_LIST);
+      break;
+    case OBJ_INSTANCE:
+      writeByte(writer, TAG_INSTANCE);
+      writeObject(writer, REF_PTR(Obj,
+          REF_PTR(ObjClass, ((ObjInstance*)object)->klass)->name));
+      break;
+    case OBJ_VECTOR: {
+      ObjVector* vector = (ObjVector*)object;
+      writeByte(writer, TAG_VECTOR);
+      writeVarint(writer, vector->count);
+      for (int i = 0; i < vector->count && !writer->failed; i++) {
+        writeValue(writer, vectorGet(vector, i));
+      }
+      break;
+    }
+    case OBJ_HASH_MAP: {
+      ObjHashMap* map = (ObjHashMap*)object;
+      writeByte(writer, TAG_HASH_MAP);
+      writeVarint(writer, map->count);
+      if (map->root != NULL_REF) writeNode(writer, REF_PTR(ObjTrieNode, map->root));
+      break;
+    }
+    case OBJ_RECORD: {
+      ObjRecord* record = (ObjRecord*)object;
+      writeByte(writer, TAG_RECORD);
+      writeObject(writer, REF_PTR(Obj, REF_PTR(ObjRecordType, record->type)->name));
+      writeVarint(writer, record->fieldCount);
+      for (int i = 0; i < record->fieldCount && !writer->failed; i++) {
+        writeValue(writer, record->fields[i]);
+      }
+      break;
+    }
+    default:
+      nativeError("Can only serialize nil, booleans, numbers, strings, "
+                  "lists, vectors, hash maps, instances and records.");
+      writer->failed = true;
+      return;
+  }
+
+  addSeen(writer, object);
+}
+
+// Writes the items of the lists and the fields of the instances, which
+// may number more of them as it goes
+static void writeContents(Writer* writer) {
+  for (int i = 0; i < writer->seenCount && !writer->failed; i++) {
+    Obj* object = writer->objects[i];
+    if (object->type == OBJ_LIST) {
+      ObjList* list = (ObjList*)object;
+      writeVarint(writer, list->items.count);
+      for (int j = 0; j < list->items.count && !writer->failed; j++) {
+        writeValue(writer, list->items.values[j]);
+      }
+    } else if (object->type == OBJ_INSTANCE) {
+      writeInstance(writer, (ObjInstance*)object);
+    }
+  }
+}
+
+static void writeValue(Writer* writer, Value value) {
+  if (writer->failed) return;
+  if (++writer->depth > MAX_DEPTH) {
+    nativeError("Value is nested too deeply to serialize.");
+    writer->failed = true;
+    return;
+  }
+
+  if (IS_NIL(value)) {
+    writeByte(writer, TAG_NIL);
+  } else if (IS_BOOL(value)) {
+    writeByte(writer, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    // -0 has to keep its sign, so it is not an integer here
+    if (number >= -2147483648.0 && number <= 2147483647.0 &&
+        number == (int32_t)number && !(number == 0 && 1 / number < 0)) {
+      int64_t integer = (int32_t)number;
+      writeByte(writer, TAG_INTEGER);
+      writeVarint(writer, ((uint64_t)integer << 1) ^ (uint64_t)(integer >> 63));
+    } else {
+      writeByte(writer, TAG_NUMBER);
+      writeDouble(writer, number);
+    }
+  } else {
+    writeObject(writer, AS_OBJ(value));
+  }
+
+  writer->depth--;
+}
+
+// Returns the serialized value as a string, or NULL if it failed
+static ObjString* serialize(Value value) {
+  Writer writer = { {0, 0, NULL}, NULL, 0, 0, NULL, 0, 0, false };
+  writeBytes(&writer, SERIALIZE_MAGIC, SERIALIZE_MAGIC_LENGTH);
+  writeValue(&writer, value);
+  writeContents(&writer);
+  FREE_ARRAY(SeenEntry, writer.seen, writer.seenCapacity);
+  FREE_ARRAY(Obj*, writer.objects, writer.objectCapacity);
+
+  ObjString* result = NULL;
+  if (!writer.failed) {
+    result = copyString((const char*)writer.output.bytes, writer.output.count);
+  }
+  freeByteArray(&writer.output);
+  return result;
+}
+
+static void malformed(Reader* reader) {
+  if (!reader->failed) nativeError("Malformed serialized value.");
+  reader->failed = true;
+}
+
+static const uint8_t* readBytes(Reader* reader, uint64_t length) {
+  if (reader->failed || (uint64_t)(reader->end - reader->current) < length) {
+    malformed(reader);
+    return NULL;
+  }
+
+  const uint8_t* bytes = reader->current;
+  reader->current += length;
+  return bytes;
+}
+
+static uint8_t readByte(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint64_t readVarint(Reader* reader) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = readByte(reader);
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  malformed(reader);
+  return 0;
+}
+
+// Reads the number of items that follow, every item takes up at least
+// a byte so a count larger than what is left means the data is malformed
+static int readCount(Reader* reader) {
+  uint64_t count = readVarint(reader);
+  if (count > (uint64_t)(reader->end - reader->current)) {
+    malformed(reader);
+    return 0;
+  }
+  return (int)count;
+}
+
+static double readDouble(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 8);
+  if (bytes == NULL) return 0;
+
+  uint64_t bits = 0;
+  for (int i = 0; i < 8; i++) {
+    bits |= (uint64_t)bytes[i] << (8 * i);
+  }
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  return number;
+}
+
+// Gives the object the next number, which also keeps it alive
+static void addObject(Reader* reader, Obj* object) {
+  push(OBJ_VAL(object));
+  writeValueArray(&reader->objects->items, OBJ_VAL(object));
+  pop();
+}
+
+static Value readValue(Reader* reader);
+
+// Reads the name of a class or record type, which is either a string
+// or a reference to one, and returns the global of that name
+static bool readGlobal(Reader* reader, Value* global) {
+  Value name = readValue(reader);
+  if (reader->failed) return false;
+  if (!IS_STRING(name)) {
+    malformed(reader);
+    return false;
+  }
+
+  if (!tableGet(&vm.globals, AS_STRING(name), global)) {
+    nativeError("Undefined variable '%s'.", AS_CSTRING(name));
+    reader->failed = true;
+    return false;
+  }
+  return true;
+}
+
+static Value readInstance(Reader* reader) {
+  Value klass;
+  if (!readGlobal(reader, &klass)) return NIL_VAL;
+  if (!IS_CLASS(klass)) {
+    nativeError("Can't deserialize an instance of something that is not a class.");
+    reader->failed = true;
+    return NIL_VAL;
+  }
+
+  ObjInstance* instance = newInstance(AS_CLASS(klass));
+  addObject(reader, (Obj*)instance);
+  return OBJ_VAL(instance);
+}
+
+static Value readRecord(Reader* reader) {
+  Value type;
+  if (!readGlobal(reader, &type)) return NIL_VAL;
+  int fieldCount = readCount(reader);
+  if (reader->failed) return NIL_VAL;
+  if (!IS_RECORD_TYPE(type) || AS_RECORD_TYPE(type)->fieldCount != fieldCount) {
+    nativeError("Can't deserialize a record whose type does not match.");
+    reader->failed = true;
+    return NIL_VAL;
+  }
+
+  // The fields are objects that have been numbered, or no objects at
+  // all, so they are safe from the GC here
+  Value fields[UINT8_COUNT];
+  for (int i = 0; i < fieldCount && !reader->failed; i++) {
+    fields[i] = readValue(reader);
+  }
+  if (reader->failed) return NIL_VAL;
+
+  ObjRecord* record = newRecord(AS_RECORD_TYPE(type), fields);
+  addObject(reader, (Obj*)record);
+  return OBJ_VAL(record);
+}
+
+// Keeps a vector or hash map alive until it gets its number
+static void beginUnfinished(Reader* reader, Obj* collection) {
+  push(OBJ_VAL(collection));
+  writeValueArray(&reader->unfinished->items, OBJ_VAL(collection));
+  pop();
+  beginTransient(collection);
+}
+
+static void endUnfinished(Reader* reader, Obj* collection) {
+  endTransient(collection);
+  reader->unfinished->items.count--;
+  if (!reader->failed) addObject(reader, collection);
+}
+
+static Value readObject(Reader* reader, Tag tag) {
+  switch (tag) {
+    case TAG_STRING: {
+      // Straight from the input, which readValue() maps rather than
+      // reads when it comes from a file. Strings are interned, so this
+      // is the only copy that is made.
+      int length = readCount(reader);
+      const uint8_t* chars = readBytes(reader, length);
+      if (chars == NULL) return NIL_VAL;
+      ObjString* string = copyString((const char*)chars, length);
+      addObject(reader, (Obj*)string);
+      return OBJ_VAL(string);
+    }
+    case TAG_REFERENCE: {
+      uint64_t number = readVarint(reader);
+      if (number >= (uint64_t)reader->objects->items.count) {
+        malformed(reader);
+        return NIL_VAL;
+      }
+      return reader->objects->items.values[number];
+    }
+    // Filled in by readContents()
+    case TAG_LIST: {
+      ObjList* list = newList();
+      addObject(reader, (Obj*)list);
+      return OBJ_VAL(list);
+    }
+    case TAG_VECTOR: {
+      ObjVector* vector = newVector();
+      beginUnfinished(reader, (Obj*)vector);
+      int count = readCount(reader);
+      for (int i = 0; i < count && !reader->failed; i++) {
+        Value item = readValue(reader);
+        if (!reader->failed) transientAppend(vector, item);
+      }
+      endUnfinished(reader, (Obj*)vector);
+      return OBJ_VAL(vector);
+    }
+    case TAG_HASH_MAP: {
+      ObjHashMap* map = newHashMap();
+      beginUnfinished(reader, (Obj*)map);
+      int count = readCount(reader);
+      for (int i = 0; i < count && !reader->failed; i++) {
+        Value key = readValue(reader);
+        Value value = readValue(reader);
+        if (!reader->failed) transientSet(map, key, value);
+      }
+      endUnfinished(reader, (Obj*)map);
+      return OBJ_VAL(map);
+    }
+    case TAG_INSTANCE: return readInstance(reader);
+    case TAG_RECORD: return readRecord(reader);
+    default:
+      malformed(reader);
+      return NIL_VAL;
+  }
+}
+
+static Value readValue(Reader* reader) {
+  if (reader->failed) return NIL_VAL;
+  if (++reader->depth > MAX_DEPTH) {
+    malformed(reader);
+    return NIL_VAL;
+  }
+
+  Value value;
+  Tag tag = (Tag)readByte(reader);
+  switch (tag) {
+    case TAG_NIL: value = NIL_VAL; break;
+    case TAG_FALSE: value = BOOL_VAL(false); break;
+    case TAG_TRUE: value = BOOL_VAL(true); break;
+    case TAG_INTEGER: {
+      uint64_t zigzag = readVarint(reader);
+      int64_t integer = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+      value = NUMBER_VAL((double)integer);
+      break;
+    }
+    case TAG_NUMBER: value = NUMBER_VAL(readDouble(reader)); break;
+    default: value = readObject(reader, tag); break;
+  }
+
+  reader->depth--;
+  return value;
+}
+
+// Reads the items of the lists and the fields of the instances, which
+// may number more of them as it goes
+static void readContents(Reader* reader) {
+  for (int i = 0; i < reader->objects->items.count && !reader->failed; i++) {
+    Value object = reader->objects->items.values[i];
+    if (IS_LIST(object)) {
+      ObjList* list = AS_LIST(object);
+      int count = readCount(reader);
+      for (int j = 0; j < count && !reader->failed; j++) {
+        Value item = readValue(reader);
+        if (!reader->failed) writeValueArray(&list->items, item);
+      }
+    } else if (IS_INSTANCE(object)) {
+      ObjInstance* instance = AS_INSTANCE(object);
+      int fieldCount = readCount(reader);
+      for (int j = 0; j < fieldCount && !reader->failed; j++) {
+        Value name = readValue(reader);
+        Value value = readValue(reader);
+        if (reader->failed) break;
+        if (!IS_STRING(name)) {
+          malformed(reader);
+          break;
+        }
+        tableSet(&instance->fields, AS_STRING(name), value);
+      }
+    }
+  }
+}
+
+// Returns false (after reporting the error) if the bytes do not hold
+// exactly one serialized value
+static bool deserialize(const uint8_t* bytes, size_t length, Value* value) {
+  Reader reader = { bytes, bytes + length, NULL, NULL, 0, false };
+  if (length < SERIALIZE_MAGIC_LENGTH ||
+      memcmp(bytes, SERIALIZE_MAGIC, SERIALIZE_MAGIC_LENGTH) != 0) {
+    malformed(&reader);
+    return false;
+  }
+  reader.current += SERIALIZE_MAGIC_LENGTH;
+
+  reader.objects = newList();
+  push(OBJ_VAL(reader.objects));
+  reader.unfinished = newList();
+  push(OBJ_VAL(reader.unfinished));
+  *value = readValue(&reader);
+  readContents(&reader);
+  if (!reader.failed && reader.current != reader.end) malformed(&reader);
+  pop();
+  pop();
+  return !reader.failed;
+}
+
+// serialize(value) returns a string holding the value in binary
+static Value serializeNative(int argCount, Value* args) {
+  ObjString* string = serialize(args[0]);
+  return string == NULL ? NIL_VAL : OBJ_VAL(string);
+}
+
+static Value deserializeNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) {
+    return nativeError("Argument must be a string.");
+  }
+  ObjString* string = AS_STRING(args[0]);
+
+  Value value;
+  if (!deserialize((const uint8_t*)string->chars, string->length, &value)) {
+    return NIL_VAL;
+  }
+  return value;
+}
+
+// writeValue(path, value) serializes the value into a file
+static Value writeValueNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) {
+    return nativeError("Path must be a string.");
+  }
+
+  ObjString* string = serialize(args[1]);
+  if (string == NULL) return NIL_VAL;
+
+  FILE* file = fopen(AS_CSTRING(args[0]), "wb");
+  bool written = file != NULL &&
+                 fwrite(string->chars, 1, string->length, file) == (size_t)string->length;
+  if (file != NULL) written = fclose(file) == 0 && written;
+  if (!written) {
+    return nativeError("Could not write file \"%s\".", AS_CSTRING(args[0]));
+  }
+  return NIL_VAL;
+}
+
+// readValue(path) deserializes the value in a file, which is mapped
+// into memory rather than read
+static Value readValueNative(int argCount, Value* args) {
+  if (!IS_STRING(args[0])) {
+    return nativeError("Path must be a string.");
+  }
+  const char* path = AS_CSTRING(args[0]);
+
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    if (fd >= 0) close(fd);
+    return nativeError("Could not open file \"%s\".", path);
+  }
+
+  // Empty files can't be mapped, and are malformed anyway
+  void* data = info.st_size > 0
+      ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+      : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    if (info.st_size == 0) return nativeError("Malformed serialized value.");
+    return nativeError("Could not read file \"%s\".", path);
+  }
+
+  Value value;
+  bool read = deserialize((const uint8_t*)data, info.st_size, &value);
+  munmap(data, info.st_size);
+  return read ? value : NIL_VAL;
+}
+
+void defineSerializeNatives() {
+  defineNative("serialize", serializeNative, 1);
+  defineNative("deserialize", deserializeNative, 1);
+  defineNative("writeValue", writeValueNative, 2);
+  defineNative("readValue", readValueNative, 1);
+}
@@ -0,0 +1,11 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include "object.h"
+
+// Registers serialize() and deserialize(), which convert a graph of
+// values to a compact binary string and back, along with writeValue()
+// and readValue() that do the same with a file
+void defineSerializeNatives();
+
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "snippet.h"
+#include "vm.h"
+
+void initSnippetCache(SnippetCache* cache, int capacity) {
+  cache->snippets = NULL;
+  cache->count = 0;
+  cache->capacity = capacity;
+  cache->newest = -1;
+  cache->oldest = -1;
+  initTable(&cache->index);
+  SET_TABLE_ROLE(&cache->index, TABLE_SNIPPETS);
+}
+
+void freeSnippetCache(SnippetCache* cache) {
+  // The snippets are allocated all at once when the first one is added
+  FREE_ARRAY(Snippet, cache->snippets, cache->snippets != NULL ? cache->capacity : 0);
+  freeTable(&cache->index);
+  initSnippetCache(cache, cache->capacity);
+}
+
+void markSnippetCache(SnippetCache* cache) {
+  for (int i = 0; i < cache->count; i++) {
+    markObject((Obj*)cache->snippets[i].source);
+    markObject((Obj*)cache->snippets[i].function);
+  }
+}
+
+static void removeFromList(SnippetCache* cache, int i) {
+  Snippet* snippet = &cache->snippets[i];
+  if (snippet->newer != -1) {
+    cache->snippets[snippet->newer].older = snippet->older;
+  } else {
+    cache->newest = snippet->older;
+  }
+
+  if (snippet->older != -1) {
+    cache->snippets[snippet->older].newer = snippet->newer;
+  } else {
+    cache->oldest = snippet->newer;
+  }
+}
+
+static void makeNewest(SnippetCache* cache, int i) {
+  Snippet* snippet = &cache->snippets[i];
+  snippet->newer = -1;
+  snippet->older = cache->newest;
+  if (cache->newest != -1) {
+    cache->snippets[cache->newest].newer = i;
+  } else {
+    cache->oldest = i;
+  }
+  cache->newest = i;
+}
+
+// Both the source and the function have to be on the stack, as adding
+// them allocates
+static void addSnippet(SnippetCache* cache, ObjString* source, ObjFunction* function) {
+  if (cache->snippets == NULL) cache->snippets = ALLOCATE(Snippet, cache->capacity);
+
+  int i;
+  if (cache->count < cache->capacity) {
+    i = cache->count++;
+  } else {
+    // Make room by evicting the least recently used snippet
+    i = cache->oldest;
+    removeFromList(cache, i);
+    tableDelete(&cache->index, cache->snippets[i].source);
+  }
+
+  cache->snippets[i].source = source;
+  cache->snippets[i].function = function;
+  makeNewest(cache, i);
+  tableSet(&cache->index, source, NUMBER_VAL(i));
+}
+
+ObjFunction* compileSnippet(SnippetCache* cache, const char* source) {
+  size_t length = strlen(source);
+  if (cache->capacity == 0 || length > SNIPPET_MAX_LENGTH) return compile(source);
+
+  // Interning the source hashes it and finds the copy that the cache
+  // holds on to, if there is one
+  ObjString* key = copyString(source, (int)length);
+  Value index;
+  if (tableGet(&cache->index, key, &index)) {
+    // A compiled function is never changed by running it, so the same
+    // one can be run over and over again
+    int i = (int)AS_NUMBER(index);
+    if (i != cache->newest) {
+      removeFromList(cache, i);
+      makeNewest(cache, i);
+    }
+    return cache->snippets[i].function;
+  }
+
+  push(OBJ_VAL(key));
+  ObjFunction* function = compile(source);
+  // Sources that do not compile are not cached, so their errors are
+  // reported every time
+  if (function != NULL) {
+    push(OBJ_VAL(function));
+    addSnippet(cache, key, function);
+    pop();
+  }
+  pop();
+  return function;
+}
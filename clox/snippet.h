@@ -0,0 +1,41 @@
+#ifndef clox_snippet_h
+#define clox_snippet_h
+
+#include "object.h"
+#include "table.h"
+
+// Number of compiled sources that interpret() keeps around by default
+#define SNIPPET_CACHE_SIZE 64
+// Longer sources are scripts rather than snippets, which are neither
+// likely to be run again nor worth keeping a copy of
+#define SNIPPET_MAX_LENGTH 4096
+
+typedef struct {
+  ObjString* source;
+  ObjFunction* function;
+  // Neighbours in the list from the most to the least recently used
+  // snippet, or -1 at either end
+  int newer;
+  int older;
+} Snippet;
+
+// Least recently used cache of the functions compiled from sources,
+// which are looked up by their interned source string
+typedef struct {
+  Snippet* snippets;
+  int count;
+  int capacity;
+  int newest;
+  int oldest;
+  // Maps each source to the index of its snippet
+  Table index;
+} SnippetCache;
+
+void initSnippetCache(SnippetCache* cache, int capacity);
+void freeSnippetCache(SnippetCache* cache);
+void markSnippetCache(SnippetCache* cache);
+// Returns the function compiled from source, compiling it if it is not
+// in the cache yet, or NULL if it does not compile
+ObjFunction* compileSnippet(SnippetCache* cache, const char* source);
+
+#endif
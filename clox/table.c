@@ -6,17 +6,145 @@
 #include "table.h"
 #include "value.h"
 
+#ifdef DEBUG_TABLE_STATS
+#include <stdatomic.h>
+#include <stdio.h>
+#endif
+
 #define TABLE_MAX_LOAD 0.75
 
+// Tables with up to this many entries keep them packed at the front of
+// the array, in the order they were added, and find keys by comparing
+// them one after the other rather than by hashing. Most classes and
+// instances have only a handful of methods and fields, for which this
+// is cheaper than computing an index and probing.
+#define SMALL_TABLE_CAPACITY 8
+#define IS_SMALL(table) ((table)->capacity <= SMALL_TABLE_CAPACITY)
+
+#ifdef DEBUG_TABLE_STATS
+// The counters are atomic because threads that share the heap look up
+// interned strings at the same time
+typedef struct {
+  atomic_long lookups;
+  atomic_long hits;
+  atomic_long probes;
+  atomic_int maxProbes;
+  atomic_long tombstones;
+  atomic_long resizes;
+  atomic_long loadSamples;
+  // Sum of the load factors that were recorded, in thousandths
+  atomic_long load;
+} TableStats;
+
+static TableStats stats[TABLE_ROLE_COUNT];
+
+static const char* roleNames[TABLE_ROLE_COUNT] = {
+  [TABLE_OTHER] = "other",
+  [TABLE_GLOBALS] = "globals",
+  [TABLE_STRINGS] = "strings",
+  [TABLE_METHODS] = "methods",
+  [TABLE_FIELDS] = "fields",
+  [TABLE_SNIPPETS] = "snippets",
+  [TABLE_REGEXES] = "regexes",
+};
+
+void countTableLookup(TableRole role, int probes, int tombstones, bool hit) {
+  TableStats* counts = &stats[role];
+  atomic_fetch_add_explicit(&counts->lookups, 1, memory_order_relaxed);
+  if (hit) atomic_fetch_add_explicit(&counts->hits, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&counts->probes, probes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&counts->tombstones, tombstones, memory_order_relaxed);
+
+  int maxProbes = atomic_load_explicit(&counts->maxProbes, memory_order_relaxed);
+  while (probes > maxProbes &&
+         !atomic_compare_exchange_weak_explicit(&counts->maxProbes, &maxProbes, probes,
+                                                memory_order_relaxed, memory_order_relaxed));
+}
+
+void countTableLoad(TableRole role, int count, int capacity) {
+  if (capacity == 0) return;
+  atomic_fetch_add_explicit(&stats[role].loadSamples, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats[role].load, count * 1000L / capacity,
+                            memory_order_relaxed);
+}
+
+void countTableResize(TableRole role) {
+  atomic_fetch_add_explicit(&stats[role].resizes, 1, memory_order_relaxed);
+}
+
+void printTableStats() {
+  fprintf(stderr, "%-8s %10s %10s %9s %9s %10s %7s %8s\n", "table", "lookups",
+          "hits", "avg probe", "max probe", "tombstones", "resizes", "avg load");
+  for (int i = 0; i < TABLE_ROLE_COUNT; i++) {
+    TableStats* counts = &stats[i];
+    long lookups = atomic_load(&counts->lookups);
+    if (lookups == 0) continue;
+    long loadSamples = atomic_load(&counts->loadSamples);
+    double perLookup = lookups > 0 ? 1.0 / lookups : 0;
+    double perSample = loadSamples > 0 ? 1.0 / loadSamples : 0;
+    fprintf(stderr, "%-8s %10ld %10ld %9.2f %9d %10ld %7ld %8.2f\n", roleNames[i],
+            lookups, atomic_load(&counts->hits), atomic_load(&counts->probes) * perLookup,
+            atomic_load(&counts->maxProbes), atomic_load(&counts->tombstones),
+            atomic_load(&counts->resizes), atomic_load(&counts->load) * perSample / 1000);
+  }
+}
+
+// Walks the same slots as a lookup of key does, which keeps the
+// counting out of the lookups themselves
+static void countLookup(Table* table, ObjString* key) {
+  OBJ_REF(ObjString) keyRef = PTR_REF(key);
+  int probes = 0;
+  int tombstones = 0;
+  bool hit = false;
+
+  if (IS_SMALL(table)) {
+    while (probes < table->count && !hit) {
+      hit = table->entries[probes++].key == keyRef;
+    }
+  } else {
+    uint32_t index = key->hash % table->capacity;
+    for (;;) {
+      Entry* entry = &table->entries[index];
+      probes++;
+      if (entry->key == keyRef) {
+        hit = true;
+        break;
+      }
+      if (entry->key == NULL_REF) {
+        if (IS_NIL(entryValue(entry))) break;
+        tombstones++;
+      }
+      index = (index + 1) % table->capacity;
+    }
+  }
+
+  countTableLookup(table->role, probes, tombstones, hit);
+}
+
+#define COUNT_LOOKUP(table, key) countLookup(table, key)
+#define COUNT_RESIZE(table) countTableResize((table)->role)
+#define COUNT_LOAD(table) countTableLoad((table)->role, (table)->count, (table)->capacity)
+#else
+#define COUNT_LOOKUP(table, key) ((void)0)
+#define COUNT_RESIZE(table) ((void)0)
+#define COUNT_LOAD(table) ((void)0)
+#endif
+
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
   table->entries = NULL;
+#ifdef DEBUG_TABLE_STATS
+  table->role = TABLE_OTHER;
+#endif
 }
 
 void freeTable(Table* table) {
   FREE_ARRAY(Entry, table->entries, table->capacity);
-  initTable(table);
+  // Unlike initTable(), this keeps the role of the table
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
 }
 
 // Whenever we encounter a tombstone, we store it in a local variable first,
@@ -26,12 +154,13 @@ void freeTable(Table* table) {
 static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
   uint32_t index = key->hash % capacity;
   Entry* tombstone = NULL;
+  OBJ_REF(ObjString) keyRef = PTR_REF(key);
 
   for (;;) {
     Entry* entry = &entries[index];
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
+    if (entry->key == NULL_REF) {
+      if (IS_NIL(entryValue(entry))) {
         // Now that we encountered an empty entry, we know for sure
         // that the key doesnt exist, we either return any previously found
         // tombstone entries, or this empty entry itself
@@ -41,7 +170,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
         // that we encountered, since this is the one we want to return
         if (tombstone == NULL) tombstone = entry;
       }
-    } else if (entry->key == key) {
+    } else if (entry->key == keyRef) {
       // We found the entry with the right key
       return entry;
     }
@@ -51,23 +180,44 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
   }
 }
 
+// Small tables never contain tombstones, so every key before count is
+// in use and the rest of the array is empty
+static Entry* findSmallEntry(Table* table, ObjString* key) {
+  OBJ_REF(ObjString) keyRef = PTR_REF(key);
+  for (int i = 0; i < table->count; i++) {
+    if (table->entries[i].key == keyRef) return &table->entries[i];
+  }
+  return NULL;
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
+  COUNT_LOOKUP(table, key);
+
   // When the table is empty, the array might still not be
   // initialised yet, hence this check is more than an optimisation
   if (table->count == 0) return false;
 
+  if (IS_SMALL(table)) {
+    Entry* entry = findSmallEntry(table, key);
+    if (entry == NULL) return false;
+    *value = entryValue(entry);
+    return true;
+  }
+
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (entry->key == NULL_REF) return false;
 
-  *value = entry->value;
+  *value = entryValue(entry);
   return true;
 }
 
 static void adjustCapacity(Table* table, int capacity) {
+  if (table->capacity > 0) COUNT_RESIZE(table);
+
   Entry* entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    entries[i].key = NULL_REF;
+    setEntryValue(&entries[i], NIL_VAL);
   }
 
   // Recalculate buckets for existing entries, we walk through
@@ -78,11 +228,13 @@ static void adjustCapacity(Table* table, int capacity) {
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+    if (entry->key == NULL_REF) continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    // A table that is still small keeps its entries packed
+    Entry* dest = capacity <= SMALL_TABLE_CAPACITY
+        ? &entries[table->count]
+        : findEntry(entries, capacity, REF_PTR(ObjString, entry->key));
+    *dest = *entry;
     table->count++;
   }
 
@@ -91,78 +243,100 @@ static void adjustCapacity(Table* table, int capacity) {
   table->capacity = capacity;
 }
 
+static bool smallTableSet(Table* table, ObjString* key, Value value) {
+  Entry* entry = findSmallEntry(table, key);
+  if (entry != NULL) {
+    setEntryValue(entry, value);
+    return false;
+  }
+
+  entry = &table->entries[table->count++];
+  entry->key = PTR_REF(key);
+  setEntryValue(entry, value);
+  return true;
+}
+
 bool tableSet(Table *table, ObjString* key, Value value) {
+  if (table->capacity == 0) adjustCapacity(table, GROW_CAPACITY(0));
+
+  if (IS_SMALL(table)) {
+    // A full small table turns into a hash table, which starts out
+    // with room to spare
+    if (table->count < table->capacity || findSmallEntry(table, key) != NULL) {
+      COUNT_LOOKUP(table, key);
+      bool isNewKey = smallTableSet(table, key, value);
+      if (isNewKey) COUNT_LOAD(table);
+      return isNewKey;
+    }
+    adjustCapacity(table, GROW_CAPACITY(table->capacity));
+  }
+
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
     adjustCapacity(table, capacity);
   }  
 
+  COUNT_LOOKUP(table, key);
   Entry* entry = findEntry(table->entries, table->capacity, key);
 
-  bool isNewKey = entry->key == NULL;
+  bool isNewKey = entry->key == NULL_REF;
 
   // Only increment count if we are not overwriting an
   // existing entry and the entry wasn't previously a 
   // tombstone entry (in which case its count would 
   // already be accounted for)
-  if (isNewKey && IS_NIL(entry->value)) {
+  if (isNewKey && IS_NIL(entryValue(entry))) {
     table->count++;
   }
 
-  entry->key = key;
-  entry->value = value;
+  entry->key = PTR_REF(key);
+  setEntryValue(entry, value);
 
+  if (isNewKey) COUNT_LOAD(table);
   return isNewKey;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
+  COUNT_LOOKUP(table, key);
   if (table->count == 0) return false;
 
+  if (IS_SMALL(table)) {
+    Entry* entry = findSmallEntry(table, key);
+    if (entry == NULL) return false;
+
+    // Close the gap, so that the entries stay packed and in the
+    // order they were added
+    Entry* last = &table->entries[--table->count];
+    memmove(entry, entry + 1, (last - entry) * sizeof(Entry));
+    last->key = NULL_REF;
+    setEntryValue(last, NIL_VAL);
+    return true;
+  }
+
   // Find the entry
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (entry->key == NULL_REF) return false;
 
   // Place a tombstone in the entry
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  entry->key = NULL_REF;
+  setEntryValue(entry, BOOL_VAL(true));
 
   return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
-    }
-  }
-}
-
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
-
-  uint32_t index  = hash % table->capacity;
-
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length && 
-        entry->key->hash == hash && 
-        memcmp(entry->key->chars, chars, length) == 0) {
-      return entry -> key;
-    }
-
-    index = (index + 1) % table->capacity;
+void tableClear(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    table->entries[i].key = NULL_REF;
+    setEntryValue(&table->entries[i], NIL_VAL);
   }
+  table->count = 0;
 }
 
-void tableRemoveWhite(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+void tableAddAll(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; i++) {
+    Entry* entry = &from->entries[i];
+    if (entry->key != NULL_REF) {
+      tableSet(to, REF_PTR(ObjString, entry->key), entryValue(entry));
     }
   }
 }
@@ -171,7 +345,7 @@ void markTable(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
     // Mark the string key and the value
-    markObject((Obj*)entry->key);
-    markValue(entry->value);
+    markObject((Obj*)REF_PTR(ObjString, entry->key));
+    markValue(entryValue(entry));
   }
 }
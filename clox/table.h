@@ -1,22 +1,56 @@
 #ifndef clox_table_h
 #define clox_table_h
 
+#include "cage.h"
 #include "common.h"
 #include "value.h"
 
+// The key sits between the type and the data of its value, which is
+// where a 32-bit reference fills what would otherwise be padding
 typedef struct {
-  ObjString* key;
-  Value value;
+  ValueType valueType;
+  OBJ_REF(ObjString) key;
+  ValueData valueData;
 } Entry;
 
+static inline Value entryValue(const Entry* entry) {
+  return (Value){entry->valueType, entry->valueData};
+}
+
+static inline void setEntryValue(Entry* entry, Value value) {
+  entry->valueType = value.type;
+  entry->valueData = value.as;
+}
+
+#ifdef DEBUG_TABLE_STATS
+// What a table is used for, which its counters are kept by. Tables
+// that were never given a role count as TABLE_OTHER.
+typedef enum {
+  TABLE_OTHER,
+  TABLE_GLOBALS,
+  TABLE_STRINGS,
+  TABLE_METHODS,
+  TABLE_FIELDS,
+  TABLE_SNIPPETS,
+  TABLE_REGEXES,
+  TABLE_ROLE_COUNT,
+} TableRole;
+#endif
+
+// Small tables keep their entries packed at the front of the array,
+// larger ones are hash tables. Either way, entries with a NULL key are
+// not in use and can be skipped when iterating over the array.
 typedef struct {
   int count;
   int capacity;
   Entry* entries;
+#ifdef DEBUG_TABLE_STATS
+  TableRole role;
+#endif
 } Table;
 
-
 void initTable(Table* table);
+// Leaves the table empty and ready to be used again
 void freeTable(Table* table);
 // Returns true if found, storing the result in the value param
 bool tableGet(Table* table, ObjString* key, Value* value);
@@ -24,10 +58,25 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 // was instead an overwrite
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
+// Removes every entry but keeps the capacity
+void tableClear(Table* table);
 void tableAddAll(Table* from, Table* to);
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
+#ifdef DEBUG_TABLE_STATS
+#define SET_TABLE_ROLE(table, tableRole) ((table)->role = (tableRole))
+// Counts a lookup that looked at probes slots, tombstones of which were
+// passed over
+void countTableLookup(TableRole role, int probes, int tombstones, bool hit);
+// Records the load factor of a table after a key was added to it, with
+// count of its capacity slots in use
+void countTableLoad(TableRole role, int count, int capacity);
+void countTableResize(TableRole role);
+// Prints the counts for every role that was looked up to stderr
+void printTableStats();
+#else
+#define SET_TABLE_ROLE(table, tableRole) ((void)0)
+#endif
+
 #endif
 
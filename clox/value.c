@@ -3,6 +3,7 @@
 
 #include "object.h"
 #include "memory.h"
+#include "persistent.h"
 #include "value.h"
 
 void initValueArray(ValueArray* array) {
@@ -39,6 +40,16 @@ void printValue(Value value) {
   }
 }
 
+// Records of the same type are equal if all of their fields are
+static bool recordsEqual(ObjRecord* a, ObjRecord* b) {
+  if (a->type != b->type) return false;
+
+  for (int i = 0; i < a->fieldCount; i++) {
+    if (!valuesEqual(a->fields[i], b->fields[i])) return false;
+  }
+  return true;
+}
+
 bool valuesEqual(Value a, Value b) {
   if (a.type != b.type) {
     return false;
@@ -50,8 +61,63 @@ bool valuesEqual(Value a, Value b) {
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     // In the case where the objects are strings, since we have
     // already interned all strings, we do not have to test the chars
-    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      if (AS_OBJ(a) == AS_OBJ(b)) return true;
+      if (OBJ_TYPE(a) != OBJ_TYPE(b)) return false;
+
+      switch (OBJ_TYPE(a)) {
+        case OBJ_HASH_MAP: return hashMapsEqual(AS_HASH_MAP(a), AS_HASH_MAP(b));
+        case OBJ_RECORD: return recordsEqual(AS_RECORD(a), AS_RECORD(b));
+        case OBJ_VECTOR: return vectorsEqual(AS_VECTOR(a), AS_VECTOR(b));
+        default: return false;
+      }
     default: return false;
   }
 }
 
+static uint32_t hashNumber(double number) {
+  // 0 and -0 are equal but differ in their bits
+  if (number == 0) return 0;
+
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(double));
+  return (uint32_t)(bits ^ (bits >> 32));
+}
+
+uint32_t hashAddress(void* pointer) {
+  uintptr_t address = (uintptr_t)pointer;
+  return (uint32_t)((address >> 3) ^ (address >> 32)) * 2654435761u;
+}
+
+uint32_t hashValue(Value value) {
+  switch (value.type) {
+    case VAL_BOOL: return AS_BOOL(value) ? 3 : 5;
+    case VAL_NIL: return 7;
+    case VAL_NUMBER: return hashNumber(AS_NUMBER(value));
+    case VAL_OBJ: {
+      // Strings are interned, but hashing their contents gives us a
+      // hash that does not depend on where the string was allocated
+      if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+      // Records that are equal have to hash the same, so we hash
+      // their fields rather than their identity
+      if (IS_RECORD(value)) {
+        ObjRecord* record = AS_RECORD(value);
+        uint32_t hash = hashAddress(REF_PTR(ObjRecordType, record->type));
+        for (int i = 0; i < record->fieldCount; i++) {
+          hash = (hash ^ hashValue(record->fields[i])) * 16777619u;
+        }
+        return hash;
+      }
+
+      // The same goes for the persistent collections
+      if (IS_VECTOR(value)) return hashVector(AS_VECTOR(value));
+      if (IS_HASH_MAP(value)) return hashHashMap(AS_HASH_MAP(value));
+
+      // Objects are never moved, so their address is a stable identity
+      return hashAddress(AS_OBJ(value));
+    }
+    default: return 0;
+  }
+}
+
@@ -1,6 +1,7 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include "cage.h"
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -13,13 +14,15 @@ typedef enum {
   VAL_OBJ,
 } ValueType;
 
+typedef union {
+  bool boolean;
+  double number;
+  OBJ_REF(Obj) obj;
+} ValueData;
+
 typedef struct {
   ValueType type;
-  union {
-    bool boolean;
-    double number;
-    Obj* obj;
-  } as;
+  ValueData as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
@@ -27,14 +30,14 @@ typedef struct {
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
-#define AS_OBJ(value) ((value).as.obj)
+#define AS_OBJ(value) REF_PTR(Obj, (value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(object)    ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define OBJ_VAL(object)    ((Value){VAL_OBJ, {.obj = PTR_REF((Obj*)object)}})
 
 typedef struct {
   int capacity;
@@ -43,6 +46,13 @@ typedef struct {
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+// Hash that is consistent with valuesEqual(), i.e. numbers, strings,
+// records, vectors and hash maps hash by content while other objects
+// hash by identity
+uint32_t hashValue(Value value);
+// Hash of an object's identity, which is what hashValue() uses for
+// objects that are not hashed by content
+uint32_t hashAddress(void* pointer);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
@@ -0,0 +1,446 @@
+#include <stdio.h>
+
+#include "chunk.h"
+#include "intrinsic.h"
+#include "memory.h"
+#include "verify.h"
+#include "vm.h"
+
+#define ERROR_MAX 160
+
+typedef struct {
+  ObjFunction* function;
+  Chunk* chunk;
+  // Length of the instruction that starts at each offset of the code,
+  // or 0 for offsets in the middle of one
+  int* lengths;
+  // Stack depth at the start of each instruction, counting the callee
+  // and the arguments, or -1 if no path reaches it yet
+  int* depths;
+  // Instructions whose successors still have to be visited
+  int* pending;
+  int pendingCount;
+  int maxSlots;
+  bool failed;
+} Verifier;
+
+static char errorMessage[ERROR_MAX];
+
+static bool fail(Verifier* verifier, int offset, const char* message) {
+  if (verifier->failed) return false;
+  verifier->failed = true;
+
+  ObjString* name = REF_PTR(ObjString, verifier->function->name);
+  snprintf(errorMessage, ERROR_MAX, "%s at offset %d in %s.", message,
+           offset, name != NULL ? name->chars : "script");
+  return false;
+}
+
+static bool checkConstant(Verifier* verifier, int offset, ObjType type) {
+  int index = verifier->chunk->code[offset + 1];
+  if (index >= verifier->chunk->constants.count) {
+    return fail(verifier, offset, "Constant does not exist");
+  }
+
+  Value constant = verifier->chunk->constants.values[index];
+  if (!IS_OBJ(constant) || OBJ_TYPE(constant) != type) {
+    return fail(verifier, offset, "Constant has the wrong type");
+  }
+  return true;
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// Returns the length of the instruction at offset after checking the
+// operands that do not depend on the stack, or 0 if it is invalid. Jump
+// targets are checked once the start of every instruction is known.
+static int checkInstruction(Verifier* verifier, int offset) {
+  Chunk* chunk = verifier->chunk;
+  int length;
+  switch (chunk->code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_INHERIT:
+    case OP_THROW:
+      return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      length = 2;
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_INTRINSIC:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      length = 3;
+      break;
+    case OP_CLOSURE: {
+      // The number of upvalues that follow depends on the constant
+      length = 2;
+      if (offset + length > chunk->count) break;
+      if (!checkConstant(verifier, offset, OBJ_FUNCTION)) return 0;
+      // The function itself is only verified later on
+      int upvalueCount =
+          AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])->upvalueCount;
+      if (upvalueCount < 0 || upvalueCount > UINT8_COUNT) {
+        fail(verifier, offset, "Invalid function");
+        return 0;
+      }
+      length += 2 * upvalueCount;
+      break;
+    }
+    default:
+      fail(verifier, offset, "Invalid opcode");
+      return 0;
+  }
+
+  if (verifier->failed || offset + length > chunk->count) {
+    fail(verifier, offset, "Instruction runs past the end of the code");
+    return 0;
+  }
+
+  uint8_t operand = chunk->code[offset + 1];
+  switch (chunk->code[offset]) {
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      if (operand >= verifier->function->upvalueCount) {
+        fail(verifier, offset, "Upvalue does not exist");
+        return 0;
+      }
+      break;
+    case OP_CONSTANT:
+      if (operand >= chunk->constants.count) {
+        fail(verifier, offset, "Constant does not exist");
+        return 0;
+      }
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      if (!checkConstant(verifier, offset, OBJ_STRING)) return 0;
+      break;
+    case OP_INTRINSIC:
+      if (operand >= INTRINSIC_COUNT) {
+        fail(verifier, offset, "Intrinsic does not exist");
+        return 0;
+      }
+      break;
+    case OP_CLOSURE:
+      for (int i = offset + 2; i < offset + length; i += 2) {
+        if (chunk->code[i] > 1) {
+          fail(verifier, offset, "Invalid upvalue capture");
+          return 0;
+        }
+        // Locals are checked against the depth of the stack later on
+        if (!chunk->code[i] && chunk->code[i + 1] >= verifier->function->upvalueCount) {
+          fail(verifier, offset, "Upvalue does not exist");
+          return 0;
+        }
+      }
+      break;
+  }
+  return length;
+}
+
+// Records the stack depth on one of the paths to the instruction at
+// offset, and queues it up if that is the first path to get there
+static void visit(Verifier* verifier, int from, int offset, int depth) {
+  if (offset >= verifier->chunk->count) {
+    fail(verifier, from, "Code runs past the end");
+    return;
+  }
+
+  if (verifier->depths[offset] == -1) {
+    verifier->depths[offset] = depth;
+    verifier->pending[verifier->pendingCount++] = offset;
+    if (depth > verifier->maxSlots) verifier->maxSlots = depth;
+  } else if (verifier->depths[offset] != depth) {
+    fail(verifier, offset, "Stack depth differs between paths");
+  }
+}
+
+// The VM takes the method that OP_METHOD binds to be the closure that
+// was created right before it, so jumps may not lead there
+static bool isJumpTarget(Verifier* verifier, int offset) {
+  Chunk* chunk = verifier->chunk;
+  return offset >= 0 && offset < chunk->count && verifier->lengths[offset] != 0 &&
+         chunk->code[offset] != OP_METHOD;
+}
+
+static void jump(Verifier* verifier, int offset, int depth) {
+  int target = jumpTarget(verifier->chunk, offset);
+  if (!isJumpTarget(verifier, target)) {
+    fail(verifier, offset, "Invalid jump target");
+    return;
+  }
+  visit(verifier, offset, target, depth);
+}
+
+// Follows the instruction at offset to the ones that can run after it
+static void step(Verifier* verifier, int offset) {
+  Chunk* chunk = verifier->chunk;
+  uint8_t* code = chunk->code + offset;
+  int depth = verifier->depths[offset];
+
+  // The number of values the instruction pops and then pushes
+  int pops = 0;
+  int pushes = 0;
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLASS:
+      pushes = 1;
+      break;
+    case OP_GET_LOCAL:
+      if (code[1] >= depth) {
+        fail(verifier, offset, "Local does not exist");
+        return;
+      }
+      pushes = 1;
+      break;
+    case OP_SET_LOCAL:
+      if (code[1] >= depth) {
+        fail(verifier, offset, "Local does not exist");
+        return;
+      }
+      pops = 1;
+      pushes = 1;
+      break;
+    case OP_CLOSURE: {
+      int upvalueCount = AS_FUNCTION(chunk->constants.values[code[1]])->upvalueCount;
+      for (int i = 0; i < upvalueCount; i++) {
+        if (code[2 + 2 * i] && code[3 + 2 * i] >= depth) {
+          fail(verifier, offset, "Local does not exist");
+          return;
+        }
+      }
+      pushes = 1;
+      break;
+    }
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_DEFINE_GLOBAL:
+    case OP_RETURN:
+    case OP_THROW:
+      pops = 1;
+      break;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_JUMP_IF_FALSE:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+      pops = 1;
+      pushes = 1;
+      break;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INHERIT:
+    case OP_METHOD:
+      pops = 2;
+      pushes = 1;
+      break;
+    case OP_CALL:
+    case OP_INVOKE:
+      pops = code[code[0] == OP_CALL ? 1 : 2] + 1;
+      pushes = 1;
+      break;
+    case OP_SUPER_INVOKE:
+      pops = code[2] + 2;
+      pushes = 1;
+      break;
+    case OP_INTRINSIC:
+      pops = code[2];
+      pushes = 1;
+      // Calls that do not take the fast path insert the callee below
+      // the arguments
+      if (depth + 1 > verifier->maxSlots) verifier->maxSlots = depth + 1;
+      break;
+  }
+
+  // The callee in slot zero stays put until the frame is discarded
+  if (depth - pops < 1) {
+    fail(verifier, offset, "Stack underflow");
+    return;
+  }
+  int next = depth - pops + pushes;
+
+  switch (code[0]) {
+    case OP_RETURN:
+    case OP_THROW:
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      jump(verifier, offset, next);
+      break;
+    case OP_JUMP_IF_FALSE:
+      jump(verifier, offset, next);
+      visit(verifier, offset, offset + 3, next);
+      break;
+    default:
+      visit(verifier, offset, offset + verifier->lengths[offset], next);
+      break;
+  }
+}
+
+static bool checkHandlers(Verifier* verifier) {
+  Chunk* chunk = verifier->chunk;
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    if (handler->start < 0 || handler->start > handler->end ||
+        handler->end > chunk->count ||
+        (handler->start < chunk->count && verifier->lengths[handler->start] == 0) ||
+        (handler->end < chunk->count && verifier->lengths[handler->end] == 0)) {
+      return fail(verifier, handler->start, "Invalid try block");
+    }
+    if (!isJumpTarget(verifier, handler->handler) ||
+        handler->stackSlots < 1 || handler->stackSlots > UINT8_COUNT) {
+      return fail(verifier, handler->handler, "Invalid catch block");
+    }
+  }
+  return true;
+}
+
+// A try block may not pop the locals that its catch block expects to
+// still be there
+static bool checkTryDepths(Verifier* verifier) {
+  Chunk* chunk = verifier->chunk;
+  for (int i = 0; i < chunk->handlerCount; i++) {
+    ExceptionHandler* handler = &chunk->handlers[i];
+    for (int offset = handler->start; offset < handler->end; offset++) {
+      int depth = verifier->depths[offset];
+      if (verifier->lengths[offset] != 0 && depth != -1 && depth < handler->stackSlots) {
+        return fail(verifier, offset, "Stack is below the locals of its try block");
+      }
+    }
+  }
+  return true;
+}
+
+static bool verify(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Verifier verifier;
+  verifier.function = function;
+  verifier.chunk = chunk;
+  verifier.pendingCount = 0;
+  verifier.failed = false;
+  // The callee and its arguments are there from the start
+  verifier.maxSlots = function->arity + 1;
+
+  if (function->arity < 0 || function->arity >= UINT8_COUNT ||
+      function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT) {
+    return fail(&verifier, 0, "Invalid function");
+  }
+
+  verifier.lengths = ALLOCATE(int, chunk->count);
+  verifier.depths = ALLOCATE(int, chunk->count);
+  verifier.pending = ALLOCATE(int, chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) {
+    verifier.lengths[offset] = 0;
+    verifier.depths[offset] = -1;
+  }
+
+  // Instructions follow each other without gaps, so decoding them in a
+  // row finds the start of every one of them
+  int previous = -1;
+  for (int offset = 0; offset < chunk->count;) {
+    int length = checkInstruction(&verifier, offset);
+    if (length == 0) break;
+    if (chunk->code[offset] == OP_METHOD &&
+        (previous == -1 || chunk->code[previous] != OP_CLOSURE)) {
+      fail(&verifier, offset, "Method is not a closure");
+      break;
+    }
+    verifier.lengths[offset] = length;
+    previous = offset;
+    offset += length;
+  }
+
+  if (!verifier.failed && checkHandlers(&verifier)) {
+    visit(&verifier, 0, 0, function->arity + 1);
+    for (int i = 0; i < chunk->handlerCount && !verifier.failed; i++) {
+      // The exception is pushed above the locals of the try block
+      ExceptionHandler* handler = &chunk->handlers[i];
+      visit(&verifier, handler->handler, handler->handler, handler->stackSlots + 1);
+    }
+
+    while (verifier.pendingCount > 0 && !verifier.failed) {
+      step(&verifier, verifier.pending[--verifier.pendingCount]);
+    }
+    if (!verifier.failed) checkTryDepths(&verifier);
+  }
+
+  FREE_ARRAY(int, verifier.lengths, chunk->count);
+  FREE_ARRAY(int, verifier.depths, chunk->count);
+  FREE_ARRAY(int, verifier.pending, chunk->count);
+  if (verifier.failed) return false;
+
+  function->maxSlots = verifier.maxSlots;
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant) && !verify(AS_FUNCTION(constant))) return false;
+  }
+  return true;
+}
+
+const char* verifyFunction(ObjFunction* function) {
+  // Nothing can be captured by the function that is run first
+  if (function->upvalueCount != 0) return "Script has upvalues.";
+
+  // Only the function itself needs to be rooted, the functions nested
+  // in it are reachable through its constants
+  push(OBJ_VAL(function));
+  bool verified = verify(function);
+  pop();
+  return verified ? NULL : errorMessage;
+}
@@ -0,0 +1,16 @@
+#ifndef clox_verify_h
+#define clox_verify_h
+
+#include "object.h"
+
+// Checks that the bytecode of a function, and of every function nested
+// in it, only ever decodes whole instructions, jumps to the start of an
+// instruction, refers to constants, locals and upvalues that exist and
+// leaves the stack at the same depth on every path to an instruction.
+// Records the number of stack slots each function needs on the way.
+//
+// Returns NULL if the bytecode is sound, or else a message that
+// describes the first problem found.
+const char* verifyFunction(ObjFunction* function);
+
+#endif
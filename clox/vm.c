@@ -3,12 +3,24 @@
 #include <string.h>
 #include <time.h>
 
+#include "bench.h"
+#include "buffer.h"
 #include "common.h"
 #include "compiler.h"
+#include "csv.h"
 #include "debug.h"
+#include "extension.h"
+#include "intrinsic.h"
+#include "json.h"
+#include "list.h"
+#include "memo.h"
 #include "memory.h"
 #include "object.h"
+#include "persistent.h"
+#include "regex.h"
+#include "serialize.h"
 #include "vm.h"
+#include "weak.h"
 
 // Defining a static VM as a global variable is not necessarily the best choice
 // It does however save us the need to pass a pointer to a VM all the time.
@@ -25,53 +37,144 @@ static void resetStack() {
   vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
-
+static void printStackTrace() {
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame* frame = &vm.frames[i];
-    ObjFunction* function = frame->closure->function;
+    ObjFunction* function = REF_PTR(ObjFunction, frame->closure->function);
 
     // -1 since IP points to the next instruction to execute
     size_t instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ",
             function->chunk.lines[instruction]);
-    if (function->name == NULL) {
+    if (function->name == NULL_REF) {
       fprintf(stderr, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(stderr, "%s()\n", REF_PTR(ObjString, function->name)->chars);
     }
   }
+}
 
-  resetStack();
+// Whether any of the frames is in a try block at the moment
+static bool isCaught() {
+  for (int i = vm.frameCount - 1; i >= 0; i--) {
+    CallFrame* frame = &vm.frames[i];
+    Chunk* chunk = &REF_PTR(ObjFunction, frame->closure->function)->chunk;
+
+    // -1 since IP points to the next instruction to execute
+    if (findHandler(chunk, (int)(frame->ip - chunk->code - 1)) != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void reportUncaught(Value exception) {
+  if (IS_STRING(exception)) {
+    fprintf(stderr, "%s\n", AS_CSTRING(exception));
+  } else if (IS_INSTANCE(exception)) {
+    fprintf(stderr, "Uncaught %s instance.\n",
+            REF_PTR(ObjString, REF_PTR(ObjClass, AS_INSTANCE(exception)->klass)->name)->chars);
+  } else if (IS_RECORD(exception)) {
+    fprintf(stderr, "Uncaught %s record.\n",
+            REF_PTR(ObjString, REF_PTR(ObjRecordType, AS_RECORD(exception)->type)->name)->chars);
+  } else {
+    fprintf(stderr, "Uncaught exception.\n");
+  }
+  printStackTrace();
+}
+
+// Starts throwing an exception, the frames are unwound by the caller.
+// If nothing is going to catch the exception it is reported right away,
+// while the stack trace is still intact.
+static void throwException(Value exception) {
+  vm.exception = exception;
+  if (!isCaught()) reportUncaught(exception);
+}
+
+// Runtime errors are thrown as strings holding the error message
+static void throwError(const char* format, va_list args) {
+  char message[1024];
+  vsnprintf(message, sizeof(message), format, args);
+  throwException(OBJ_VAL(copyString(message, (int)strlen(message))));
+}
+
+static void runtimeError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  throwError(format, args);
+  va_end(args);
 }
 
-static void defineNative(const char* name, NativeFn function) {
+Value nativeError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  throwError(format, args);
+  va_end(args);
+
+  // The frames are only unwound once the native has returned
+  vm.nativeFailed = true;
+  return NIL_VAL;
+}
+
+// Called whenever a global is defined or assigned, so that OP_INTRINSIC
+// stops assuming that the global holds the math function
+static void noteGlobalChange(ObjString* name) {
+  if (name->length > INTRINSIC_NAME_MAX) return;
+
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    if (vm.intrinsicNames[i] == name) vm.redefinedIntrinsics |= 1u << i;
+  }
+}
+
+ObjNative* defineNative(const char* name, NativeFn function, int arity) {
   // We store things on the stack so that the GC knows that
   // we are not done with them
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  ObjNative* native = newNative(function, arity);
+  push(OBJ_VAL(native));
+  // Natives can be defined while the stack is in use (by extensions),
+  // so we cannot assume that these are in the first two slots
+  tableSet(&vm.globals, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+  noteGlobalChange(AS_STRING(vm.stackTop[-2]));
   pop();
   pop();
+  return native;
 }
 
-void initVM() {
+void initVM(const Allocator* allocator) {
+  // This has to come first as every allocation below relies on it
+  vm.allocator = allocator != NULL ? *allocator : defaultAllocator;
+
+#ifdef HEAP_CAGE
+  initCage();
+#endif
+
   resetStack();
   vm.objects = NULL;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.objectsAllocated = 0;
+  vm.bytesRequested = 0;
 
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
+  vm.weakRefs = NULL;
+  vm.weakMaps = NULL;
+  vm.nativeFailed = false;
+  vm.exception = NIL_VAL;
+  for (int i = 0; i < INTRINSIC_COUNT; i++) {
+    vm.intrinsicNames[i] = NULL;
+  }
+  vm.redefinedIntrinsics = 0;
+
   initTable(&vm.globals);
-  initTable(&vm.strings);
+  SET_TABLE_ROLE(&vm.globals, TABLE_GLOBALS);
+  initTable(&vm.baseGlobals);
+  SET_TABLE_ROLE(&vm.baseGlobals, TABLE_GLOBALS);
+  initInternTable(&vm.strings);
+  initSnippetCache(&vm.snippets, SNIPPET_CACHE_SIZE);
 
   // String copying involves allocation of objects, which can
   // trigger a GC, to avoid the GC reading initString before it is
@@ -79,14 +182,50 @@ void initVM() {
   vm.initString = NULL; 
   vm.initString = copyString("init", 4);
 
-  defineNative("clock", clockNative);
+  defineNative("clock", clockNative, 0);
+  defineIntrinsicNatives();
+  defineWeakNatives();
+  defineMemoNatives();
+  defineListNatives();
+  definePersistentNatives();
+  defineSerializeNatives();
+  defineBufferNatives();
+  defineCsvNatives();
+  defineJsonNatives();
+  defineRegexNatives();
+  defineBenchNatives();
+  defineExtensionNatives();
+
+  tableAddAll(&vm.globals, &vm.baseGlobals);
+}
+
+void resetVM() {
+  resetStack();
+  vm.exception = NIL_VAL;
+  vm.nativeFailed = false;
+
+  // Redefined and new globals are dropped, the table keeps its size
+  tableClear(&vm.globals);
+  tableAddAll(&vm.baseGlobals, &vm.globals);
+  vm.redefinedIntrinsics = 0;
+
+  // With the roots back to what they were, whatever the scripts created
+  // is garbage
+  collectGarbage();
 }
 
 void freeVM() {
+#ifdef DEBUG_TABLE_STATS
+  printTableStats();
+#endif
   freeTable(&vm.globals);
-  freeTable(&vm.strings);
+  freeTable(&vm.baseGlobals);
+  freeInternTable(&vm.strings);
+  freeSnippetCache(&vm.snippets);
+  freeRegexCache();
   vm.initString = NULL;
   freeObjects();
+  freeExtensions();
 }
 
 // Value stack operations
@@ -107,12 +246,17 @@ static Value peek(int distance) {
 }
 
 static bool call(ObjClosure* closure, int argCount) {
-  if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+  ObjFunction* function = REF_PTR(ObjFunction, closure->function);
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
     return false;
   }
   
-  if (vm.frameCount == FRAMES_MAX) {
+  // The verifier has worked out how deep the function can take the
+  // stack, which is checked once here rather than on every push
+  int slots = (int)(vm.stackTop - vm.stack) - argCount - 1;
+  if (vm.frameCount == FRAMES_MAX ||
+      slots + function->maxSlots > STACK_MAX - STACK_RESERVE) {
     runtimeError("Stack overflow.");
     return false;
   }
@@ -121,11 +265,50 @@ static bool call(ObjClosure* closure, int argCount) {
   frame->closure = closure;
   // Point the frame's ip to the beginning of the function's
   // bytecode
-  frame->ip = closure->function->chunk.code;
+  frame->ip = function->chunk.code;
 
   // First slot is reserved for the function itself, which
   // is why we need a -1 here
   frame->slots = vm.stackTop - argCount - 1;
+  frame->memoEntry = NULL;
+  return true;
+}
+
+static bool callMemo(ObjMemo* memo, int argCount) {
+  Value* args = vm.stackTop - argCount;
+  // Arguments are hashed by their contents, which a transient changes
+  // in place, so its calls could never be found again
+  for (int i = 0; i < argCount; i++) {
+    if (isTransient(args[i])) {
+      runtimeError("Can't pass a transient collection to a memoized function.");
+      return false;
+    }
+  }
+  uint32_t hash = hashArguments(args, argCount);
+
+  Value result;
+  if (memoGet(memo, args, argCount, hash, &result)) {
+    // Behave exactly as if the call returned the cached result
+    vm.stackTop -= argCount + 1;
+    push(result);
+    return true;
+  }
+
+  // Checked early so that we do not record an entry for a call
+  // that is never going to happen
+  ObjClosure* closure = REF_PTR(ObjClosure, memo->function);
+  ObjFunction* function = REF_PTR(ObjFunction, closure->function);
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+    return false;
+  }
+
+  MemoEntry* entry = memoBegin(memo, args, argCount, hash);
+
+  // The memo stays in slot zero of the new frame, which keeps it alive
+  // for as long as the call runs, plain functions never read that slot
+  if (!call(closure, argCount)) return false;
+  vm.frames[vm.frameCount - 1].memoEntry = entry;
   return true;
 }
 
@@ -137,7 +320,7 @@ static bool callValue(Value callee, int argCount) {
         // Ensure that in slot 0 of the locals in the stack frame,
         // we can find the receiver of the method call
         vm.stackTop[-argCount - 1] = bound->receiver;
-        return call(bound->method, argCount);
+        return call(REF_PTR(ObjClosure, bound->method), argCount);
       }
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
@@ -159,9 +342,36 @@ static bool callValue(Value callee, int argCount) {
       }
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
+      case OBJ_MEMO:
+        return callMemo(AS_MEMO(callee), argCount);
+      case OBJ_RECORD_TYPE: {
+        ObjRecordType* type = AS_RECORD_TYPE(callee);
+        if (argCount != type->fieldCount) {
+          runtimeError("Expected %d arguments but got %d.",
+                       type->fieldCount, argCount);
+          return false;
+        }
+
+        // The arguments are the fields, the record takes the place of
+        // the type once they are popped
+        ObjRecord* record = newRecord(type, vm.stackTop - argCount);
+        vm.stackTop -= argCount;
+        vm.stackTop[-1] = OBJ_VAL(record);
+        return true;
+      }
       case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
+        ObjNative* native = (ObjNative*)AS_OBJ(callee);
+        if (native->arity != -1 && argCount != native->arity) {
+          runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+          return false;
+        }
+
+        Value result = native->function(argCount, vm.stackTop - argCount);
+        if (vm.nativeFailed) {
+          // The error has already been thrown by the native
+          vm.nativeFailed = false;
+          return false;
+        }
         // Note that the function object itself will be the first value
         // in the stack frame, which is why we need the +1 here
         vm.stackTop -= argCount + 1;
@@ -192,6 +402,19 @@ static bool invokeFromClass(ObjClass* klass , ObjString* name, int argCount) {
 // on which this method is invoked from.
 static bool invoke(ObjString* name, int argCount) {
   Value receiver = peek(argCount);
+
+  // Records have no methods, but their fields can hold callables
+  if (IS_RECORD(receiver)) {
+    ObjRecord* record = AS_RECORD(receiver);
+    int field = recordFieldIndex(REF_PTR(ObjRecordType, record->type), name);
+    if (field == -1) {
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+    }
+
+    vm.stackTop[-argCount - 1] = record->fields[field];
+    return callValue(record->fields[field], argCount);
+  }
   
   if (!IS_INSTANCE(receiver)) {
     runtimeError("Only instances have methods.");
@@ -210,7 +433,7 @@ static bool invoke(ObjString* name, int argCount) {
     return callValue(value, argCount);
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  return invokeFromClass(REF_PTR(ObjClass, instance->klass), name, argCount);
 }
 
 // Looks up the class for a method of a particular name, if
@@ -236,7 +459,7 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
-    upvalue = upvalue->next;
+    upvalue = REF_PTR(ObjUpvalue, upvalue->next);
   }
 
   // If there is an existing upvalue that is the one
@@ -250,12 +473,12 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   // Note how here upvalue is definitely in a slot lower than where
   // we want to place the newly created upvalue, and prevUpvalue should
   // be one slot above where we want to place our new value
-  createdUpvalue->next = upvalue;
+  createdUpvalue->next = PTR_REF(upvalue);
 
   if (prevUpvalue == NULL) {
     vm.openUpvalues = createdUpvalue;
   } else {
-    prevUpvalue->next = createdUpvalue;
+    prevUpvalue->next = PTR_REF(createdUpvalue);
   }
   return createdUpvalue;
 }
@@ -270,7 +493,7 @@ static void closeUpvalues(Value* last) {
     // Here we quite simply point it to the copy of the value that is owned
     // by the upvalue
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    vm.openUpvalues = REF_PTR(ObjUpvalue, upvalue->next);
   }
 }
 
@@ -286,7 +509,7 @@ static void defineMethod(ObjString* name) {
 }
 
 // nil and false are falsey, everything else is truthy
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
@@ -310,7 +533,45 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+// Unwinds the frames above exitFrame until one of them is in a try
+// block, whose handler then receives the pending exception. Returns
+// false if none of them handles it, which leaves exitFrame on top.
+static bool catchException(int exitFrame) {
+  while (vm.frameCount > exitFrame) {
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    Chunk* chunk = &REF_PTR(ObjFunction, frame->closure->function)->chunk;
+    ExceptionHandler* handler =
+        findHandler(chunk, (int)(frame->ip - chunk->code - 1));
+
+    if (handler != NULL) {
+      // Discard whatever the try block left on the stack, closing
+      // the upvalues of the locals that it declared
+      Value* slots = frame->slots + handler->stackSlots;
+      closeUpvalues(slots);
+      vm.stackTop = slots;
+
+      // The exception becomes the catch variable
+      push(vm.exception);
+      vm.exception = NIL_VAL;
+      frame->ip = chunk->code + handler->handler;
+      return true;
+    }
+
+    // A memoized call that throws has no result to cache
+    if (frame->memoEntry != NULL) {
+      memoAbandon(AS_MEMO(frame->slots[0]), frame->memoEntry);
+    }
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+    vm.stackTop = frame->slots;
+  }
+  return false;
+}
+
+// Executes bytecode until the frame count drops back to exitFrame, i.e.
+// until the function that was called at that depth returns. Its return
+// value is left at the top of the stack.
+static InterpretResult run(int exitFrame) {
   // Storing the current frame in a local variable will encourage
   // the C compiler to store this pointer in a register
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
@@ -319,7 +580,8 @@ static InterpretResult run() {
   #define READ_BYTE() (*frame->ip++)
 
   // Return the next instruction as a constant (and advance the IP)
-  #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  #define READ_CONSTANT() \
+      (REF_PTR(ObjFunction, frame->closure->function)->chunk.constants.values[READ_BYTE()])
 
   // Takes the next two bytes and constructs a 16bit unsigned int
   #define READ_SHORT() \
@@ -334,7 +596,7 @@ static InterpretResult run() {
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
         runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+        goto exceptionThrown; \
       } \
       double b = AS_NUMBER(pop()); \
       double a = AS_NUMBER(pop()); \
@@ -357,7 +619,8 @@ static InterpretResult run() {
     // By doing pointer arithmetic between the ptr to the next instruction
     // and the start of the instruction array, we get the offset of the 
     // next instruction to be executed
-    disassembleInstruction(&frame->closure->function->chunk, (int) (frame->ip - frame->closure->function->chunk.code));
+    disassembleInstruction(&REF_PTR(ObjFunction, frame->closure->function)->chunk,
+        (int) (frame->ip - REF_PTR(ObjFunction, frame->closure->function)->chunk.code));
 #endif
 
     uint8_t instruction;
@@ -390,7 +653,7 @@ static InterpretResult run() {
         Value value;
         if (!tableGet(&vm.globals, name, &value)) {
           runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
         push(value);
         break;
@@ -398,6 +661,7 @@ static InterpretResult run() {
       case OP_DEFINE_GLOBAL: {
         ObjString* name = READ_STRING();
         tableSet(&vm.globals, name, peek(0));
+        noteGlobalChange(name);
         pop();
         break;
       }
@@ -412,8 +676,9 @@ static InterpretResult run() {
         if (tableSet(&vm.globals, name, peek(0))) {
           tableDelete(&vm.globals, name);
           runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
+        noteGlobalChange(name);
         break;
       }
       case OP_SET_LOCAL: {
@@ -425,20 +690,25 @@ static InterpretResult run() {
       }
       case OP_GET_UPVALUE: {
                              uint8_t slot = READ_BYTE();
-                             push(*frame->closure->upvalues[slot]->location);
+                             push(*REF_PTR(ObjUpvalue, frame->closure->upvalues[slot])->location);
                              break;
                            }
       case OP_SET_UPVALUE: {
                              uint8_t slot = READ_BYTE();
-                             *frame->closure->upvalues[slot]->location = peek(0);
+                             *REF_PTR(ObjUpvalue, frame->closure->upvalues[slot])->location = peek(0);
                              break;
                            }
       case OP_GET_SUPER: {
                            ObjString* name = READ_STRING();
+                           if (!IS_CLASS(peek(0))) {
+                             runtimeError("Superclass must be a class.");
+                             goto exceptionThrown;
+                           }
                            ObjClass* superclass = AS_CLASS(pop());
                            if (!bindMethod(superclass, name)) {
-                             return INTERPRET_RUNTIME_ERROR;
+                             goto exceptionThrown;
                            }
+                           break;
                          }
       case OP_EQUAL: {
         Value b = pop();
@@ -447,10 +717,24 @@ static InterpretResult run() {
         break;
       }
       case OP_GET_PROPERTY: {
+        if (IS_RECORD(peek(0))) {
+          ObjRecord* record = AS_RECORD(peek(0));
+          ObjString* name = READ_STRING();
+          int field = recordFieldIndex(REF_PTR(ObjRecordType, record->type), name);
+          if (field == -1) {
+            runtimeError("Undefined property '%s'.", name->chars);
+            goto exceptionThrown;
+          }
+
+          pop(); // Pop the record
+          push(record->fields[field]);
+          break;
+        }
+
         // Instance should be at the top of stack when processing this OP 
         if (!IS_INSTANCE(peek(0))) {
           runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(0));
@@ -465,16 +749,21 @@ static InterpretResult run() {
 
         // If what we are trying to access is neither a property
         // or a method, we should throw an error
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
+        if (!bindMethod(REF_PTR(ObjClass, instance->klass), name)) {
+          goto exceptionThrown;
         }
         break;
       }
       case OP_SET_PROPERTY: { 
         // Top of the stack is the value followed by the instance 
+        if (IS_RECORD(peek(1))) {
+          runtimeError("Records are immutable.");
+          goto exceptionThrown;
+        }
+
         if (!IS_INSTANCE(peek(1))) {
           runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(1));
@@ -500,7 +789,7 @@ static InterpretResult run() {
           push(NUMBER_VAL(a + b));
         } else {
           runtimeError("Operands must be two numbers or two strings");
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
         break;
       } 
@@ -511,7 +800,7 @@ static InterpretResult run() {
       case OP_NEGATE: 
         if (!IS_NUMBER(peek(0))) {
           runtimeError("Operand must be a number");
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
         push(NUMBER_VAL(-AS_NUMBER(pop())));
         break;
@@ -538,18 +827,48 @@ static InterpretResult run() {
       case OP_CALL :{
         int argCount = READ_BYTE();
         if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
         // On a successful function call, there will be a new frame
         // for the called function
         frame = &vm.frames[vm.frameCount - 1];
         break;
       }
+      case OP_INTRINSIC: {
+        Intrinsic intrinsic = (Intrinsic)READ_BYTE();
+        int argCount = READ_BYTE();
+        int arity = intrinsicArity(intrinsic);
+        Value* args = vm.stackTop - argCount;
+        if (!(vm.redefinedIntrinsics & (1u << intrinsic)) && argCount == arity &&
+            IS_NUMBER(args[0]) && (arity == 1 || IS_NUMBER(args[1]))) {
+          double b = arity == 2 ? AS_NUMBER(args[1]) : 0;
+          args[0] = NUMBER_VAL(applyIntrinsic(intrinsic, AS_NUMBER(args[0]), b));
+          vm.stackTop = args + 1;
+          break;
+        }
+
+        // Anything else is a regular call to the global, which has to go
+        // below the arguments
+        ObjString* name = vm.intrinsicNames[intrinsic];
+        Value callee;
+        if (!tableGet(&vm.globals, name, &callee)) {
+          runtimeError("Undefined variable '%s'.", name->chars);
+          goto exceptionThrown;
+        }
+        memmove(args + 1, args, sizeof(Value) * argCount);
+        args[0] = callee;
+        vm.stackTop++;
+        if (!callValue(callee, argCount)) {
+          goto exceptionThrown;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        break;
+      }
       case OP_INVOKE: { 
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
         if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
         // On a successful function call, there will be a new frame
         // for the called function
@@ -559,9 +878,13 @@ static InterpretResult run() {
       case OP_SUPER_INVOKE: {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
+        if (!IS_CLASS(peek(0))) {
+          runtimeError("Superclass must be a class.");
+          goto exceptionThrown;
+        }
         ObjClass* superclass = AS_CLASS(pop());
         if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
         }
         frame = &vm.frames[vm.frameCount - 1];
         break;
@@ -575,7 +898,7 @@ static InterpretResult run() {
           uint8_t isLocal = READ_BYTE();
           uint8_t index = READ_BYTE();
           if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+            closure->upvalues[i] = PTR_REF(captureUpvalue(frame->slots + index));
           } else {
             // To note here that while we are still in the middle of defining
             // this function, the current function in the frame is referring
@@ -590,6 +913,11 @@ static InterpretResult run() {
         pop();
         break;
       case OP_RETURN: {
+        if (frame->memoEntry != NULL) {
+          // Still on the stack, since caching it can trigger a GC
+          memoComplete(AS_MEMO(frame->slots[0]), frame->memoEntry, peek(0));
+        }
+
         // Function always returns a value, now that we intend to discard
         // the function's entire stack window, we pop the return value
         Value result = pop();
@@ -598,16 +926,16 @@ static InterpretResult run() {
         closeUpvalues(frame->slots);
 
         vm.frameCount--;
-        // If we are done interpreting everything
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
 
         // Discard all slots that the callee was using for its parameters
         vm.stackTop = frame->slots;
         // Push the return value to the top of the stack
         push(result);
+
+        // If we are done interpreting everything, or the function
+        // that a native called into has returned
+        if (vm.frameCount == exitFrame) return INTERPRET_OK;
+
         frame = &vm.frames[vm.frameCount - 1];
         break;
       }
@@ -619,7 +947,13 @@ static InterpretResult run() {
         
         if (!IS_CLASS(superclass)) {
           runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+          goto exceptionThrown;
+        }
+        // Only bytecode that was not written by the compiler can get
+        // here with anything else
+        if (!IS_CLASS(peek(0))) {
+          runtimeError("Methods can only be added to classes.");
+          goto exceptionThrown;
         }
 
         ObjClass* subclass = AS_CLASS(peek(0));
@@ -629,9 +963,22 @@ static InterpretResult run() {
         break;
       }
       case OP_METHOD:
+        if (!IS_CLASS(peek(1))) {
+          runtimeError("Methods can only be added to classes.");
+          goto exceptionThrown;
+        }
         defineMethod(READ_STRING());
         break;
+      case OP_THROW:
+        throwException(pop());
+        goto exceptionThrown;
     }
+    continue;
+
+exceptionThrown:
+    // The exception has already been reported if nothing catches it
+    if (!catchException(exitFrame)) return INTERPRET_RUNTIME_ERROR;
+    frame = &vm.frames[vm.frameCount - 1];
   }
   #undef READ_BYTE
   #undef READ_SHORT
@@ -641,9 +988,19 @@ static InterpretResult run() {
 }
 
 InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
+  ObjFunction* function = compileSnippet(&vm.snippets, source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretCompiled(function);
+}
+
+void setSnippetCacheSize(int size) {
+  freeSnippetCache(&vm.snippets);
+  // The cache relies on its capacity to tell whether it is in use
+  initSnippetCache(&vm.snippets, size < 0 ? 0 : size);
+}
+
+InterpretResult interpretCompiled(ObjFunction* function) {
   // This is why the compiler reserves the first local slot for its
   // internal use, i.e. to store the implicit top level function
   push(OBJ_VAL(function));
@@ -651,7 +1008,43 @@ InterpretResult interpret(const char* source) {
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
-  callValue(OBJ_VAL(closure), 0);
-  
-  return run();
+  // A script that needs more stack than there is never starts running
+  if (!callValue(OBJ_VAL(closure), 0)) {
+    resetStack();
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  InterpretResult result = run(0);
+  if (result == INTERPRET_OK) {
+    // Discard the return value of the top level function
+    pop();
+  } else if (result == INTERPRET_RUNTIME_ERROR) {
+    resetStack();
+    vm.exception = NIL_VAL;
+  }
+  return result;
+}
+
+bool callFunction(Value callee, int argCount, Value* args, Value* result) {
+  int exitFrame = vm.frameCount;
+
+  push(callee);
+  for (int i = 0; i < argCount; i++) {
+    push(args[i]);
+  }
+
+  // Natives and classes without initializers complete right away,
+  // everything else gets a new frame that we run to completion in a
+  // nested invocation of the interpreter loop
+  if (!callValue(callee, argCount) ||
+      (vm.frameCount > exitFrame && run(exitFrame) != INTERPRET_OK)) {
+    // The exception was not caught by the nested call, the native that
+    // called us is responsible for failing in turn so that the frames
+    // below it get a chance to catch it
+    vm.nativeFailed = true;
+    return false;
+  }
+
+  *result = pop();
+  return true;
 }
@@ -1,12 +1,19 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "intern.h"
+#include "intrinsic.h"
+#include "memory.h"
 #include "object.h"
+#include "snippet.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Slots that calls leave free at the top of the stack for the values
+// natives push, e.g. the arguments of a function they call back
+#define STACK_RESERVE 64
 
 // A callframe represents a single ongoing function call
 typedef struct {
@@ -19,9 +26,15 @@ typedef struct {
   // Points to the first slot in the VM's value stack that
   // this function can use
   Value *slots;
+  // Set when this call was made through a memoized function on a cache
+  // miss, the result is stored in this entry once the call returns
+  MemoEntry* memoEntry;
 } CallFrame;
 
 typedef struct {
+  // Hooks through which all memory of the VM is obtained
+  Allocator allocator;
+
   CallFrame frames[FRAMES_MAX];
   // Current height of the CallFrame stack, i.e. the number
   // of ongoing function calls
@@ -35,9 +48,12 @@ typedef struct {
 
   // Table of global variable names and values
   Table globals;
+  // The globals as initVM() left them, i.e. the natives, which
+  // resetVM() restores
+  Table baseGlobals;
 
-  // A hash table to keep track of all interned strings
-  Table strings;
+  // Set of all interned strings
+  InternTable strings;
   
   // Interned string for the init keyword for classes
   ObjString* initString;
@@ -49,6 +65,10 @@ typedef struct {
   size_t bytesAllocated;
   // Threshold of memory allocation before next GC is necessary
   size_t nextGC;
+  // Running totals that never go down, so that benchmarks can tell how
+  // much the code they measure allocates
+  size_t objectsAllocated;
+  size_t bytesRequested;
 
   // Head of a linked list of all objects allocated
   Obj* objects;
@@ -57,6 +77,27 @@ typedef struct {
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+
+  // Weak references and weak maps reached during the ongoing GC
+  ObjWeakRef* weakRefs;
+  ObjWeakMap* weakMaps;
+
+  // Set when a native reports an error through nativeError()
+  bool nativeFailed;
+
+  // Exception that is being thrown, while the frames are unwound in
+  // search of a handler for it
+  Value exception;
+
+  // Names of the globals that hold the math intrinsics, and a bit for
+  // each one whose global has been defined or assigned since, after
+  // which OP_INTRINSIC calls whatever the global holds instead
+  ObjString* intrinsicNames[INTRINSIC_COUNT];
+  uint32_t redefinedIntrinsics;
+
+  // Functions compiled by interpret(), so that running the same source
+  // again skips the scanner and the compiler
+  SnippetCache snippets;
 } VM;
 
 // Compiler reports static errors and VM detects runtime errors
@@ -68,13 +109,46 @@ typedef enum {
 
 extern VM vm;
 
-void initVM();
+// The allocator can be NULL, in which case the VM uses the
+// defaultAllocator, i.e. the C standard library
+void initVM(const Allocator* allocator);
 void freeVM();
+// Brings the VM back to the state initVM() left it in, for a lot less
+// than freeing it and initializing it again. Everything that scripts
+// created is freed, while the memory of the stack and the tables, the
+// natives and the compiled snippets are kept.
+void resetVM();
 InterpretResult interpret(const char* source);
-
-// Value stack operations
+// Sets how many compiled sources interpret() keeps, zero (or less) turns
+// caching off. Empties the cache.
+void setSnippetCacheSize(int size);
+// Runs a top level function that was compiled earlier
+InterpretResult interpretCompiled(ObjFunction* function);
+
+// Makes a native function available as a global variable, an arity
+// of -1 lets the native accept any number of arguments
+ObjNative* defineNative(const char* name, NativeFn function, int arity);
+// Calls any callable Lox value from inside a native, storing what it
+// returns in the result param.
+//
+// Returns false if the call failed with a runtime error. The error has
+// already been reported at that point and the native has to return
+// right away, the VM then propagates the error to its caller. Note that
+// the result is not on the stack anymore and so has to be pushed if the
+// native allocates anything while it is still using the result.
+bool callFunction(Value callee, int argCount, Value* args, Value* result);
+// Called by natives to report a runtime error, e.g. when they are given
+// arguments of the wrong type. The native is expected to return right
+// after, the error is raised once control is back in the VM.
+Value nativeError(const char* format, ...);
+
+// Value stack operations, natives can use these as scratch space for
+// values that need to be kept alive, as long as they leave the stack
+// the way that they found it
 void push(Value value);
 Value pop();
 
+bool isFalsey(Value value);
+
 #endif
 
@@ -0,0 +1,225 @@
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+#include "weak.h"
+
+#define WEAK_MAP_MAX_LOAD 0.75
+
+// Same probing scheme as findEntry() in table.c. Keys are matched by
+// identity, so they are hashed by identity too: vectors and hash maps
+// hash by content, which a transient changes in place.
+static WeakEntry* findWeakEntry(WeakEntry* entries, int capacity, Obj* key) {
+  uint32_t index = hashAddress(key) % capacity;
+  OBJ_REF(Obj) ref = PTR_REF(key);
+  WeakEntry* tombstone = NULL;
+
+  for (;;) {
+    WeakEntry* entry = &entries[index];
+
+    if (entry->key == NULL_REF) {
+      if (IS_NIL(weakEntryValue(entry))) {
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        if (tombstone == NULL) tombstone = entry;
+      }
+    } else if (entry->key == ref) {
+      return entry;
+    }
+
+    index = (index + 1) % capacity;
+  }
+}
+
+bool weakMapGet(ObjWeakMap* map, Obj* key, Value* value) {
+  if (map->count == 0) return false;
+
+  WeakEntry* entry = findWeakEntry(map->entries, map->capacity, key);
+  if (entry->key == NULL_REF) return false;
+
+  *value = weakEntryValue(entry);
+  return true;
+}
+
+static void adjustCapacity(ObjWeakMap* map, int capacity) {
+  WeakEntry* entries = ALLOCATE(WeakEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NULL_REF;
+    setWeakEntryValue(&entries[i], NIL_VAL);
+  }
+
+  // Tombstones are not copied over, so the entries are recounted
+  map->count = 0;
+  for (int i = 0; i < map->capacity; i++) {
+    WeakEntry* entry = &map->entries[i];
+    if (entry->key == NULL_REF) continue;
+
+    WeakEntry* dest = findWeakEntry(entries, capacity, REF_PTR(Obj, entry->key));
+    *dest = *entry;
+    map->count++;
+  }
+
+  FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+  map->entries = entries;
+  map->capacity = capacity;
+}
+
+bool weakMapSet(ObjWeakMap* map, Obj* key, Value value) {
+  if (map->count + 1 > map->capacity * WEAK_MAP_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(map->capacity);
+    adjustCapacity(map, capacity);
+  }
+
+  WeakEntry* entry = findWeakEntry(map->entries, map->capacity, key);
+
+  bool isNewKey = entry->key == NULL_REF;
+  if (isNewKey && IS_NIL(weakEntryValue(entry))) map->count++;
+
+  entry->key = PTR_REF(key);
+  setWeakEntryValue(entry, value);
+  return isNewKey;
+}
+
+bool weakMapDelete(ObjWeakMap* map, Obj* key) {
+  if (map->count == 0) return false;
+
+  WeakEntry* entry = findWeakEntry(map->entries, map->capacity, key);
+  if (entry->key == NULL_REF) return false;
+
+  // Place a tombstone in the entry
+  entry->key = NULL_REF;
+  setWeakEntryValue(entry, BOOL_VAL(true));
+  return true;
+}
+
+void freeWeakMap(ObjWeakMap* map) {
+  FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+  map->entries = NULL;
+  map->count = 0;
+  map->capacity = 0;
+}
+
+void markWeakMapValues() {
+  // Marking a value can make more keys reachable, possibly keys of
+  // maps that we already went through (or maps we did not know about
+  // yet), so we keep going until a pass does not mark anything new
+  bool markedAny;
+  do {
+    markedAny = false;
+
+    for (ObjWeakMap* map = vm.weakMaps; map != NULL;
+         map = REF_PTR(ObjWeakMap, map->nextWeak)) {
+      for (int i = 0; i < map->capacity; i++) {
+        WeakEntry* entry = &map->entries[i];
+        if (entry->key == NULL_REF || !REF_PTR(Obj, entry->key)->isMarked) continue;
+
+        Value value = weakEntryValue(entry);
+        if (IS_OBJ(value) && !AS_OBJ(value)->isMarked) {
+          markValue(value);
+          markedAny = true;
+        }
+      }
+    }
+
+    traceReferences();
+  } while (markedAny);
+}
+
+void sweepWeakReferences() {
+  for (ObjWeakRef* ref = vm.weakRefs; ref != NULL;
+       ref = REF_PTR(ObjWeakRef, ref->nextWeak)) {
+    if (ref->target != NULL_REF && !REF_PTR(Obj, ref->target)->isMarked) {
+      ref->target = NULL_REF;
+    }
+  }
+
+  // This is the same thing that removeWhiteInterned() does
+  // for the table of interned strings
+  for (ObjWeakMap* map = vm.weakMaps; map != NULL;
+       map = REF_PTR(ObjWeakMap, map->nextWeak)) {
+    for (int i = 0; i < map->capacity; i++) {
+      WeakEntry* entry = &map->entries[i];
+      if (entry->key != NULL_REF && !REF_PTR(Obj, entry->key)->isMarked) {
+        // Tombstoned in place, as the key is about to be freed
+        entry->key = NULL_REF;
+        setWeakEntryValue(entry, BOOL_VAL(true));
+      }
+    }
+  }
+
+  vm.weakRefs = NULL;
+  vm.weakMaps = NULL;
+}
+
+static Value weakRefNative(int argCount, Value* args) {
+  if (!IS_OBJ(args[0])) {
+    return nativeError("Can only create weak references to objects.");
+  }
+  return OBJ_VAL(newWeakRef(AS_OBJ(args[0])));
+}
+
+// Returns the target of the reference, or nil if it has been collected
+static Value weakRefGetNative(int argCount, Value* args) {
+  if (!IS_WEAK_REF(args[0])) {
+    return nativeError("Argument must be a weak reference.");
+  }
+
+  Obj* target = REF_PTR(Obj, AS_WEAK_REF(args[0])->target);
+  return target != NULL ? OBJ_VAL(target) : NIL_VAL;
+}
+
+static Value weakMapNative(int argCount, Value* args) {
+  return OBJ_VAL(newWeakMap());
+}
+
+// Validates the map and key arguments shared by the weak map natives
+static bool checkWeakMapArgs(Value* args) {
+  if (!IS_WEAK_MAP(args[0])) {
+    nativeError("First argument must be a weak map.");
+    return false;
+  }
+  if (!IS_OBJ(args[1])) {
+    nativeError("Weak map keys must be objects.");
+    return false;
+  }
+  return true;
+}
+
+static Value weakMapGetNative(int argCount, Value* args) {
+  if (!checkWeakMapArgs(args)) return NIL_VAL;
+
+  Value value;
+  if (!weakMapGet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), &value)) {
+    return NIL_VAL;
+  }
+  return value;
+}
+
+static Value weakMapSetNative(int argCount, Value* args) {
+  if (!checkWeakMapArgs(args)) return NIL_VAL;
+
+  weakMapSet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), args[2]);
+  return args[2];
+}
+
+static Value weakMapHasNative(int argCount, Value* args) {
+  if (!checkWeakMapArgs(args)) return NIL_VAL;
+
+  Value value;
+  return BOOL_VAL(weakMapGet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), &value));
+}
+
+static Value weakMapDeleteNative(int argCount, Value* args) {
+  if (!checkWeakMapArgs(args)) return NIL_VAL;
+
+  return BOOL_VAL(weakMapDelete(AS_WEAK_MAP(args[0]), AS_OBJ(args[1])));
+}
+
+void defineWeakNatives() {
+  defineNative("weakRef", weakRefNative, 1);
+  defineNative("weakRefGet", weakRefGetNative, 1);
+  defineNative("weakMap", weakMapNative, 0);
+  defineNative("weakMapGet", weakMapGetNative, 2);
+  defineNative("weakMapSet", weakMapSetNative, 3);
+  defineNative("weakMapHas", weakMapHasNative, 2);
+  defineNative("weakMapDelete", weakMapDeleteNative, 2);
+}
@@ -0,0 +1,24 @@
+#ifndef clox_weak_h
+#define clox_weak_h
+
+#include "object.h"
+
+// Returns true if found, storing the result in the value param
+bool weakMapGet(ObjWeakMap* map, Obj* key, Value* value);
+// Returns true if a new entry was added, false if there
+// was instead an overwrite
+bool weakMapSet(ObjWeakMap* map, Obj* key, Value value);
+bool weakMapDelete(ObjWeakMap* map, Obj* key);
+void freeWeakMap(ObjWeakMap* map);
+
+// Called by the GC once tracing is otherwise complete, marks the values
+// of weak map entries whose keys turned out to be reachable (tracing
+// anything that this makes reachable in turn)
+void markWeakMapValues();
+// Called by the GC right before sweeping, clears weak references to
+// unmarked objects and drops weak map entries with unmarked keys
+void sweepWeakReferences();
+
+void defineWeakNatives();
+
+#endif